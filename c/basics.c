@@ -8,6 +8,8 @@ https://developers.google.com/open-source/licenses/bsd
 
 #include "basics.h"
 
+#include <pthread.h>
+
 void put_be24(uint8_t *out, uint32_t i)
 {
 	out[0] = (uint8_t)((i >> 16) & 0xff);
@@ -116,13 +118,133 @@ int names_equal(char **a, char **b)
 	return a[i] == b[i];
 }
 
-int common_prefix_size(struct strbuf *a, struct strbuf *b)
+static size_t common_prefix_bytewise(const uint8_t *a, const uint8_t *b,
+				     size_t n)
+{
+	size_t i = 0;
+	while (i < n && a[i] == b[i])
+		i++;
+	return i;
+}
+
+/* compares 8 bytes at a time, and finds the mismatch within the word
+ * bytewise, so it doesn't depend on the byte order. */
+static size_t common_prefix_word(const uint8_t *a, const uint8_t *b, size_t n)
 {
-	int p = 0;
-	for (; p < a->len && p < b->len; p++) {
-		if (a->buf[p] != b->buf[p])
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t x = 0;
+		uint64_t y = 0;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y)
 			break;
 	}
+	return i + common_prefix_bytewise(a + i, b + i, n - i);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+
+/* SSE2 is part of x86-64, so this one needs no check. */
+static size_t common_prefix_sse2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if (eq != 0xffff)
+			return i + __builtin_ctz(~eq);
+	}
+	return i + common_prefix_word(a + i, b + i, n - i);
+}
 
-	return p;
+__attribute__((target("avx2"))) static size_t
+common_prefix_avx2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		unsigned eq = (unsigned)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(x, y));
+		if (eq != 0xffffffff)
+			return i + __builtin_ctz(~eq);
+	}
+	/* not common_prefix_sse2: mixing its legacy SSE encoding with AVX is
+	 * slow. */
+	if (i + 16 <= n) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if (eq != 0xffff)
+			return i + __builtin_ctz(~eq);
+		i += 16;
+	}
+	return i + common_prefix_word(a + i, b + i, n - i);
+}
+
+static const struct prefix_kernel all_prefix_kernels[] = {
+	{ "bytewise", &common_prefix_bytewise },
+	{ "word", &common_prefix_word },
+	{ "sse2", &common_prefix_sse2 },
+	{ "avx2", &common_prefix_avx2 },
+	{ NULL, NULL },
+};
+
+static int prefix_kernel_supported(const struct prefix_kernel *k)
+{
+	__builtin_cpu_init();
+	return strcmp(k->name, "avx2") || __builtin_cpu_supports("avx2");
+}
+#else
+static const struct prefix_kernel all_prefix_kernels[] = {
+	{ "bytewise", &common_prefix_bytewise },
+	{ "word", &common_prefix_word },
+	{ NULL, NULL },
+};
+
+static int prefix_kernel_supported(const struct prefix_kernel *k)
+{
+	return 1;
+}
+#endif
+
+/* Filled in once by prefix_kernels_init; the unused tail stays zeroed, so the
+ * list is always terminated. */
+static struct prefix_kernel usable_prefix_kernels[ARRAY_SIZE(
+	all_prefix_kernels)];
+static size_t (*common_prefix_fn)(const uint8_t *a, const uint8_t *b,
+				  size_t n);
+static pthread_once_t prefix_kernels_once = PTHREAD_ONCE_INIT;
+
+static void prefix_kernels_init(void)
+{
+	size_t i = 0;
+	size_t n = 0;
+	for (i = 0; all_prefix_kernels[i].name != NULL; i++) {
+		if (prefix_kernel_supported(&all_prefix_kernels[i]))
+			usable_prefix_kernels[n++] = all_prefix_kernels[i];
+	}
+	common_prefix_fn = usable_prefix_kernels[n - 1].fn;
+}
+
+const struct prefix_kernel *prefix_kernels(void)
+{
+	pthread_once(&prefix_kernels_once, &prefix_kernels_init);
+	return usable_prefix_kernels;
+}
+
+size_t common_prefix_len(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	pthread_once(&prefix_kernels_once, &prefix_kernels_init);
+	return common_prefix_fn(a, b, n);
+}
+
+int common_prefix_size(struct strbuf *a, struct strbuf *b)
+{
+	size_t n = a->len < b->len ? a->len : b->len;
+	return common_prefix_len((const uint8_t *)a->buf,
+				 (const uint8_t *)b->buf, n);
 }
@@ -57,4 +57,18 @@ void *reftable_calloc(size_t sz);
 struct strbuf;
 int common_prefix_size(struct strbuf *a, struct strbuf *b);
 
+/* Returns the length of the longest shared prefix of a[0, n) and b[0, n),
+ * using the fastest kernel the CPU supports. */
+size_t common_prefix_len(const uint8_t *a, const uint8_t *b, size_t n);
+
+/* An implementation of common_prefix_len. */
+struct prefix_kernel {
+	const char *name;
+	size_t (*fn)(const uint8_t *a, const uint8_t *b, size_t n);
+};
+
+/* Returns the kernels this CPU can run, slowest first, terminated by an entry
+ * with a NULL name. For tests and benchmarks. */
+const struct prefix_kernel *prefix_kernels(void);
+
 #endif
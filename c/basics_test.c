@@ -87,9 +87,39 @@ static void test_common_prefix(void)
 	strbuf_release(&s2);
 }
 
+static void test_prefix_kernels(void)
+{
+	const struct prefix_kernel *k = prefix_kernels();
+	uint8_t a[100];
+	uint8_t b[100];
+	int kernels = 0;
+	int n = 0;
+	int diff = 0;
+
+	for (n = 0; n < sizeof(a); n++)
+		a[n] = (uint8_t)(n * 7);
+
+	for (; k->name != NULL; k++) {
+		kernels++;
+		for (n = 0; n <= sizeof(a); n++) {
+			for (diff = 0; diff <= n; diff++) {
+				/* b differs from a at `diff`, and in its
+				 * highest bit only. */
+				memcpy(b, a, sizeof(a));
+				if (diff < n)
+					b[diff] ^= 0x80;
+				EXPECT(k->fn(a, b, n) == diff);
+				EXPECT(common_prefix_len(a, b, n) == diff);
+			}
+		}
+	}
+	EXPECT(kernels >= 2);
+}
+
 int basics_test_main(int argc, const char *argv[])
 {
 	test_common_prefix();
+	test_prefix_kernels();
 	test_parse_names_normal();
 	test_parse_names_drop_empty();
 	test_binsearch();
@@ -0,0 +1,207 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "system.h"
+
+#include <time.h>
+
+#include "basics.h"
+#include "record.h"
+#include "reftable-tests.h"
+
+/* Microbenchmarks for the kernels on the innermost loops of seeking, merging
+ * and writing. Each prints its throughput in MB/s of input processed. */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, double secs)
+{
+	printf("%-28s %10.1f MB/s\n", name, bytes / secs / 1e6);
+}
+
+#define KEY_COUNT 4096
+#define KEY_ROUNDS 500
+
+/* sorted ref names, as found in a ref block. */
+static void make_keys(struct strbuf *keys)
+{
+	int i = 0;
+	for (i = 0; i < KEY_COUNT; i++) {
+		char name[100];
+		snprintf(name, sizeof(name),
+			 "refs/remotes/origin/feature/team-%02d/topic-%06d",
+			 i / 64, i * 7);
+		strbuf_init(&keys[i], 0);
+		strbuf_addstr(&keys[i], name);
+	}
+}
+
+static void bench_prefix_kernels(struct strbuf *keys)
+{
+	const struct prefix_kernel *k = prefix_kernels();
+	static uint8_t a[1 << 16];
+	static uint8_t b[1 << 16];
+	size_t sink = 0;
+
+	memset(a, 'x', sizeof(a));
+	memset(b, 'x', sizeof(b));
+	for (; k->name != NULL; k++) {
+		char name[64];
+		size_t bytes = 0;
+		double start = now();
+		int r = 0;
+		int i = 0;
+		for (r = 0; r < KEY_ROUNDS; r++) {
+			for (i = 1; i < KEY_COUNT; i++) {
+				size_t n = keys[i].len < keys[i - 1].len ?
+						   keys[i].len :
+						   keys[i - 1].len;
+				sink += k->fn((uint8_t *)keys[i - 1].buf,
+					      (uint8_t *)keys[i].buf, n);
+				bytes += n;
+			}
+		}
+		snprintf(name, sizeof(name), "prefix/%s/keys", k->name);
+		report(name, bytes, now() - start);
+
+		bytes = 0;
+		start = now();
+		for (r = 0; r < 2000; r++) {
+			sink += k->fn(a, b, sizeof(a));
+			bytes += sizeof(a);
+		}
+		snprintf(name, sizeof(name), "prefix/%s/64k", k->name);
+		report(name, bytes, now() - start);
+	}
+	if (sink == 0)
+		printf("unexpected\n");
+}
+
+static void bench_strbuf_cmp(struct strbuf *keys)
+{
+	size_t bytes = 0;
+	double start = now();
+	int sink = 0;
+	int r = 0;
+	int i = 0;
+	for (r = 0; r < KEY_ROUNDS; r++) {
+		for (i = 1; i < KEY_COUNT; i++) {
+			sink += strbuf_cmp(&keys[i - 1], &keys[i]);
+			bytes += keys[i].len;
+		}
+	}
+	report("strbuf_cmp/keys", bytes, now() - start);
+	if (sink == 0)
+		printf("unexpected\n");
+}
+
+static void bench_varint(void)
+{
+	static uint8_t buf[1 << 20];
+	struct string_view out = { buf, sizeof(buf) };
+	struct string_view in = { NULL };
+	uint64_t sink = 0;
+	size_t len = 0;
+	double start = 0;
+	int r = 0;
+	uint64_t i = 0;
+
+	/* mostly small values, like prefix and suffix lengths. */
+	for (i = 0; out.len >= 10; i++) {
+		uint64_t val = (i % 16 == 0) ? i * 1000 : i % 300;
+		int n = put_var_int(&out, val);
+		string_view_consume(&out, n);
+	}
+	len = sizeof(buf) - out.len;
+
+	start = now();
+	for (r = 0; r < 50; r++) {
+		out.buf = buf;
+		out.len = sizeof(buf);
+		for (i = 0; out.len >= 10; i++) {
+			uint64_t val = (i % 16 == 0) ? i * 1000 : i % 300;
+			int n = put_var_int(&out, val);
+			string_view_consume(&out, n);
+		}
+	}
+	report("put_var_int", 50 * len, now() - start);
+
+	start = now();
+	for (r = 0; r < 50; r++) {
+		in.buf = buf;
+		in.len = len;
+		while (in.len > 0) {
+			uint64_t val = 0;
+			int n = get_var_int(&val, &in);
+			sink += val;
+			string_view_consume(&in, n);
+		}
+	}
+	report("get_var_int", 50 * len, now() - start);
+	if (sink == 0)
+		printf("unexpected\n");
+}
+
+static void bench_decode_key(struct strbuf *keys)
+{
+	static uint8_t buf[1 << 20];
+	struct string_view out = { buf, sizeof(buf) };
+	struct strbuf key = STRBUF_INIT;
+	struct strbuf last = STRBUF_INIT;
+	size_t len = 0;
+	double start = 0;
+	int r = 0;
+	int i = 0;
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		int restart = 0;
+		int n = reftable_encode_key(&restart, out,
+					    i > 0 ? keys[i - 1] : last,
+					    keys[i], 1);
+		string_view_consume(&out, n);
+	}
+	len = sizeof(buf) - out.len;
+
+	start = now();
+	for (r = 0; r < KEY_ROUNDS; r++) {
+		struct string_view in = { buf, len };
+		strbuf_reset(&last);
+		while (in.len > 0) {
+			uint8_t extra = 0;
+			int n = reftable_decode_key(&key, &extra, last, in);
+			string_view_consume(&in, n);
+			SWAP(key, last);
+		}
+	}
+	report("reftable_decode_key", KEY_ROUNDS * len, now() - start);
+	strbuf_release(&key);
+	strbuf_release(&last);
+}
+
+int reftable_bench_main(int argc, const char *argv[])
+{
+	struct strbuf *keys =
+		reftable_calloc(sizeof(struct strbuf) * KEY_COUNT);
+	int i = 0;
+
+	make_keys(keys);
+	bench_prefix_kernels(keys);
+	bench_strbuf_cmp(keys);
+	bench_varint();
+	bench_decode_key(keys);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		strbuf_release(&keys[i]);
+	reftable_free(keys);
+	return 0;
+}
@@ -37,8 +37,286 @@ int footer_size(int version)
 	abort();
 }
 
+/* Dictionary entries are path components (including their trailing '/') of
+ * this many bytes. */
+#define DICT_MIN_LEN 3
+#define DICT_MAX_LEN 255
+/* each entry is varint(length) followed by the bytes. */
+#define DICT_MAX_BYTES (MAX_DICT_ENTRIES * (2 + DICT_MAX_LEN))
+
+/* the trailer of a columnar block: the offset of the types, the number of
+ * records, values and targets (3 bytes each), and the update index width. */
+#define COLUMNS_TRAILER_SIZE 13
+
+static int update_index_width(uint64_t max)
+{
+	if (max == 0)
+		return 0;
+	if (max <= 0xff)
+		return 1;
+	if (max <= 0xffff)
+		return 2;
+	if (max <= 0xffffffff)
+		return 4;
+	return 8;
+}
+
+static void put_be_width(uint8_t *out, uint64_t val, int width)
+{
+	int i = 0;
+	for (i = width - 1; i >= 0; i--) {
+		out[i] = (uint8_t)(val & 0xff);
+		val >>= 8;
+	}
+}
+
+static uint64_t get_be_width(uint8_t *in, int width)
+{
+	uint64_t val = 0;
+	int i = 0;
+	for (i = 0; i < width; i++)
+		val = (val << 8) | in[i];
+	return val;
+}
+
+static uint32_t block_columns_size(struct block_columns *c, int restarts)
+{
+	return c->len * (1 + update_index_width(c->max_update_index)) +
+	       c->values.len + c->targets.len + c->symrefs.len +
+	       3 * restarts + COLUMNS_TRAILER_SIZE;
+}
+
+/* returns how much adding `ref` grows the columns. */
+static uint32_t block_columns_growth(struct block_columns *c,
+				     struct reftable_ref_record *ref,
+				     int hash_size)
+{
+	uint64_t max = c->max_update_index;
+	uint32_t growth = 0;
+	uint8_t varint[10];
+	struct string_view dest = { varint, sizeof(varint) };
+	if (ref->update_index > max)
+		max = ref->update_index;
+
+	growth = (c->len + 1) * (1 + update_index_width(max)) -
+		 c->len * (1 + update_index_width(c->max_update_index));
+	switch (ref->value_type) {
+	case REFTABLE_REF_VAL1:
+		growth += hash_size;
+		break;
+	case REFTABLE_REF_VAL2:
+		growth += 2 * hash_size;
+		break;
+	case REFTABLE_REF_SYMREF:
+		growth += strlen(ref->value.symref);
+		growth += put_var_int(&dest, strlen(ref->value.symref));
+		break;
+	case REFTABLE_REF_DELETION:
+		break;
+	}
+	return growth;
+}
+
+static void block_columns_add(struct block_columns *c,
+			      struct reftable_ref_record *ref, int hash_size)
+{
+	if (c->len == c->cap) {
+		c->cap = 2 * c->cap + 1;
+		c->types = reftable_realloc(c->types, c->cap);
+		c->update_indices = reftable_realloc(
+			c->update_indices, sizeof(uint64_t) * c->cap);
+	}
+	c->types[c->len] = ref->value_type;
+	c->update_indices[c->len] = ref->update_index;
+	c->len++;
+	if (ref->update_index > c->max_update_index)
+		c->max_update_index = ref->update_index;
+
+	switch (ref->value_type) {
+	case REFTABLE_REF_VAL1:
+		strbuf_add(&c->values, ref->value.val1, hash_size);
+		break;
+	case REFTABLE_REF_VAL2:
+		strbuf_add(&c->values, ref->value.val2.value, hash_size);
+		strbuf_add(&c->targets, ref->value.val2.target_value,
+			   hash_size);
+		break;
+	case REFTABLE_REF_SYMREF: {
+		uint8_t varint[10];
+		struct string_view dest = { varint, sizeof(varint) };
+		size_t len = strlen(ref->value.symref);
+		strbuf_add(&c->symrefs, varint, put_var_int(&dest, len));
+		strbuf_add(&c->symrefs, ref->value.symref, len);
+	} break;
+	case REFTABLE_REF_DELETION:
+		break;
+	}
+}
+
+/* the space the block needs after the records and restart offsets: the
+ * dictionary with its entry count and offset, or the columns with the
+ * restart record indices and the column trailer. */
+static uint32_t block_writer_trailer_size(struct block_writer *w, int restarts)
+{
+	if (w->use_dict)
+		return 1 + w->dict_bytes + 3;
+	if (w->use_columns)
+		return block_columns_size(w->columns, restarts);
+	return 0;
+}
+
+static uint8_t dict_hash(const uint8_t *buf, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i = 0;
+	for (i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 16777619u;
+	}
+	return (uint8_t)(h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24));
+}
+
+/* returns the dictionary id of `buf`, adding it if there is room, or -1. */
+static int block_writer_dict_id(struct block_writer *w, const uint8_t *buf,
+				size_t len)
+{
+	uint8_t slot = dict_hash(buf, len);
+	struct string_view dest = { NULL };
+	int id = 0;
+
+	/* the table is at most half full, so this finds an empty slot. */
+	while (w->dict_slots[slot] != 0) {
+		id = w->dict_slots[slot] - 1;
+		if (w->dict_len[id] == len &&
+		    !memcmp(w->dict + w->dict_start[id], buf, len))
+			return id;
+		slot++;
+	}
+	if (w->dict_count == MAX_DICT_ENTRIES)
+		return -1;
+
+	id = w->dict_count++;
+	dest.buf = w->dict + w->dict_bytes;
+	dest.len = DICT_MAX_BYTES - w->dict_bytes;
+	w->dict_bytes += put_var_int(&dest, len);
+	w->dict_start[id] = w->dict_bytes;
+	w->dict_len[id] = len;
+	memcpy(w->dict + w->dict_bytes, buf, len);
+	w->dict_bytes += len;
+	w->dict_slot[id] = slot;
+	w->dict_slots[slot] = id + 1;
+	return id;
+}
+
+/* drops the entries added after the dictionary had `count` entries. As they
+ * are removed newest first, the probe sequences of the others stay intact. */
+static void block_writer_dict_truncate(struct block_writer *w, int count,
+				       uint32_t bytes)
+{
+	while (w->dict_count > count) {
+		w->dict_count--;
+		w->dict_slots[w->dict_slot[w->dict_count]] = 0;
+	}
+	w->dict_bytes = bytes;
+}
+
+static int put_dict_literal(struct string_view *dest, const uint8_t *buf,
+			    size_t len)
+{
+	int n = put_var_int(dest, (uint64_t)len << 1 | 1);
+	if (n < 0)
+		return -1;
+	string_view_consume(dest, n);
+	if (dest->len < len)
+		return -1;
+	memcpy(dest->buf, buf, len);
+	string_view_consume(dest, len);
+	return 0;
+}
+
+/*
+ * Like reftable_encode_key, but the suffix is written as a count of tokens.
+ * A token is varint(id << 1) for dictionary entry `id`, or varint(len << 1 |
+ * 1) followed by `len` literal bytes. The suffix is split into path
+ * components, which are added to the dictionary on first use.
+ */
+static int block_writer_encode_dict_key(struct block_writer *w, int *restart,
+					struct string_view dest,
+					struct strbuf prev_key,
+					struct strbuf key, uint8_t extra)
+{
+	struct string_view start = dest;
+	uint8_t varint[10];
+	struct string_view varint_dest = { varint, sizeof(varint) };
+	struct string_view tokens = { NULL };
+	uint8_t *tokens_start = NULL;
+	int prefix_len = common_prefix_size(&prev_key, &key);
+	const uint8_t *p = (const uint8_t *)key.buf + prefix_len;
+	const uint8_t *end = (const uint8_t *)key.buf + key.len;
+	const uint8_t *literal = p;
+	uint64_t count = 0;
+	int reserve = 0;
+	int n = put_var_int(&dest, (uint64_t)prefix_len);
+	if (n < 0)
+		return -1;
+	string_view_consume(&dest, n);
+
+	*restart = (prefix_len == 0);
+
+	/* there are at most as many tokens as suffix bytes. Leave room for the
+	 * count, and move the tokens into place once it is known. */
+	reserve = put_var_int(&varint_dest, (uint64_t)(end - p) << 3 | 0x7);
+	if (dest.len < reserve)
+		return -1;
+	tokens = dest;
+	string_view_consume(&tokens, reserve);
+	tokens_start = tokens.buf;
+
+	while (p < end) {
+		const uint8_t *q = p;
+		int id = -1;
+		while (q < end && *q != '/')
+			q++;
+		if (q < end)
+			q++;
+
+		if (q - p >= DICT_MIN_LEN && q - p <= DICT_MAX_LEN)
+			id = block_writer_dict_id(w, p, q - p);
+		if (id >= 0) {
+			if (literal < p) {
+				if (put_dict_literal(&tokens, literal,
+						     p - literal) < 0)
+					return -1;
+				count++;
+			}
+			n = put_var_int(&tokens, (uint64_t)id << 1);
+			if (n < 0)
+				return -1;
+			string_view_consume(&tokens, n);
+			count++;
+			literal = q;
+		}
+		p = q;
+	}
+	if (literal < end) {
+		if (put_dict_literal(&tokens, literal, end - literal) < 0)
+			return -1;
+		count++;
+	}
+
+	n = put_var_int(&dest, count << 3 | (uint64_t)extra);
+	string_view_consume(&dest, n);
+	memmove(dest.buf, tokens_start, tokens.buf - tokens_start);
+	string_view_consume(&dest, tokens.buf - tokens_start);
+
+	return start.len - dest.len;
+}
+
+/* `n` is the size of the record, and `extra` the bytes it adds outside of the
+ * record area. */
 static int block_writer_register_restart(struct block_writer *w, int n,
-					 int is_restart, struct strbuf *key)
+					 uint32_t extra, int is_restart,
+					 struct strbuf *key)
 {
 	int rlen = w->restart_len;
 	if (rlen >= MAX_RESTARTS) {
@@ -48,7 +326,8 @@ static int block_writer_register_restart(struct block_writer *w, int n,
 	if (is_restart) {
 		rlen++;
 	}
-	if (2 + 3 * rlen + n > w->block_size - w->next)
+	if (2 + 3 * rlen + n + extra + block_writer_trailer_size(w, rlen) >
+	    w->block_size - w->next)
 		return -1;
 	if (is_restart) {
 		if (w->restart_len == w->restart_cap) {
@@ -56,12 +335,23 @@ static int block_writer_register_restart(struct block_writer *w, int n,
 			w->restarts = reftable_realloc(
 				w->restarts, sizeof(uint32_t) * w->restart_cap);
 		}
+		if (w->use_columns) {
+			struct block_columns *c = w->columns;
+			if (w->restart_len >= c->restart_cap) {
+				c->restart_cap = w->restart_cap;
+				c->restart_idx = reftable_realloc(
+					c->restart_idx,
+					sizeof(uint32_t) * c->restart_cap);
+			}
+			c->restart_idx[w->restart_len] = w->entries;
+		}
 
 		w->restarts[w->restart_len++] = w->next;
 	}
 
 	w->next += n;
 
+	w->shared_prefix_bytes += common_prefix_size(&w->last_key, key);
 	strbuf_reset(&w->last_key);
 	strbuf_addbuf(&w->last_key, key);
 	w->entries++;
@@ -81,11 +371,48 @@ void block_writer_init(struct block_writer *bw, uint8_t typ, uint8_t *buf,
 	bw->entries = 0;
 	bw->restart_len = 0;
 	bw->last_key.len = 0;
+	bw->shared_prefix_bytes = 0;
+	bw->use_dict = 0;
+	block_writer_dict_truncate(bw, 0, 0);
+	bw->use_columns = 0;
+}
+
+void block_writer_use_dict(struct block_writer *bw)
+{
+	assert(bw->entries == 0 &&
+	       bw->buf[bw->header_off] == BLOCK_TYPE_REF);
+	bw->buf[bw->header_off] = BLOCK_TYPE_REF_DICT;
+	bw->use_dict = 1;
+	if (bw->dict == NULL)
+		bw->dict = reftable_malloc(DICT_MAX_BYTES);
+}
+
+void block_writer_use_columns(struct block_writer *bw)
+{
+	struct block_columns *c = bw->columns;
+	assert(bw->entries == 0 &&
+	       bw->buf[bw->header_off] == BLOCK_TYPE_REF);
+	bw->buf[bw->header_off] = BLOCK_TYPE_REF_COLUMNS;
+	bw->use_columns = 1;
+	if (c == NULL) {
+		c = bw->columns = reftable_calloc(sizeof(struct block_columns));
+		strbuf_init(&c->values, 0);
+		strbuf_init(&c->targets, 0);
+		strbuf_init(&c->symrefs, 0);
+	}
+	c->len = 0;
+	c->max_update_index = 0;
+	strbuf_reset(&c->values);
+	strbuf_reset(&c->targets);
+	strbuf_reset(&c->symrefs);
 }
 
 uint8_t block_writer_type(struct block_writer *bw)
 {
-	return bw->buf[bw->header_off];
+	uint8_t typ = bw->buf[bw->header_off];
+	if (typ == BLOCK_TYPE_REF_DICT || typ == BLOCK_TYPE_REF_COLUMNS)
+		return BLOCK_TYPE_REF;
+	return typ;
 }
 
 /* adds the reftable_record to the block. Returns -1 if it does not fit, 0 on
@@ -104,39 +431,113 @@ int block_writer_add(struct block_writer *w, struct reftable_record *rec)
 
 	int is_restart = 0;
 	struct strbuf key = STRBUF_INIT;
+	int dict_count = w->dict_count;
+	uint32_t dict_bytes = w->dict_bytes;
+	uint32_t extra = 0;
 	int n = 0;
 
 	reftable_record_key(rec, &key);
-	n = reftable_encode_key(&is_restart, out, last, key,
-				reftable_record_val_type(rec));
+	if (w->use_dict)
+		n = block_writer_encode_dict_key(w, &is_restart, out, last, key,
+						 reftable_record_val_type(rec));
+	else
+		n = reftable_encode_key(&is_restart, out, last, key,
+					reftable_record_val_type(rec));
 	if (n < 0)
 		goto done;
 	string_view_consume(&out, n);
 
-	n = reftable_record_encode(rec, out, w->hash_size);
-	if (n < 0)
-		goto done;
-	string_view_consume(&out, n);
+	if (w->use_columns) {
+		/* the value goes into the columns. */
+		assert(reftable_record_type(rec) == BLOCK_TYPE_REF);
+		extra = block_columns_growth(w->columns, rec->data,
+					     w->hash_size);
+	} else {
+		n = reftable_record_encode(rec, out, w->hash_size);
+		if (n < 0)
+			goto done;
+		string_view_consume(&out, n);
+	}
 
-	if (block_writer_register_restart(w, start.len - out.len, is_restart,
-					  &key) < 0)
+	if (block_writer_register_restart(w, start.len - out.len, extra,
+					  is_restart, &key) < 0)
 		goto done;
+	if (w->use_columns)
+		block_columns_add(w->columns, rec->data, w->hash_size);
 
 	strbuf_release(&key);
 	return 0;
 
 done:
+	block_writer_dict_truncate(w, dict_count, dict_bytes);
 	strbuf_release(&key);
 	return -1;
 }
 
+static void block_writer_write_columns(struct block_writer *w)
+{
+	struct block_columns *c = w->columns;
+	int width = update_index_width(c->max_update_index);
+	uint32_t i = 0;
+
+	memcpy(w->buf + w->next, c->types, c->len);
+	w->next += c->len;
+	for (i = 0; i < c->len; i++) {
+		put_be_width(w->buf + w->next, c->update_indices[i], width);
+		w->next += width;
+	}
+	memcpy(w->buf + w->next, c->values.buf, c->values.len);
+	w->next += c->values.len;
+	memcpy(w->buf + w->next, c->targets.buf, c->targets.len);
+	w->next += c->targets.len;
+	memcpy(w->buf + w->next, c->symrefs.buf, c->symrefs.len);
+	w->next += c->symrefs.len;
+}
+
+static void block_writer_write_columns_trailer(struct block_writer *w,
+					       uint32_t types_off)
+{
+	struct block_columns *c = w->columns;
+	int i = 0;
+	for (i = 0; i < w->restart_len; i++) {
+		put_be24(w->buf + w->next, c->restart_idx[i]);
+		w->next += 3;
+	}
+	put_be24(w->buf + w->next, types_off);
+	put_be24(w->buf + w->next + 3, c->len);
+	put_be24(w->buf + w->next + 6, c->values.len / w->hash_size);
+	put_be24(w->buf + w->next + 9, c->targets.len / w->hash_size);
+	w->buf[w->next + 12] = update_index_width(c->max_update_index);
+	w->next += COLUMNS_TRAILER_SIZE;
+}
+
 int block_writer_finish(struct block_writer *w)
 {
+	uint32_t dict_off = w->next;
+	uint32_t types_off = w->next;
 	int i = 0;
+	if (w->use_columns)
+		block_writer_write_columns(w);
+	if (w->use_dict) {
+		struct string_view dest = {
+			.buf = w->buf + w->next,
+			.len = w->block_size - w->next,
+		};
+		w->next += put_var_int(&dest, w->dict_count);
+		memcpy(w->buf + w->next, w->dict, w->dict_bytes);
+		w->next += w->dict_bytes;
+	}
+
 	for (i = 0; i < w->restart_len; i++) {
 		put_be24(w->buf + w->next, w->restarts[i]);
 		w->next += 3;
 	}
+	if (w->use_dict) {
+		put_be24(w->buf + w->next, dict_off);
+		w->next += 3;
+	}
+	if (w->use_columns)
+		block_writer_write_columns_trailer(w, types_off);
 
 	put_be16(w->buf + w->next, w->restart_len);
 	w->next += 2;
@@ -180,7 +581,78 @@ int block_writer_finish(struct block_writer *w)
 
 uint8_t block_reader_type(struct block_reader *r)
 {
-	return r->block.data[r->header_off];
+	uint8_t typ = r->block.data[r->header_off];
+	if (typ == BLOCK_TYPE_REF_DICT || typ == BLOCK_TYPE_REF_COLUMNS)
+		return BLOCK_TYPE_REF;
+	return typ;
+}
+
+/* locates the columns of a BLOCK_TYPE_REF_COLUMNS block. They must end
+ * before `end`. */
+static int block_reader_read_columns(struct block_reader *br, uint8_t *data,
+				     uint32_t header_off, uint32_t end,
+				     uint8_t *trailer, int hash_size)
+{
+	uint32_t types_off = get_be24(trailer);
+	uint64_t off = types_off;
+	int width = trailer[12];
+
+	br->record_count = get_be24(trailer + 3);
+	br->value_count = get_be24(trailer + 6);
+	br->target_count = get_be24(trailer + 9);
+	if (width != 0 && width != 1 && width != 2 && width != 4 && width != 8)
+		return REFTABLE_FORMAT_ERROR;
+	if (types_off < header_off + 4)
+		return REFTABLE_FORMAT_ERROR;
+
+	br->types = data + off;
+	off += br->record_count;
+	br->update_indices = data + off;
+	off += (uint64_t)br->record_count * width;
+	br->values = data + off;
+	off += (uint64_t)br->value_count * hash_size;
+	br->targets = data + off;
+	off += (uint64_t)br->target_count * hash_size;
+	if (off > end)
+		return REFTABLE_FORMAT_ERROR;
+	br->symrefs = data + off;
+	br->symrefs_len = end - off;
+	br->update_index_width = width;
+	br->is_columnar = 1;
+	return 0;
+}
+
+/* reads the dictionary of a BLOCK_TYPE_REF_DICT block, stored in data[off,
+ * end). */
+static int block_reader_read_dict(struct block_reader *br, uint8_t *data,
+				  uint32_t off, uint32_t end)
+{
+	struct string_view in = {
+		.buf = data + off,
+		.len = end - off,
+	};
+	uint64_t count = 0;
+	uint64_t len = 0;
+	int i = 0;
+	int n = get_var_int(&count, &in);
+	if (n <= 0 || count > MAX_DICT_ENTRIES)
+		return REFTABLE_FORMAT_ERROR;
+	string_view_consume(&in, n);
+
+	for (i = 0; i < count; i++) {
+		n = get_var_int(&len, &in);
+		if (n <= 0)
+			return REFTABLE_FORMAT_ERROR;
+		string_view_consume(&in, n);
+		if (len > DICT_MAX_LEN || in.len < len)
+			return REFTABLE_FORMAT_ERROR;
+		br->dict_off[i] = in.buf - data;
+		br->dict_len[i] = len;
+		string_view_consume(&in, len);
+	}
+	br->dict_count = count;
+	br->is_dict = 1;
+	return 0;
 }
 
 int block_reader_init(struct block_reader *br, struct reftable_block *block,
@@ -193,6 +665,7 @@ int block_reader_init(struct block_reader *br, struct reftable_block *block,
 
 	uint16_t restart_count = 0;
 	uint32_t restart_start = 0;
+	uint32_t block_len = 0;
 	uint8_t *restart_bytes = NULL;
 
 	if (!reftable_is_block_type(typ))
@@ -240,6 +713,41 @@ int block_reader_init(struct block_reader *br, struct reftable_block *block,
 
 	restart_count = get_be16(block->data + sz - 2);
 	restart_start = sz - 2 - 3 * restart_count;
+	block_len = restart_start;
+	br->is_dict = 0;
+	br->dict_count = 0;
+	br->is_columnar = 0;
+	if (typ == BLOCK_TYPE_REF_COLUMNS) {
+		/* the restarts are followed by the record index of each
+		 * restart, and the column trailer. */
+		int err = 0;
+		uint8_t *trailer = block->data + sz - 2 - COLUMNS_TRAILER_SIZE;
+		if (2 + 6 * restart_count + COLUMNS_TRAILER_SIZE >
+		    sz - header_off - 4)
+			return REFTABLE_FORMAT_ERROR;
+		restart_start -= 3 * restart_count + COLUMNS_TRAILER_SIZE;
+		err = block_reader_read_columns(br, block->data, header_off,
+						restart_start, trailer,
+						hash_size);
+		if (err < 0)
+			return err;
+		br->restart_idx = trailer - 3 * restart_count;
+		block_len = br->types - block->data;
+	} else if (typ == BLOCK_TYPE_REF_DICT) {
+		/* the dictionary goes before the restarts, and its offset
+		 * after them. */
+		int err = 0;
+		if (2 + 3 * restart_count + 3 > sz - header_off - 4)
+			return REFTABLE_FORMAT_ERROR;
+		restart_start -= 3;
+		block_len = get_be24(block->data + sz - 5);
+		if (block_len < header_off + 4 || block_len > restart_start)
+			return REFTABLE_FORMAT_ERROR;
+		err = block_reader_read_dict(br, block->data, block_len,
+					     restart_start);
+		if (err < 0)
+			return err;
+	}
 	restart_bytes = block->data + restart_start;
 
 	/* transfer ownership. */
@@ -248,7 +756,7 @@ int block_reader_init(struct block_reader *br, struct reftable_block *block,
 	block->len = 0;
 
 	br->hash_size = hash_size;
-	br->block_len = restart_start;
+	br->block_len = block_len;
 	br->full_block_size = full_block_size;
 	br->header_off = header_off;
 	br->restart_count = restart_count;
@@ -267,6 +775,175 @@ void block_reader_start(struct block_reader *br, struct block_iter *it)
 	it->br = br;
 	strbuf_reset(&it->last_key);
 	it->next_off = br->header_off + 4;
+	it->idx = 0;
+	it->value_idx = 0;
+	it->target_idx = 0;
+	it->symref_off = 0;
+}
+
+/* moves the column positions of `it` past the current record. */
+static int block_iter_skip_columns(struct block_iter *it)
+{
+	struct block_reader *br = it->br;
+	if (it->idx >= br->record_count)
+		return -1;
+
+	switch (br->types[it->idx]) {
+	case REFTABLE_REF_DELETION:
+		break;
+	case REFTABLE_REF_VAL2:
+		if (it->target_idx >= br->target_count)
+			return -1;
+		it->target_idx++;
+		/* fallthrough */
+	case REFTABLE_REF_VAL1:
+		if (it->value_idx >= br->value_count)
+			return -1;
+		it->value_idx++;
+		break;
+	case REFTABLE_REF_SYMREF: {
+		uint64_t len = 0;
+		struct string_view in = {
+			.buf = br->symrefs + it->symref_off,
+			.len = br->symrefs_len - it->symref_off,
+		};
+		int n = get_var_int(&len, &in);
+		if (n <= 0 || in.len - n < len)
+			return -1;
+		it->symref_off += n + len;
+	} break;
+	default:
+		return -1;
+	}
+	it->idx++;
+	return 0;
+}
+
+/* fills in `rec` from the columns, and moves past the current record. */
+static int block_iter_decode_columns(struct block_iter *it, struct strbuf key,
+				     struct reftable_record *rec)
+{
+	struct block_reader *br = it->br;
+	struct reftable_ref_record *r = NULL;
+	int hash_size = br->hash_size;
+	int width = br->update_index_width;
+	uint32_t idx = it->idx;
+	uint32_t value_idx = it->value_idx;
+	uint32_t target_idx = it->target_idx;
+	uint32_t symref_off = it->symref_off;
+	if (reftable_record_type(rec) != BLOCK_TYPE_REF)
+		return -1;
+	if (block_iter_skip_columns(it) < 0)
+		return -1;
+
+	r = (struct reftable_ref_record *)rec->data;
+	reftable_ref_record_prepare(r, key.len, br->types[idx], hash_size);
+	memcpy(r->refname, key.buf, key.len);
+	r->refname[key.len] = 0;
+	r->update_index =
+		get_be_width(br->update_indices + idx * width, width);
+	switch (r->value_type) {
+	case REFTABLE_REF_VAL1:
+		memcpy(r->value.val1, br->values + value_idx * hash_size,
+		       hash_size);
+		break;
+	case REFTABLE_REF_VAL2:
+		memcpy(r->value.val2.value,
+		       br->values + value_idx * hash_size, hash_size);
+		memcpy(r->value.val2.target_value,
+		       br->targets + target_idx * hash_size, hash_size);
+		break;
+	case REFTABLE_REF_SYMREF: {
+		uint64_t len = 0;
+		struct string_view in = {
+			.buf = br->symrefs + symref_off,
+			.len = br->symrefs_len - symref_off,
+		};
+		int n = get_var_int(&len, &in);
+		r->value.symref = reftable_malloc(len + 1);
+		memcpy(r->value.symref, in.buf + n, len);
+		r->value.symref[len] = 0;
+	} break;
+	case REFTABLE_REF_DELETION:
+		break;
+	}
+	return 0;
+}
+
+/* positions `it` at restart `i`. */
+static int block_iter_seek_restart(struct block_iter *it, int i)
+{
+	struct block_reader *br = it->br;
+	uint32_t idx = 0;
+	it->next_off = block_reader_restart_offset(br, i);
+	it->idx = 0;
+	it->value_idx = 0;
+	it->target_idx = 0;
+	it->symref_off = 0;
+	if (!br->is_columnar)
+		return 0;
+
+	idx = get_be24(br->restart_idx + 3 * i);
+	if (idx > br->record_count)
+		return REFTABLE_FORMAT_ERROR;
+	while (it->idx < idx) {
+		if (block_iter_skip_columns(it) < 0)
+			return REFTABLE_FORMAT_ERROR;
+	}
+	return 0;
+}
+
+/* Like reftable_decode_key, but also decodes the keys of
+ * BLOCK_TYPE_REF_DICT blocks. */
+static int block_reader_decode_key(struct block_reader *br, struct strbuf *key,
+				   uint8_t *extra, struct strbuf last_key,
+				   struct string_view in)
+{
+	int start_len = in.len;
+	uint64_t prefix_len = 0;
+	uint64_t count = 0;
+	uint64_t tok = 0;
+	int n = 0;
+	if (!br->is_dict)
+		return reftable_decode_key(key, extra, last_key, in);
+
+	n = get_var_int(&prefix_len, &in);
+	if (n < 0 || prefix_len > last_key.len)
+		return -1;
+	string_view_consume(&in, n);
+
+	n = get_var_int(&count, &in);
+	if (n <= 0)
+		return -1;
+	string_view_consume(&in, n);
+
+	*extra = (uint8_t)(count & 0x7);
+	count >>= 3;
+
+	strbuf_reset(key);
+	strbuf_add(key, last_key.buf, prefix_len);
+	while (count-- > 0) {
+		n = get_var_int(&tok, &in);
+		if (n <= 0)
+			return -1;
+		string_view_consume(&in, n);
+
+		if (tok & 1) {
+			tok >>= 1;
+			if (in.len < tok)
+				return -1;
+			strbuf_add(key, in.buf, tok);
+			string_view_consume(&in, tok);
+		} else {
+			tok >>= 1;
+			if (tok >= br->dict_count)
+				return -1;
+			strbuf_add(key, br->block.data + br->dict_off[tok],
+				   br->dict_len[tok]);
+		}
+	}
+
+	return start_len - in.len;
 }
 
 struct restart_find_args {
@@ -289,7 +966,8 @@ static int restart_key_less(size_t idx, void *args)
 	struct strbuf rkey = STRBUF_INIT;
 	struct strbuf last_key = STRBUF_INIT;
 	uint8_t unused_extra;
-	int n = reftable_decode_key(&rkey, &unused_extra, last_key, in);
+	int n = block_reader_decode_key(a->r, &rkey, &unused_extra, last_key,
+					in);
 	int result;
 	if (n < 0) {
 		a->error = 1;
@@ -307,6 +985,10 @@ void block_iter_copy_from(struct block_iter *dest, struct block_iter *src)
 	dest->next_off = src->next_off;
 	strbuf_reset(&dest->last_key);
 	strbuf_addbuf(&dest->last_key, &src->last_key);
+	dest->idx = src->idx;
+	dest->value_idx = src->value_idx;
+	dest->target_idx = src->target_idx;
+	dest->symref_off = src->symref_off;
 }
 
 int block_iter_next(struct block_iter *it, struct reftable_record *rec)
@@ -323,12 +1005,16 @@ int block_iter_next(struct block_iter *it, struct reftable_record *rec)
 	if (it->next_off >= it->br->block_len)
 		return 1;
 
-	n = reftable_decode_key(&key, &extra, it->last_key, in);
+	n = block_reader_decode_key(it->br, &key, &extra, it->last_key, in);
 	if (n < 0)
 		return -1;
 
 	string_view_consume(&in, n);
-	n = reftable_record_decode(rec, key, extra, in, it->br->hash_size);
+	if (it->br->is_columnar)
+		n = block_iter_decode_columns(it, key, rec);
+	else
+		n = reftable_record_decode(rec, key, extra, in,
+					   it->br->hash_size);
 	if (n < 0)
 		return -1;
 	string_view_consume(&in, n);
@@ -350,7 +1036,7 @@ int block_reader_first_key(struct block_reader *br, struct strbuf *key)
 	};
 
 	uint8_t extra = 0;
-	int n = reftable_decode_key(key, &extra, empty, in);
+	int n = block_reader_decode_key(br, key, &extra, empty, in);
 	if (n < 0)
 		return n;
 
@@ -362,6 +1048,127 @@ int block_iter_seek(struct block_iter *it, struct strbuf *want)
 	return block_reader_seek(it->br, it, want);
 }
 
+/* returns the index of the first record at or after the position of `it`
+ * that has `oid` as its value or peeled value, or the record count. */
+static int block_reader_find_oid(struct block_reader *br,
+				 struct block_iter *it, uint8_t *oid,
+				 uint32_t *found)
+{
+	int hash_size = br->hash_size;
+	uint32_t value_idx = it->value_idx;
+	uint32_t target_idx = it->target_idx;
+	uint32_t i = 0;
+
+	for (i = it->idx; i < br->record_count; i++) {
+		uint8_t typ = br->types[i];
+		uint8_t *h = NULL;
+		if (typ != REFTABLE_REF_VAL1 && typ != REFTABLE_REF_VAL2)
+			continue;
+
+		if (value_idx >= br->value_count)
+			return REFTABLE_FORMAT_ERROR;
+		h = br->values + value_idx++ * hash_size;
+		if (h[0] == oid[0] && !memcmp(h, oid, hash_size))
+			break;
+
+		if (typ != REFTABLE_REF_VAL2)
+			continue;
+		if (target_idx >= br->target_count)
+			return REFTABLE_FORMAT_ERROR;
+		h = br->targets + target_idx++ * hash_size;
+		if (h[0] == oid[0] && !memcmp(h, oid, hash_size))
+			break;
+	}
+	*found = i;
+	return 0;
+}
+
+int block_iter_seek_oid(struct block_iter *it, uint8_t *oid)
+{
+	struct block_reader *br = it->br;
+	struct strbuf key = STRBUF_INIT;
+	uint32_t want = 0;
+	size_t lo = 0;
+	size_t hi = br->restart_count;
+	int err = 0;
+
+	if (!br->is_columnar)
+		return 1;
+
+	err = block_reader_find_oid(br, it, oid, &want);
+	if (err < 0)
+		return err;
+	if (want == br->record_count) {
+		it->next_off = br->block_len;
+		it->idx = want;
+		return 0;
+	}
+
+	/* start from the last restart before the match, if that is ahead of
+	 * us. Keys are prefix compressed, so the ones in between the restart
+	 * and the match still have to be decoded. */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (get_be24(br->restart_idx + 3 * mid) <= want)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && get_be24(br->restart_idx + 3 * (lo - 1)) > it->idx) {
+		err = block_iter_seek_restart(it, lo - 1);
+		if (err < 0)
+			return err;
+	}
+
+	while (it->idx < want) {
+		struct string_view in = {
+			.buf = br->block.data + it->next_off,
+			.len = br->block_len - it->next_off,
+		};
+		uint8_t extra = 0;
+		int n = block_reader_decode_key(br, &key, &extra, it->last_key,
+						in);
+		if (n < 0 || block_iter_skip_columns(it) < 0) {
+			err = REFTABLE_FORMAT_ERROR;
+			break;
+		}
+		strbuf_reset(&it->last_key);
+		strbuf_addbuf(&it->last_key, &key);
+		it->next_off += n;
+	}
+
+	strbuf_release(&key);
+	return err;
+}
+
+int block_iter_seek_restart_run(struct block_iter *it, int i, uint32_t *end)
+{
+	struct block_reader *br = it->br;
+	if (i < 0 || i >= br->restart_count)
+		return REFTABLE_FORMAT_ERROR;
+
+	*end = (i + 1 < br->restart_count) ?
+		       block_reader_restart_offset(br, i + 1) :
+		       br->block_len;
+	return block_iter_seek_restart(it, i);
+}
+
+int block_iter_restart_run(struct block_iter *it)
+{
+	struct block_reader *br = it->br;
+	int lo = 0;
+	int hi = br->restart_count;
+	/* find the last restart at or before the next record. */
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if (block_reader_restart_offset(br, mid) <= it->next_off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 void block_iter_close(struct block_iter *it)
 {
 	strbuf_release(&it->last_key);
@@ -387,12 +1194,13 @@ int block_reader_seek(struct block_reader *br, struct block_iter *it,
 		goto done;
 	}
 
-	it->br = br;
 	if (i > 0) {
-		i--;
-		it->next_off = block_reader_restart_offset(br, i);
+		it->br = br;
+		err = block_iter_seek_restart(it, i - 1);
+		if (err < 0)
+			goto done;
 	} else {
-		it->next_off = br->header_off + 4;
+		block_reader_start(br, it);
 	}
 
 	/* We're looking for the last entry less/equal than the wanted key, so
@@ -424,6 +1232,17 @@ done:
 void block_writer_release(struct block_writer *bw)
 {
 	FREE_AND_NULL(bw->restarts);
+	FREE_AND_NULL(bw->dict);
+	if (bw->columns != NULL) {
+		struct block_columns *c = bw->columns;
+		reftable_free(c->types);
+		reftable_free(c->update_indices);
+		reftable_free(c->restart_idx);
+		strbuf_release(&c->values);
+		strbuf_release(&c->targets);
+		strbuf_release(&c->symrefs);
+		FREE_AND_NULL(bw->columns);
+	}
 	strbuf_release(&bw->last_key);
 	/* the block is not owned. */
 }
@@ -10,9 +10,32 @@ https://developers.google.com/open-source/licenses/bsd
 #define BLOCK_H
 
 #include "basics.h"
+#include "constants.h"
 #include "record.h"
 #include "reftable-blocksource.h"
 
+/* The columns of a BLOCK_TYPE_REF_COLUMNS block, collected while its keys
+ * are written. */
+struct block_columns {
+	uint8_t *types;
+	uint64_t *update_indices;
+	uint64_t max_update_index;
+	uint32_t len;
+	uint32_t cap;
+
+	/* hashes of the VAL1 and VAL2 records, and the peeled hashes of the
+	 * VAL2 records. */
+	struct strbuf values;
+	struct strbuf targets;
+
+	/* varint(length) and bytes of each symref target. */
+	struct strbuf symrefs;
+
+	/* the record index of each restart. */
+	uint32_t *restart_idx;
+	uint32_t restart_cap;
+};
+
 /*
  * Writes reftable blocks. The block_writer is reused across blocks to minimize
  * allocation overhead.
@@ -36,6 +59,25 @@ struct block_writer {
 
 	struct strbuf last_key;
 	int entries;
+
+	/* total length of the prefixes keys share with their predecessor,
+	 * including at restarts. */
+	uint64_t shared_prefix_bytes;
+
+	/* for BLOCK_TYPE_REF_DICT: the dictionary entries, encoded as they are
+	 * written after the records, and a hash table to look them up. */
+	int use_dict;
+	uint8_t *dict;
+	uint32_t dict_bytes;
+	int dict_count;
+	uint32_t dict_start[MAX_DICT_ENTRIES];
+	uint8_t dict_len[MAX_DICT_ENTRIES];
+	uint8_t dict_slot[MAX_DICT_ENTRIES];
+	uint8_t dict_slots[256];
+
+	/* for BLOCK_TYPE_REF_COLUMNS. */
+	int use_columns;
+	struct block_columns *columns;
 };
 
 /*
@@ -44,7 +86,13 @@ struct block_writer {
 void block_writer_init(struct block_writer *bw, uint8_t typ, uint8_t *buf,
 		       uint32_t block_size, uint32_t header_off, int hash_size);
 
-/* returns the block type (eg. 'r' for ref records. */
+/* switches an empty ref block to BLOCK_TYPE_REF_DICT. */
+void block_writer_use_dict(struct block_writer *bw);
+
+/* switches an empty ref block to BLOCK_TYPE_REF_COLUMNS. */
+void block_writer_use_columns(struct block_writer *bw);
+
+/* returns the block type of the records (eg. 'r' for ref records. */
 uint8_t block_writer_type(struct block_writer *bw);
 
 /* appends the record, or -1 if it doesn't fit. */
@@ -71,6 +119,27 @@ struct block_reader {
 	uint8_t *restart_bytes;
 	uint16_t restart_count;
 
+	/* for BLOCK_TYPE_REF_DICT: offsets and lengths of the dictionary
+	 * entries within the block. */
+	int is_dict;
+	int dict_count;
+	uint32_t dict_off[MAX_DICT_ENTRIES];
+	uint8_t dict_len[MAX_DICT_ENTRIES];
+
+	/* for BLOCK_TYPE_REF_COLUMNS: the arrays following the keys. */
+	int is_columnar;
+	uint32_t record_count;
+	uint32_t value_count;
+	uint32_t target_count;
+	uint32_t symrefs_len;
+	int update_index_width;
+	uint8_t *types;
+	uint8_t *update_indices;
+	uint8_t *values;
+	uint8_t *targets;
+	uint8_t *symrefs;
+	uint8_t *restart_idx;
+
 	/* size of the data in the file. For log blocks, this is the compressed
 	 * size. */
 	uint32_t full_block_size;
@@ -84,6 +153,13 @@ struct block_iter {
 
 	/* key for last entry we read. */
 	struct strbuf last_key;
+
+	/* for columnar blocks: the index of the next record, and the positions
+	 * of its data in the value, target and symref arrays. */
+	uint32_t idx;
+	uint32_t value_idx;
+	uint32_t target_idx;
+	uint32_t symref_off;
 };
 
 /* initializes a block reader. */
@@ -98,7 +174,7 @@ void block_reader_start(struct block_reader *br, struct block_iter *it);
 int block_reader_seek(struct block_reader *br, struct block_iter *it,
 		      struct strbuf *want);
 
-/* Returns the block type (eg. 'r' for refs) */
+/* Returns the block type of the records (eg. 'r' for refs) */
 uint8_t block_reader_type(struct block_reader *r);
 
 /* Decodes the first key in the block */
@@ -109,6 +185,18 @@ void block_iter_copy_from(struct block_iter *dest, struct block_iter *src);
 /* return < 0 for error, 0 for OK, > 0 for EOF. */
 int block_iter_next(struct block_iter *it, struct reftable_record *rec);
 
+/* Positions `it` at the next record whose value or peeled value is `oid`, or
+ * at the end of the block. This only looks at the hash arrays, so it needs a
+ * columnar block; for other blocks, it returns 1 without moving. */
+int block_iter_seek_oid(struct block_iter *it, uint8_t *oid);
+
+/* Positions `it` at restart point `i` of its block, and sets `end` to the
+ * offset where the records up to the next restart point end. */
+int block_iter_seek_restart_run(struct block_iter *it, int i, uint32_t *end);
+
+/* Returns the index of the restart run that holds the next record of `it`. */
+int block_iter_restart_run(struct block_iter *it);
+
 /* Seek to `want` with in the block pointed to by `it` */
 int block_iter_seek(struct block_iter *it, struct strbuf *want);
 
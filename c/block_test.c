@@ -114,8 +114,238 @@ static void test_block_read_write(void)
 	}
 }
 
+static void test_block_dict_read_write(void)
+{
+	const int header_off = 21;
+	char *names[400];
+	const int N = ARRAY_SIZE(names);
+	const int block_size = 8192;
+	struct reftable_block block = { NULL };
+	struct block_writer bw = {
+		.last_key = STRBUF_INIT,
+	};
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_record rec = { NULL };
+	uint8_t hash[SHA1_SIZE] = { 1 };
+	int added = 0;
+	int i = 0;
+	int n;
+	struct block_reader br = { 0 };
+	struct block_iter it = { .last_key = STRBUF_INIT };
+	struct strbuf want = STRBUF_INIT;
+
+	block.data = reftable_calloc(block_size);
+	block.len = block_size;
+	block.source = malloc_block_source();
+	block_writer_init(&bw, BLOCK_TYPE_REF, block.data, block_size,
+			  header_off, hash_size(SHA1_ID));
+	block_writer_use_dict(&bw);
+	EXPECT(block_writer_type(&bw) == BLOCK_TYPE_REF);
+	/* write every key in full, so each one adds a component. */
+	bw.restart_interval = 1;
+	reftable_record_from_ref(&rec, &ref);
+
+	/* more distinct components than fit in the dictionary, and more
+	 * records than fit in the block. */
+	for (i = 0; i < N; i++) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/user%03d/topic%d", i,
+			 i % 3);
+		names[i] = xstrdup(name);
+	}
+	for (i = 0; i < N; i++) {
+		ref.refname = names[i];
+		ref.value_type = REFTABLE_REF_VAL1;
+		ref.value.val1 = hash;
+		n = block_writer_add(&bw, &rec);
+		ref.refname = NULL;
+		ref.value_type = REFTABLE_REF_DELETION;
+		if (n < 0)
+			break;
+		added++;
+	}
+	EXPECT(added > MAX_DICT_ENTRIES);
+	EXPECT(added < N);
+	EXPECT(bw.dict_count == MAX_DICT_ENTRIES);
+
+	n = block_writer_finish(&bw);
+	EXPECT(n > 0 && n <= block_size);
+	block_writer_release(&bw);
+
+	n = block_reader_init(&br, &block, header_off, block_size, SHA1_SIZE);
+	EXPECT(n == 0);
+	EXPECT(block_reader_type(&br) == BLOCK_TYPE_REF);
+	EXPECT(br.dict_count == MAX_DICT_ENTRIES);
+
+	block_reader_start(&br, &it);
+	for (i = 0; i < added; i++) {
+		n = block_iter_next(&it, &rec);
+		EXPECT(n == 0);
+		EXPECT_STREQ(names[i], ref.refname);
+	}
+	n = block_iter_next(&it, &rec);
+	EXPECT(n == 1);
+	block_iter_close(&it);
+
+	for (i = 0; i < added; i++) {
+		struct block_iter it = { .last_key = STRBUF_INIT };
+		strbuf_reset(&want);
+		strbuf_addstr(&want, names[i]);
+
+		n = block_reader_seek(&br, &it, &want);
+		EXPECT(n == 0);
+		n = block_iter_next(&it, &rec);
+		EXPECT(n == 0);
+		EXPECT_STREQ(names[i], ref.refname);
+		block_iter_close(&it);
+	}
+
+	reftable_record_release(&rec);
+	reftable_block_done(&br.block);
+	strbuf_release(&want);
+	for (i = 0; i < N; i++) {
+		reftable_free(names[i]);
+	}
+}
+
+static void test_block_columns_read_write(void)
+{
+	const int header_off = 21;
+	char *names[300];
+	const int N = ARRAY_SIZE(names);
+	const int block_size = 4096;
+	struct reftable_block block = { NULL };
+	struct block_writer bw = {
+		.last_key = STRBUF_INIT,
+	};
+	struct reftable_ref_record refs[300] = { { NULL } };
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_record rec = { NULL };
+	uint8_t hashes[300][SHA1_SIZE];
+	uint8_t targets[300][SHA1_SIZE];
+	uint8_t want[SHA1_SIZE];
+	int added = 0;
+	int matches = 0;
+	int i = 0;
+	int n;
+	struct block_reader br = { 0 };
+	struct block_iter it = { .last_key = STRBUF_INIT };
+	struct strbuf key = STRBUF_INIT;
+
+	block.data = reftable_calloc(block_size);
+	block.len = block_size;
+	block.source = malloc_block_source();
+	block_writer_init(&bw, BLOCK_TYPE_REF, block.data, block_size,
+			  header_off, hash_size(SHA1_ID));
+	block_writer_use_columns(&bw);
+
+	for (i = 0; i < N; i++) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+		names[i] = xstrdup(name);
+		memset(hashes[i], i % 7, SHA1_SIZE);
+		memset(targets[i], 1 + i % 5, SHA1_SIZE);
+
+		refs[i].refname = names[i];
+		refs[i].update_index = 37 * i;
+		refs[i].value_type = i % 4;
+		switch (refs[i].value_type) {
+		case REFTABLE_REF_VAL1:
+			refs[i].value.val1 = hashes[i];
+			break;
+		case REFTABLE_REF_VAL2:
+			refs[i].value.val2.value = hashes[i];
+			refs[i].value.val2.target_value = targets[i];
+			break;
+		case REFTABLE_REF_SYMREF:
+			refs[i].value.symref = names[i / 2];
+			break;
+		case REFTABLE_REF_DELETION:
+			break;
+		}
+	}
+	for (i = 0; i < N; i++) {
+		struct reftable_record wrec = { NULL };
+		reftable_record_from_ref(&wrec, &refs[i]);
+		n = block_writer_add(&bw, &wrec);
+		if (n < 0)
+			break;
+		added++;
+	}
+	EXPECT(added > 10);
+	EXPECT(added < N);
+
+	n = block_writer_finish(&bw);
+	EXPECT(n > 0 && n <= block_size);
+	block_writer_release(&bw);
+
+	n = block_reader_init(&br, &block, header_off, block_size, SHA1_SIZE);
+	EXPECT(n == 0);
+	EXPECT(block_reader_type(&br) == BLOCK_TYPE_REF);
+	EXPECT(br.is_columnar);
+	EXPECT(br.record_count == added);
+
+	reftable_record_from_ref(&rec, &ref);
+	block_reader_start(&br, &it);
+	for (i = 0; i < added; i++) {
+		n = block_iter_next(&it, &rec);
+		EXPECT(n == 0);
+		EXPECT(reftable_ref_record_equal(&ref, &refs[i], SHA1_SIZE));
+	}
+	n = block_iter_next(&it, &rec);
+	EXPECT(n == 1);
+	block_iter_close(&it);
+
+	for (i = 0; i < added; i++) {
+		struct block_iter it = { .last_key = STRBUF_INIT };
+		strbuf_reset(&key);
+		strbuf_addstr(&key, names[i]);
+		n = block_reader_seek(&br, &it, &key);
+		EXPECT(n == 0);
+		n = block_iter_next(&it, &rec);
+		EXPECT(n == 0);
+		EXPECT(reftable_ref_record_equal(&ref, &refs[i], SHA1_SIZE));
+		block_iter_close(&it);
+	}
+
+	/* 3 occurs both as value and as peeled value. */
+	memset(want, 3, SHA1_SIZE);
+	block_reader_start(&br, &it);
+	i = 0;
+	while (1) {
+		n = block_iter_seek_oid(&it, want);
+		EXPECT(n == 0);
+		n = block_iter_next(&it, &rec);
+		if (n > 0)
+			break;
+		EXPECT(n == 0);
+		while (i < added &&
+		       !((refs[i].value_type == REFTABLE_REF_VAL1 ||
+			  refs[i].value_type == REFTABLE_REF_VAL2) &&
+			 !memcmp(hashes[i], want, SHA1_SIZE)) &&
+		       !(refs[i].value_type == REFTABLE_REF_VAL2 &&
+			 !memcmp(targets[i], want, SHA1_SIZE)))
+			i++;
+		EXPECT(i < added);
+		EXPECT(reftable_ref_record_equal(&ref, &refs[i], SHA1_SIZE));
+		i++;
+		matches++;
+	}
+	EXPECT(matches > 0);
+	block_iter_close(&it);
+
+	reftable_record_release(&rec);
+	reftable_block_done(&br.block);
+	strbuf_release(&key);
+	for (i = 0; i < N; i++) {
+		reftable_free(names[i]);
+	}
+}
+
 int block_test_main(int argc, const char *argv[])
 {
 	test_block_read_write();
+	test_block_dict_read_write();
+	test_block_columns_read_write();
 	return 0;
 }
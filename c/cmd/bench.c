@@ -0,0 +1,14 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "reftable-tests.h"
+
+int main(int argc, const char **argv)
+{
+	return reftable_bench_main(argc, argv);
+}
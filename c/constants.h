@@ -13,9 +13,20 @@ https://developers.google.com/open-source/licenses/bsd
 #define BLOCK_TYPE_INDEX 'i'
 #define BLOCK_TYPE_REF 'r'
 #define BLOCK_TYPE_OBJ 'o'
+/* a ref block whose keys are spelled with path components from a dictionary
+ * stored in the block. It holds ref records, like BLOCK_TYPE_REF. */
+#define BLOCK_TYPE_REF_DICT 'd'
+/* a ref block that stores keys, value types, update indices and hashes in
+ * separate arrays. It holds ref records, like BLOCK_TYPE_REF. */
+#define BLOCK_TYPE_REF_COLUMNS 'c'
 #define BLOCK_TYPE_ANY 0
 
 #define MAX_RESTARTS ((1 << 16) - 1)
+
+/* In full-width obj indices, a position is the offset of a ref block shifted
+ * left by this many bits, or'ed with the index of a restart point in it. */
+#define OBJ_POS_RESTART_BITS 16
+#define MAX_DICT_ENTRIES 127
 #define DEFAULT_BLOCK_SIZE 4096
 
 #endif
@@ -9,6 +9,11 @@ https://developers.google.com/open-source/licenses/bsd
 #ifndef GIT_COMPAT_UTIL_H
 #define GIT_COMPAT_UTIL_H
 
+/* for sync_file_range(2). */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
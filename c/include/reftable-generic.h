@@ -27,6 +27,16 @@ int reftable_table_seek_ref(struct reftable_table *tab,
 void reftable_table_from_reader(struct reftable_table *tab,
 				struct reftable_reader *reader);
 
+/* returns an iterator for the refs pointing to `oid`. */
+int reftable_table_refs_for(struct reftable_table *tab,
+			    struct reftable_iterator *it, uint8_t *oid);
+
+/* returns an iterator for the log entries from `name` onwards with a time in
+ * [min_time, max_time]; see reftable_reader_seek_log_time. */
+int reftable_table_seek_log_time(struct reftable_table *tab,
+				 struct reftable_iterator *it, const char *name,
+				 uint64_t min_time, uint64_t max_time);
+
 /* returns the hash ID from a generic reftable_table */
 uint32_t reftable_table_hash_id(struct reftable_table *tab);
 
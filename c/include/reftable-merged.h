@@ -51,6 +51,30 @@ int reftable_merged_table_seek_log(struct reftable_merged_table *mt,
 				   struct reftable_iterator *it,
 				   const char *name);
 
+/* returns an iterator for the log entries from `name` onwards whose time is in
+ * [min_time, max_time]; see reftable_reader_seek_log_time. Entries are
+ * filtered after merging, so an entry that a newer table rewrote with a time
+ * outside the range is not returned. Only the oldest table uses its log time
+ * index. */
+int reftable_merged_table_seek_log_time(struct reftable_merged_table *mt,
+					struct reftable_iterator *it,
+					const char *name, uint64_t min_time,
+					uint64_t max_time);
+
+/* returns an iterator for the refs pointing to `oid` (as value, or as
+ * peeled target), in name order. The tables are searched concurrently, and
+ * refs that are shadowed by newer tables are dropped. */
+int reftable_merged_table_refs_for(struct reftable_merged_table *mt,
+				   struct reftable_iterator *it, uint8_t *oid);
+
+/* calls `fn` for each ref whose name starts with `prefix`, in name order,
+ * skipping deletions. The record is only valid during the call; it is read
+ * from the tables without being copied. Stops at the first non-zero return
+ * of `fn`, and returns it. */
+int reftable_merged_table_visit_refs(
+	struct reftable_merged_table *mt, const char *prefix,
+	int (*fn)(void *arg, const struct reftable_ref_record *ref), void *arg);
+
 /* returns the max update_index covered by this merged table. */
 uint64_t
 reftable_merged_table_max_update_index(struct reftable_merged_table *mt);
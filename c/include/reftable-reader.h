@@ -73,6 +73,17 @@ int reftable_reader_seek_log_at(struct reftable_reader *r,
 int reftable_reader_seek_log(struct reftable_reader *r,
 			     struct reftable_iterator *it, const char *name);
 
+/* seek to the log entries from `name` onwards (use "" for all) whose time is
+   in [min_time, max_time]. Deletions are returned regardless of their time,
+   as they may hide entries in older tables. If the table was written with
+   log_time_index, blocks without entries in the range are skipped without
+   being read.
+ */
+int reftable_reader_seek_log_time(struct reftable_reader *r,
+				  struct reftable_iterator *it,
+				  const char *name, uint64_t min_time,
+				  uint64_t max_time);
+
 /* closes and deallocates a reader. */
 void reftable_reader_free(struct reftable_reader *);
 
@@ -80,6 +91,18 @@ void reftable_reader_free(struct reftable_reader *);
 int reftable_reader_refs_for(struct reftable_reader *r,
 			     struct reftable_iterator *it, uint8_t *oid);
 
+/* Finds the refs pointing to any of the `n` object IDs in `oids`, which are
+ * stored back to back and must be sorted without duplicates. `fn` is called
+ * for each ref and each requested ID it points to, with the index of that ID,
+ * in table order. The obj index is walked once and each ref block is read at
+ * most once, however many IDs it holds. Stops at the first non-zero return of
+ * `fn`, and returns it. */
+int reftable_reader_refs_for_oids(struct reftable_reader *r, uint8_t *oids,
+				  size_t n,
+				  int (*fn)(void *arg, size_t oid_idx,
+					    struct reftable_ref_record *ref),
+				  void *arg);
+
 /* return the max_update_index for a table */
 uint64_t reftable_reader_max_update_index(struct reftable_reader *r);
 
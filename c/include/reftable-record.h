@@ -58,6 +58,15 @@ uint8_t *reftable_ref_record_val2(struct reftable_ref_record *rec);
 /* returns whether 'ref' represents a deletion */
 int reftable_ref_record_is_deletion(const struct reftable_ref_record *ref);
 
+/* formats `ref` as it appears in a ref advertisement: a pkt-line with its
+ * hex value and name, followed by a line for the peeled value of a tag.
+ * Deletions and symrefs produce nothing. Returns the number of bytes of
+ * output, which is only written (without a terminating NUL) if it fits in
+ * `len` bytes, or REFTABLE_API_ERROR if a line would be too long. */
+int reftable_ref_record_format_pkt_line(const struct reftable_ref_record *ref,
+					uint32_t hash_id, char *dest,
+					size_t len);
+
 /* prints a reftable_ref_record onto stdout. Useful for debugging. */
 void reftable_ref_record_print(struct reftable_ref_record *ref,
 			       uint32_t hash_id);
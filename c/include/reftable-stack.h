@@ -9,6 +9,7 @@ https://developers.google.com/open-source/licenses/bsd
 #ifndef REFTABLE_STACK_H
 #define REFTABLE_STACK_H
 
+#include "reftable-iterator.h"
 #include "reftable-writer.h"
 
 /*
@@ -40,13 +41,26 @@ struct reftable_addition;
 int reftable_stack_new_addition(struct reftable_addition **dest,
 				struct reftable_stack *st);
 
+/*
+ * returns a new optimistic transaction to add reftables to the given stack.
+ * The ref database is not locked while tables are written; the lock is only
+ * taken in reftable_addition_commit, which then checks the new tables against
+ * tables that were added in the meantime. If they conflict, because of
+ * overlapping update indices or ref names, the commit fails with
+ * REFTABLE_LOCK_ERROR, and the caller should reload and retry.
+ */
+int reftable_stack_new_optimistic_addition(struct reftable_addition **dest,
+					   struct reftable_stack *st);
+
 /* Adds a reftable to transaction. */
 int reftable_addition_add(struct reftable_addition *add,
 			  int (*write_table)(struct reftable_writer *wr,
 					     void *arg),
 			  void *arg);
 
-/* Commits the transaction, releasing the lock. */
+/* Commits the transaction, releasing the lock. If the stack directory can't be
+ * synced after tables.list was replaced (REFTABLE_FSYNC_FULL), the tables are
+ * committed and the stack is reloaded, but REFTABLE_IO_ERROR is returned. */
 int reftable_addition_commit(struct reftable_addition *add);
 
 /* Release all non-committed data from the transaction, and deallocate the
@@ -60,6 +74,23 @@ int reftable_stack_add(struct reftable_stack *st,
 					  void *write_arg),
 		       void *write_arg);
 
+/*
+ * adds refs and logs to the stack as a single transaction. Concurrent calls
+ * from different threads on the same stack are coalesced into a single table
+ * and a single update of the table list. Each caller still gets its own
+ * result; a caller whose records conflict with the stack fails on its own.
+ *
+ * The update_index fields of the records are ignored: all records of a group
+ * are written at the stack's next update index. Hence, a call may not contain
+ * two refs or two logs for the same ref name. Calls that touch the same ref
+ * names are committed in separate groups.
+ *
+ * While calls are in progress, the stack must not be used otherwise.
+ */
+int reftable_stack_group_add(struct reftable_stack *st,
+			     struct reftable_ref_record *refs, size_t refs_len,
+			     struct reftable_log_record *logs, size_t logs_len);
+
 /* returns the merged_table for seeking. This table is valid until the
  * next write or reload, and should not be closed or deleted.
  */
@@ -87,6 +118,14 @@ struct reftable_log_expiry_config {
 int reftable_stack_compact_all(struct reftable_stack *st,
 			       struct reftable_log_expiry_config *config);
 
+/* Expires reflog entries without compacting the stack. Only tables with
+ * expired entries are rewritten, one at a time; their ref and obj sections are
+ * copied byte for byte, and only their logs are re-encoded. An expired entry
+ * that hides one in an older table is replaced by a deletion. Returns > 0 if
+ * a table was locked by a concurrent compaction. */
+int reftable_stack_expire_logs(struct reftable_stack *st,
+			       struct reftable_log_expiry_config *config);
+
 /* heuristically compact unbalanced table stack. */
 int reftable_stack_auto_compact(struct reftable_stack *st);
 
@@ -95,6 +134,11 @@ int reftable_stack_auto_compact(struct reftable_stack *st);
 int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
 			    struct reftable_ref_record *ref);
 
+/* returns an iterator for the refs pointing to `oid`; see
+ * reftable_merged_table_refs_for. */
+int reftable_stack_refs_for(struct reftable_stack *st,
+			    struct reftable_iterator *it, uint8_t *oid);
+
 /* convenience function to read a single log. Returns < 0 for error, 0 for
  * success, and 1 if ref not found. */
 int reftable_stack_read_log(struct reftable_stack *st, const char *refname,
@@ -113,4 +157,62 @@ struct reftable_compaction_stats {
 struct reftable_compaction_stats *
 reftable_stack_compaction_stats(struct reftable_stack *st);
 
+/* Number of buckets in the stack depth histogram. The last bucket counts all
+ * lookups done with at least REFTABLE_STACK_DEPTH_BUCKETS - 1 tables. */
+#define REFTABLE_STACK_DEPTH_BUCKETS 16
+
+/* statistics on the shape of the stack and the cost of using it. */
+struct reftable_stack_stats {
+	/* bytes written by additions (new tables). */
+	uint64_t addition_bytes;
+	/* bytes written by compactions. The write amplification is
+	 * (addition_bytes + compaction_bytes) / addition_bytes. */
+	uint64_t compaction_bytes;
+	/* wall clock time spent in compaction, in microseconds. */
+	uint64_t compaction_usecs;
+
+	/* number of reftable_stack_read_ref and reftable_stack_read_log
+	 * calls. */
+	uint64_t lookups;
+	/* depth_histogram[i] is the number of lookups that saw a stack of i
+	 * tables. */
+	uint64_t depth_histogram[REFTABLE_STACK_DEPTH_BUCKETS];
+	/* number of tables that read at least one block, summed over
+	 * lookups. */
+	uint64_t tables_probed;
+	/* number of blocks read and inflated, summed over lookups. Divide by
+	 * `lookups` for the per-seek cost. */
+	uint64_t blocks_read;
+	uint64_t blocks_inflated;
+};
+
+/* return statistics for additions, compactions and lookups up till now. */
+const struct reftable_stack_stats *
+reftable_stack_get_stats(struct reftable_stack *st);
+
+/* Limits for the background compaction worker. */
+struct reftable_compaction_worker_options {
+	/* maximum number of bytes per second written by compactions. 0 means
+	 * unlimited. */
+	uint64_t max_bytes_per_second;
+
+	/* percentage (1-100) of one CPU the worker may use for compacting,
+	 * measured in CPU time of the worker thread. 0 means unlimited. */
+	int max_cpu_percent;
+};
+
+/* Starts a thread that compacts the stack in the background. After this,
+ * reftable_stack_add no longer compacts inline; instead, each committed
+ * addition wakes up the worker. The worker backs off when it contends with
+ * additions on the table list lock. Returns REFTABLE_API_ERROR if a worker is
+ * already running. */
+int reftable_stack_start_compaction_worker(
+	struct reftable_stack *st,
+	const struct reftable_compaction_worker_options *opts);
+
+/* Stops the compaction worker and waits for it to finish. Compactions in
+ * flight are completed; pending triggers are dropped. Called implicitly by
+ * reftable_stack_destroy. */
+void reftable_stack_stop_compaction_worker(struct reftable_stack *st);
+
 #endif
@@ -18,5 +18,6 @@ int reftable_test_main(int argc, const char **argv);
 int stack_test_main(int argc, const char **argv);
 int tree_test_main(int argc, const char **argv);
 int reftable_dump_main(int argc, char *const *argv);
+int reftable_bench_main(int argc, const char **argv);
 
 #endif
@@ -29,6 +29,41 @@ struct reftable_write_options {
 	/* how often to write complete keys in each block. */
 	int restart_interval;
 
+	/* boolean: pick the restart interval for each block from the key
+	 * sizes and shared prefixes seen so far in its section. The first
+	 * block of a section uses restart_interval. */
+	unsigned adaptive_restart_interval : 1;
+
+	/* boolean: write ref blocks that spell their keys with path components
+	 * from a per-block dictionary. This makes tables with many similar ref
+	 * names smaller, but they can't be read by versions of this library
+	 * that predate the option. */
+	unsigned ref_block_dictionary : 1;
+
+	/* boolean: write ref blocks that keep the value types, update indices,
+	 * hashes and symref targets in arrays separate from the keys, so
+	 * scanning for an object ID doesn't decode every record. Takes
+	 * precedence over ref_block_dictionary. Like that option, the tables
+	 * can't be read by older versions of this library. */
+	unsigned columnar_ref_blocks : 1;
+
+	/* boolean: key the 'o' section on complete object IDs, and point each
+	 * at the restart point in its ref block after which the refs to it
+	 * are, rather than at the whole block. Reverse lookups then decode a
+	 * few records instead of whole blocks, and see no refs to other IDs
+	 * that share a prefix. The index is larger, and the tables can't be
+	 * read by older versions of this library. */
+	unsigned full_width_obj_index : 1;
+
+	/* block sizes for the ref, obj, index and log sections. 0 means
+	 * block_size. The table's block_size is raised to the largest of the
+	 * ref, obj and index sizes, and sections with smaller blocks are
+	 * written unpadded. */
+	uint32_t ref_block_size;
+	uint32_t obj_block_size;
+	uint32_t index_block_size;
+	uint32_t log_block_size;
+
 	/* 4-byte identifier ("sha1", "s256") of the hash.
 	 * Defaults to SHA1 if unset
 	 */
@@ -42,6 +77,38 @@ struct reftable_write_options {
 	 *   is a single line, and add '\n' if missing.
 	 */
 	unsigned exact_log_message : 1;
+
+	/* boolean: always write an index for the log section, and record in
+	 * it the range of times of the log entries in each block. Scans for
+	 * a time range then skip blocks without inflating them. The tables
+	 * can't be read by older versions of this library. */
+	unsigned log_time_index : 1;
+
+	/* maximum number of bytes used to collect object IDs for the 'o'
+	 * section. Beyond this, they are sorted and spilled to temporary
+	 * files. 0 means unlimited. */
+	uint64_t obj_index_memory_limit;
+
+	/* for reftable_stack_group_add: how long, in milliseconds, a group
+	 * leader waits for other additions to join the group. */
+	int group_commit_window_ms;
+
+	/* for reftable_writer_add_refs and reftable_writer_add_logs: the number
+	 * of threads used to sort large batches. 0 or 1 sorts on the calling
+	 * thread. */
+	int sort_threads;
+
+	/* for reftable_stack: how new tables and tables.list are made durable
+	 * before they are renamed into place. */
+	enum {
+		/* leave it to the OS. */
+		REFTABLE_FSYNC_NONE = 0,
+		/* fdatasync(2) new tables and tables.list. */
+		REFTABLE_FSYNC_DATA = 1,
+		/* fsync(2) new tables and tables.list, and the directory after
+		 * renaming them. */
+		REFTABLE_FSYNC_FULL = 2,
+	} fsync_mode;
 };
 
 /* reftable_block_stats holds statistics for a single block type */
@@ -141,6 +208,14 @@ int reftable_writer_close(struct reftable_writer *w);
  */
 const struct reftable_stats *writer_stats(struct reftable_writer *w);
 
+/* reftable_writer_reset prepares a closed (or unused) writer for writing a new
+ * table to `writer_func`, with the same options. The block buffer and the
+ * other storage grown while writing earlier tables are reused, which makes
+ * this cheaper than a new writer for small tables. */
+void reftable_writer_reset(struct reftable_writer *w,
+			   int (*writer_func)(void *, const void *, size_t),
+			   void *writer_arg);
+
 /* reftable_writer_free deallocates memory for the writer */
 void reftable_writer_free(struct reftable_writer *w);
 
@@ -150,30 +150,45 @@ static void indexed_table_ref_iter_close(void *p)
 	block_iter_close(&it->cur);
 	reftable_block_done(&it->block_reader.block);
 	strbuf_release(&it->oid);
+	reftable_free(it->offsets);
 }
 
 static int indexed_table_ref_iter_next_block(struct indexed_table_ref_iter *it)
 {
 	uint64_t off;
+	uint64_t pos = 0;
 	int err = 0;
 	if (it->offset_idx == it->offset_len) {
 		it->is_finished = 1;
 		return 1;
 	}
 
-	reftable_block_done(&it->block_reader.block);
-
 	off = it->offsets[it->offset_idx++];
-	err = reader_init_block_reader(it->r, &it->block_reader, off,
-				       BLOCK_TYPE_REF);
-	if (err < 0) {
-		return err;
+	if (it->r->obj_full_width) {
+		pos = off;
+		off >>= OBJ_POS_RESTART_BITS;
 	}
-	if (err > 0) {
-		/* indexed block does not exist. */
-		return REFTABLE_FORMAT_ERROR;
+
+	if (it->block_reader.block.data == NULL || off != it->block_off) {
+		reftable_block_done(&it->block_reader.block);
+		err = reader_init_block_reader(it->r, &it->block_reader, off,
+					       BLOCK_TYPE_REF);
+		if (err < 0) {
+			return err;
+		}
+		if (err > 0) {
+			/* indexed block does not exist. */
+			return REFTABLE_FORMAT_ERROR;
+		}
+		it->block_off = off;
 	}
 	block_reader_start(&it->block_reader, &it->cur);
+	it->run_end = it->block_reader.block_len;
+	if (it->r->obj_full_width)
+		/* only the refs after this restart point can match. */
+		return block_iter_seek_restart_run(
+			&it->cur, pos & ((1 << OBJ_POS_RESTART_BITS) - 1),
+			&it->run_end);
 	return 0;
 }
 
@@ -184,7 +199,11 @@ static int indexed_table_ref_iter_next(void *p, struct reftable_record *rec)
 		(struct reftable_ref_record *)rec->data;
 
 	while (1) {
-		int err = block_iter_next(&it->cur, rec);
+		int err = 1;
+		if (it->is_finished)
+			return 1;
+		if (it->cur.next_off < it->run_end)
+			err = block_iter_next(&it->cur, rec);
 		if (err < 0) {
 			return err;
 		}
@@ -200,10 +219,16 @@ static int indexed_table_ref_iter_next(void *p, struct reftable_record *rec)
 			}
 			continue;
 		}
-		/* BUG */
-		if (!memcmp(it->oid.buf, ref->value.val2.target_value,
-			    it->oid.len) ||
-		    !memcmp(it->oid.buf, ref->value.val2.value, it->oid.len)) {
+		if (ref->value_type == REFTABLE_REF_VAL2 &&
+		    (!memcmp(it->oid.buf, ref->value.val2.target_value,
+			     it->oid.len) ||
+		     !memcmp(it->oid.buf, ref->value.val2.value,
+			     it->oid.len))) {
+			return 0;
+		}
+
+		if (ref->value_type == REFTABLE_REF_VAL1 &&
+		    !memcmp(it->oid.buf, ref->value.val1, it->oid.len)) {
 			return 0;
 		}
 	}
@@ -246,3 +271,93 @@ void iterator_from_indexed_table_ref_iter(struct reftable_iterator *it,
 	it->iter_arg = itr;
 	it->ops = &indexed_table_ref_iter_vtable;
 }
+
+/* If a key is within this many refs of the cursor, stepping is cheaper than
+ * seeking. */
+#define REF_CURSOR_MAX_STEPS 16
+
+/* 0 = on a live ref, 1 = EOF, < 0 = error. */
+static int ref_cursor_next_live(struct ref_cursor *c)
+{
+	while (1) {
+		int err = reftable_iterator_next_ref(&c->it, &c->ref);
+		if (err > 0)
+			c->state = 2;
+		if (err != 0)
+			return err;
+		if (!reftable_ref_record_is_deletion(&c->ref) &&
+		    (c->skip == NULL || !c->skip(c->skip_arg, &c->ref)))
+			return 0;
+	}
+}
+
+int ref_cursor_seek(struct ref_cursor *c, const char *key)
+{
+	int steps = 0;
+	int err = 0;
+	if (c->state == 2)
+		return 1;
+
+	if (c->state == 1) {
+		while (strcmp(c->ref.refname, key) < 0 &&
+		       steps++ < REF_CURSOR_MAX_STEPS) {
+			err = ref_cursor_next_live(c);
+			if (err != 0)
+				return err;
+		}
+		if (strcmp(c->ref.refname, key) >= 0)
+			return 0;
+		reftable_iterator_destroy(&c->it);
+	}
+
+	err = reftable_table_seek_ref(&c->tab, &c->it, key);
+	if (err > 0)
+		c->state = 2;
+	if (err != 0)
+		return err;
+	c->state = 1;
+	return ref_cursor_next_live(c);
+}
+
+void ref_cursor_release(struct ref_cursor *c)
+{
+	reftable_ref_record_release(&c->ref);
+	reftable_iterator_destroy(&c->it);
+}
+
+static int ref_array_iter_next(void *p, struct reftable_record *rec)
+{
+	struct ref_array_iter *ai = (struct ref_array_iter *)p;
+	struct reftable_ref_record *ref =
+		(struct reftable_ref_record *)rec->data;
+	struct reftable_ref_record empty = { NULL };
+	if (ai->idx == ai->len)
+		return 1;
+
+	reftable_ref_record_release(ref);
+	*ref = ai->refs[ai->idx];
+	ai->refs[ai->idx++] = empty;
+	return 0;
+}
+
+static void ref_array_iter_close(void *p)
+{
+	struct ref_array_iter *ai = (struct ref_array_iter *)p;
+	size_t i = 0;
+	for (i = ai->idx; i < ai->len; i++)
+		reftable_ref_record_release(&ai->refs[i]);
+	FREE_AND_NULL(ai->refs);
+}
+
+static struct reftable_iterator_vtable ref_array_iter_vtable = {
+	.next = &ref_array_iter_next,
+	.close = &ref_array_iter_close,
+};
+
+void iterator_from_ref_array_iter(struct reftable_iterator *it,
+				  struct ref_array_iter *ai)
+{
+	assert(it->ops == NULL);
+	it->iter_arg = ai;
+	it->ops = &ref_array_iter_vtable;
+}
@@ -59,6 +59,11 @@ struct indexed_table_ref_iter {
 	struct block_reader block_reader;
 	struct block_iter cur;
 	int is_finished;
+
+	/* for full-width obj indices: the offset of the loaded block, and
+	 * where the restart run being read ends. */
+	uint64_t block_off;
+	uint32_t run_end;
 };
 
 #define INDEXED_TABLE_REF_ITER_INIT                                     \
@@ -72,4 +77,33 @@ int new_indexed_table_ref_iter(struct indexed_table_ref_iter **dest,
 			       struct reftable_reader *r, uint8_t *oid,
 			       int oid_len, uint64_t *offsets, int offset_len);
 
+/* A forward-only cursor over the live refs of a table: those that are not
+ * deletions, and for which `skip` (if set) returns 0. */
+struct ref_cursor {
+	struct reftable_table tab;
+	int (*skip)(void *arg, struct reftable_ref_record *ref);
+	void *skip_arg;
+
+	struct reftable_iterator it;
+	struct reftable_ref_record ref;
+	/* 0 = not positioned, 1 = on `ref`, 2 = no more refs. */
+	int state;
+};
+
+/* Moves to the first live ref at or after `key`, which may not be before the
+ * key of an earlier call. Nearby keys are reached by stepping, others by
+ * seeking. 0 = OK, 1 = EOF, < 0 = error. */
+int ref_cursor_seek(struct ref_cursor *c, const char *key);
+void ref_cursor_release(struct ref_cursor *c);
+
+/* iterator that hands out an array of ref records, which it owns. */
+struct ref_array_iter {
+	struct reftable_ref_record *refs;
+	size_t len;
+	size_t idx;
+};
+
+void iterator_from_ref_array_iter(struct reftable_iterator *it,
+				  struct ref_array_iter *ai);
+
 #endif
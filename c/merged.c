@@ -17,6 +17,8 @@ https://developers.google.com/open-source/licenses/bsd
 #include "reftable-error.h"
 #include "system.h"
 
+#include <pthread.h>
+
 static int merged_iter_init(struct merged_iter *mi)
 {
 	int i = 0;
@@ -47,27 +49,50 @@ static void merged_iter_close(void *p)
 	struct merged_iter *mi = (struct merged_iter *)p;
 	int i = 0;
 	merged_iter_pqueue_release(&mi->pq);
+	if (mi->spare.ops != NULL)
+		reftable_record_destroy(&mi->spare);
+	strbuf_release(&mi->entry_key);
+	strbuf_release(&mi->key);
 	for (i = 0; i < mi->stack_len; i++) {
 		reftable_iterator_destroy(&mi->stack[i]);
 	}
 	reftable_free(mi->stack);
 }
 
+/* keeps the storage of `rec` for the next record a subiterator reads, and
+ * clears `rec`. */
+static void merged_iter_recycle(struct merged_iter *mi,
+				struct reftable_record *rec)
+{
+	if (mi->spare.ops == NULL) {
+		mi->spare = *rec;
+		memset(rec, 0, sizeof(*rec));
+	} else {
+		reftable_record_destroy(rec);
+	}
+}
+
 static int merged_iter_advance_nonnull_subiter(struct merged_iter *mi,
 					       size_t idx)
 {
-	struct reftable_record rec = reftable_new_record(mi->typ);
-	struct pq_entry e = {
-		.rec = rec,
-		.index = idx,
-	};
-	int err = iterator_next(&mi->stack[idx], &rec);
+	struct reftable_record rec = mi->spare;
+	struct pq_entry e = { 0 };
+	int err = 0;
+	if (rec.ops != NULL)
+		memset(&mi->spare, 0, sizeof(mi->spare));
+	else
+		rec = reftable_new_record(mi->typ);
+
+	e.rec = rec;
+	e.index = idx;
+	err = iterator_next(&mi->stack[idx], &rec);
+	if (err != 0)
+		merged_iter_recycle(mi, &rec);
 	if (err < 0)
 		return err;
 
 	if (err > 0) {
 		reftable_iterator_destroy(&mi->stack[idx]);
-		reftable_record_destroy(&rec);
 		return 0;
 	}
 
@@ -82,20 +107,22 @@ static int merged_iter_advance_subiter(struct merged_iter *mi, size_t idx)
 	return merged_iter_advance_nonnull_subiter(mi, idx);
 }
 
-static int merged_iter_next_entry(struct merged_iter *mi,
-				  struct reftable_record *rec)
+/* takes the next record off the queue, and drops the records it shadows. On
+ * success, the caller owns entry->rec. */
+static int merged_iter_pop_entry(struct merged_iter *mi,
+				 struct pq_entry *entry)
 {
-	struct strbuf entry_key = STRBUF_INIT;
-	struct pq_entry entry = { 0 };
 	int err = 0;
 
 	if (merged_iter_pqueue_is_empty(mi->pq))
 		return 1;
 
-	entry = merged_iter_pqueue_remove(&mi->pq);
-	err = merged_iter_advance_subiter(mi, entry.index);
-	if (err < 0)
+	*entry = merged_iter_pqueue_remove(&mi->pq);
+	err = merged_iter_advance_subiter(mi, entry->index);
+	if (err < 0) {
+		reftable_record_destroy(&entry->rec);
 		return err;
+	}
 
 	/*
 	  One can also use reftable as datacenter-local storage, where the ref
@@ -105,32 +132,41 @@ static int merged_iter_next_entry(struct merged_iter *mi,
 	  such a deployment, the loop below must be changed to collect all
 	  entries for the same key, and return new the newest one.
 	*/
-	reftable_record_key(&entry.rec, &entry_key);
+	reftable_record_key(&entry->rec, &mi->entry_key);
 	while (!merged_iter_pqueue_is_empty(mi->pq)) {
 		struct pq_entry top = merged_iter_pqueue_top(mi->pq);
-		struct strbuf k = STRBUF_INIT;
 		int err = 0, cmp = 0;
 
-		reftable_record_key(&top.rec, &k);
-
-		cmp = strbuf_cmp(&k, &entry_key);
-		strbuf_release(&k);
+		reftable_record_key(&top.rec, &mi->key);
+		cmp = strbuf_cmp(&mi->key, &mi->entry_key);
 
 		if (cmp > 0) {
 			break;
 		}
 
 		merged_iter_pqueue_remove(&mi->pq);
+		merged_iter_recycle(mi, &top.rec);
 		err = merged_iter_advance_subiter(mi, top.index);
 		if (err < 0) {
+			reftable_record_destroy(&entry->rec);
 			return err;
 		}
-		reftable_record_destroy(&top.rec);
 	}
 
-	reftable_record_copy_from(rec, &entry.rec, hash_size(mi->hash_id));
-	reftable_record_destroy(&entry.rec);
-	strbuf_release(&entry_key);
+	return 0;
+}
+
+static int merged_iter_next_entry(struct merged_iter *mi,
+				  struct reftable_record *rec)
+{
+	struct pq_entry entry = { 0 };
+	int err = merged_iter_pop_entry(mi, &entry);
+	if (err != 0)
+		return err;
+
+	/* hand the record over, and refill the caller's old one later. */
+	reftable_record_swap(rec, &entry.rec);
+	merged_iter_recycle(mi, &entry.rec);
 	return 0;
 }
 
@@ -232,30 +268,36 @@ reftable_merged_table_min_update_index(struct reftable_merged_table *mt)
 }
 
 static int reftable_table_seek_record(struct reftable_table *tab,
-				      struct reftable_iterator *it,
-				      struct reftable_record *rec)
+				      struct reftable_iterator *it, void *arg)
 {
-	return tab->ops->seek_record(tab->table_arg, it, rec);
+	return tab->ops->seek_record(tab->table_arg, it,
+				     (struct reftable_record *)arg);
 }
 
-static int merged_table_seek_record(struct reftable_merged_table *mt,
-				    struct reftable_iterator *it,
-				    struct reftable_record *rec)
+/* merges the iterators that `seek` returns for each table, which produce
+ * records of type `typ`. */
+static int merged_table_seek_with(struct reftable_merged_table *mt,
+				  struct reftable_iterator *it, uint8_t typ,
+				  int (*seek)(struct reftable_table *tab,
+					      struct reftable_iterator *it,
+					      void *arg),
+				  void *arg)
 {
 	struct reftable_iterator *iters = reftable_calloc(
 		sizeof(struct reftable_iterator) * mt->stack_len);
 	struct merged_iter merged = {
 		.stack = iters,
-		.typ = reftable_record_type(rec),
+		.typ = typ,
 		.hash_id = mt->hash_id,
 		.suppress_deletions = mt->suppress_deletions,
+		.entry_key = STRBUF_INIT,
+		.key = STRBUF_INIT,
 	};
 	int n = 0;
 	int err = 0;
 	int i = 0;
 	for (i = 0; i < mt->stack_len && err == 0; i++) {
-		int e = reftable_table_seek_record(&mt->stack[i], &iters[n],
-						   rec);
+		int e = seek(&mt->stack[i], &iters[n], arg);
 		if (e < 0) {
 			err = e;
 		}
@@ -286,6 +328,14 @@ static int merged_table_seek_record(struct reftable_merged_table *mt,
 	return 0;
 }
 
+int merged_table_seek_record(struct reftable_merged_table *mt,
+			     struct reftable_iterator *it,
+			     struct reftable_record *rec)
+{
+	return merged_table_seek_with(mt, it, reftable_record_type(rec),
+				      &reftable_table_seek_record, rec);
+}
+
 int reftable_merged_table_seek_ref(struct reftable_merged_table *mt,
 				   struct reftable_iterator *it,
 				   const char *name)
@@ -319,6 +369,135 @@ int reftable_merged_table_seek_log(struct reftable_merged_table *mt,
 	return reftable_merged_table_seek_log_at(mt, it, name, max);
 }
 
+struct log_time_query {
+	struct reftable_merged_table *mt;
+	const char *name;
+	uint64_t min_time;
+	uint64_t max_time;
+};
+
+/* Only the oldest table skips entries by time: an entry it skips can't hide
+ * an older one. In the other tables, an entry outside the range may shadow an
+ * older entry inside it, so they are filtered after the merge. */
+static int reftable_table_seek_log_time_void(struct reftable_table *tab,
+					     struct reftable_iterator *it,
+					     void *arg)
+{
+	struct log_time_query *q = (struct log_time_query *)arg;
+	struct reftable_log_record log = {
+		.refname = (char *)q->name,
+		.update_index = ~((uint64_t)0),
+	};
+	struct reftable_record rec = { NULL };
+	if (tab == &q->mt->stack[0])
+		return reftable_table_seek_log_time(tab, it, q->name,
+						    q->min_time, q->max_time);
+	reftable_record_from_log(&rec, &log);
+	return reftable_table_seek_record(tab, it, &rec);
+}
+
+/* the merged log entries with a time in [min_time, max_time], and all
+ * deletions. */
+struct merged_log_time_iter {
+	struct reftable_iterator it;
+	uint64_t min_time;
+	uint64_t max_time;
+};
+
+static int merged_log_time_iter_next(void *p, struct reftable_record *rec)
+{
+	struct merged_log_time_iter *lt = (struct merged_log_time_iter *)p;
+	struct reftable_log_record *log = reftable_record_as_log(rec);
+	while (1) {
+		int err = iterator_next(&lt->it, rec);
+		if (err != 0)
+			return err;
+		if (reftable_log_record_is_deletion(log) ||
+		    (log->time >= lt->min_time && log->time <= lt->max_time))
+			return 0;
+	}
+}
+
+static void merged_log_time_iter_close(void *p)
+{
+	struct merged_log_time_iter *lt = (struct merged_log_time_iter *)p;
+	reftable_iterator_destroy(&lt->it);
+}
+
+static struct reftable_iterator_vtable merged_log_time_iter_vtable = {
+	.next = &merged_log_time_iter_next,
+	.close = &merged_log_time_iter_close,
+};
+
+int reftable_merged_table_seek_log_time(struct reftable_merged_table *mt,
+					struct reftable_iterator *it,
+					const char *name, uint64_t min_time,
+					uint64_t max_time)
+{
+	struct log_time_query q = {
+		.mt = mt,
+		.name = name,
+		.min_time = min_time,
+		.max_time = max_time,
+	};
+	struct merged_log_time_iter *lt =
+		reftable_calloc(sizeof(struct merged_log_time_iter));
+	int err = merged_table_seek_with(mt, &lt->it, BLOCK_TYPE_LOG,
+					 &reftable_table_seek_log_time_void,
+					 &q);
+	if (err < 0) {
+		reftable_free(lt);
+		return err;
+	}
+
+	lt->min_time = min_time;
+	lt->max_time = max_time;
+	assert(it->ops == NULL);
+	it->iter_arg = lt;
+	it->ops = &merged_log_time_iter_vtable;
+	return 0;
+}
+
+int reftable_merged_table_visit_refs(
+	struct reftable_merged_table *mt, const char *prefix,
+	int (*fn)(void *arg, const struct reftable_ref_record *ref), void *arg)
+{
+	struct reftable_iterator it = { NULL };
+	struct merged_iter *mi = NULL;
+	size_t prefix_len = strlen(prefix);
+	int err = reftable_merged_table_seek_ref(mt, &it, prefix);
+	if (err < 0)
+		return err;
+
+	/* the records are passed on straight from the queue, instead of being
+	 * handed over to a caller's record like merged_iter_next does. */
+	mi = it.iter_arg;
+	while (1) {
+		struct pq_entry entry = { 0 };
+		struct reftable_ref_record *ref = NULL;
+		err = merged_iter_pop_entry(mi, &entry);
+		if (err != 0) {
+			if (err > 0)
+				err = 0;
+			break;
+		}
+
+		ref = reftable_record_as_ref(&entry.rec);
+		if (strncmp(ref->refname, prefix, prefix_len)) {
+			reftable_record_destroy(&entry.rec);
+			break;
+		}
+		if (!reftable_ref_record_is_deletion(ref))
+			err = fn(arg, ref);
+		merged_iter_recycle(mi, &entry.rec);
+		if (err != 0)
+			break;
+	}
+
+	reftable_iterator_destroy(&it);
+	return err;
+}
+
 uint32_t reftable_merged_table_hash_id(struct reftable_merged_table *mt)
 {
 	return mt->hash_id;
@@ -350,11 +529,212 @@ static uint64_t reftable_merged_table_max_update_index_void(void *tab)
 		(struct reftable_merged_table *)tab);
 }
 
+/* at most this many threads search the tables for refs_for. */
+#define REFS_FOR_MAX_THREADS 8
+
+/* names of refs pointing to an object, from one table. */
+struct refs_for_task {
+	struct reftable_table *tab;
+	char **names;
+	size_t len;
+	size_t cap;
+	int err;
+};
+
+struct refs_for_search {
+	uint8_t *oid;
+	struct refs_for_task *tasks;
+	size_t len;
+	size_t next;
+	pthread_mutex_t mu;
+};
+
+static void refs_for_task_run(struct refs_for_task *t, uint8_t *oid)
+{
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int err = reftable_table_refs_for(t->tab, &it, oid);
+	while (err == 0) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		if (err != 0)
+			break;
+		if (t->len == t->cap) {
+			t->cap = 2 * t->cap + 1;
+			t->names = reftable_realloc(t->names,
+						    sizeof(char *) * t->cap);
+		}
+		t->names[t->len++] = xstrdup(ref.refname);
+	}
+	t->err = err < 0 ? err : 0;
+	reftable_ref_record_release(&ref);
+	reftable_iterator_destroy(&it);
+}
+
+static void *refs_for_worker(void *arg)
+{
+	struct refs_for_search *s = arg;
+	while (1) {
+		struct refs_for_task *t = NULL;
+		pthread_mutex_lock(&s->mu);
+		if (s->next < s->len)
+			t = &s->tasks[s->next++];
+		pthread_mutex_unlock(&s->mu);
+		if (t == NULL)
+			break;
+		refs_for_task_run(t, s->oid);
+	}
+	return NULL;
+}
+
+/* Runs the tasks, using up to REFS_FOR_MAX_THREADS threads. Each table is
+ * only read by one thread. */
+static void refs_for_search_run(struct refs_for_search *s)
+{
+	pthread_t workers[REFS_FOR_MAX_THREADS - 1];
+	int threads = s->len < REFS_FOR_MAX_THREADS ? s->len :
+						      REFS_FOR_MAX_THREADS;
+	int started = 0;
+	int i = 0;
+
+	pthread_mutex_init(&s->mu, NULL);
+	for (i = 0; i < threads - 1; i++) {
+		if (pthread_create(&workers[i], NULL, &refs_for_worker, s))
+			break;
+		started++;
+	}
+	refs_for_worker(s);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&s->mu);
+}
+
+static int name_compare(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int ref_points_to(struct reftable_ref_record *ref, uint8_t *oid,
+			 int hash_size)
+{
+	uint8_t *val1 = reftable_ref_record_val1(ref);
+	uint8_t *val2 = reftable_ref_record_val2(ref);
+	return (val1 != NULL && !memcmp(val1, oid, hash_size)) ||
+	       (val2 != NULL && !memcmp(val2, oid, hash_size));
+}
+
+int reftable_merged_table_refs_for(struct reftable_merged_table *mt,
+				   struct reftable_iterator *it, uint8_t *oid)
+{
+	struct refs_for_search search = { .oid = oid };
+	struct ref_cursor cursor = { { NULL } };
+	struct ref_array_iter *result = NULL;
+	size_t result_cap = 0;
+	char **names = NULL;
+	size_t names_len = 0;
+	int oid_len = hash_size(mt->hash_id);
+	size_t i = 0;
+	size_t j = 0;
+	int err = 0;
+
+	/* collect candidate names from every table. */
+	search.len = mt->stack_len;
+	search.tasks =
+		reftable_calloc(sizeof(struct refs_for_task) * (search.len + 1));
+	for (i = 0; i < search.len; i++)
+		search.tasks[i].tab = &mt->stack[i];
+	refs_for_search_run(&search);
+
+	for (i = 0; i < search.len; i++) {
+		struct refs_for_task *t = &search.tasks[i];
+		if (t->err < 0 && err == 0)
+			err = t->err;
+		names = reftable_realloc(names, sizeof(char *) *
+							(names_len + t->len + 1));
+		for (j = 0; j < t->len; j++)
+			names[names_len++] = t->names[j];
+		reftable_free(t->names);
+	}
+	if (err < 0)
+		goto done;
+	QSORT(names, names_len, name_compare);
+
+	/* A candidate may be shadowed by a newer table, so check what the
+	 * merged view has under its name. The names are visited in order, so
+	 * this is a single forward pass. */
+	result = reftable_calloc(sizeof(struct ref_array_iter));
+	reftable_table_from_merged_table(&cursor.tab, mt);
+	for (i = 0; i < names_len; i++) {
+		struct reftable_record dst = { NULL };
+		struct reftable_record src = { NULL };
+		if (i > 0 && !strcmp(names[i], names[i - 1]))
+			continue;
+
+		err = ref_cursor_seek(&cursor, names[i]);
+		if (err > 0)
+			break;
+		if (err < 0)
+			goto done;
+		if (strcmp(cursor.ref.refname, names[i]) ||
+		    !ref_points_to(&cursor.ref, oid, oid_len))
+			continue;
+
+		if (result->len == result_cap) {
+			result_cap = 2 * result_cap + 1;
+			result->refs = reftable_realloc(
+				result->refs,
+				sizeof(struct reftable_ref_record) * result_cap);
+		}
+		memset(&result->refs[result->len], 0,
+		       sizeof(struct reftable_ref_record));
+		reftable_record_from_ref(&dst, &result->refs[result->len++]);
+		reftable_record_from_ref(&src, &cursor.ref);
+		reftable_record_copy_from(&dst, &src, oid_len);
+	}
+	err = 0;
+	iterator_from_ref_array_iter(it, result);
+	result = NULL;
+
+done:
+	if (result != NULL) {
+		for (i = 0; i < result->len; i++)
+			reftable_ref_record_release(&result->refs[i]);
+		reftable_free(result->refs);
+		reftable_free(result);
+	}
+	ref_cursor_release(&cursor);
+	for (i = 0; i < names_len; i++)
+		reftable_free(names[i]);
+	reftable_free(names);
+	reftable_free(search.tasks);
+	return err;
+}
+
+static int reftable_merged_table_refs_for_void(void *tab,
+					       struct reftable_iterator *it,
+					       uint8_t *oid)
+{
+	return reftable_merged_table_refs_for(
+		(struct reftable_merged_table *)tab, it, oid);
+}
+
+static int reftable_merged_table_seek_log_time_void(void *tab,
+						    struct reftable_iterator *it,
+						    const char *name,
+						    uint64_t min_time,
+						    uint64_t max_time)
+{
+	return reftable_merged_table_seek_log_time(
+		(struct reftable_merged_table *)tab, it, name, min_time,
+		max_time);
+}
+
 static struct reftable_table_vtable merged_table_vtable = {
 	.seek_record = reftable_merged_table_seek_void,
 	.hash_id = reftable_merged_table_hash_id_void,
 	.min_update_index = reftable_merged_table_min_update_index_void,
 	.max_update_index = reftable_merged_table_max_update_index_void,
+	.refs_for = reftable_merged_table_refs_for_void,
+	.seek_log_time = reftable_merged_table_seek_log_time_void,
 };
 
 void reftable_table_from_merged_table(struct reftable_table *tab,
@@ -28,8 +28,19 @@ struct merged_iter {
 	uint8_t typ;
 	int suppress_deletions;
 	struct merged_iter_pqueue pq;
+	/* a record that was handed out or dropped; the next subiterator
+	 * advance decodes into its storage. Unset if ops is NULL. */
+	struct reftable_record spare;
+	/* scratch space for comparing the keys of queued records. */
+	struct strbuf entry_key;
+	struct strbuf key;
 };
 
 void merged_table_release(struct reftable_merged_table *mt);
 
+/* seeks all tables to the key of `rec`, and merges the records of its type. */
+int merged_table_seek_record(struct reftable_merged_table *mt,
+			     struct reftable_iterator *it,
+			     struct reftable_record *rec);
+
 #endif
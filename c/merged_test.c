@@ -287,6 +287,94 @@ static void test_merged(void)
 	reftable_free(bs);
 }
 
+static void test_merged_refs_for(void)
+{
+	uint8_t hash1[SHA1_SIZE] = { 1 };
+	uint8_t hash2[SHA1_SIZE] = { 2 };
+	uint8_t hash3[SHA1_SIZE] = { 3 };
+	struct reftable_ref_record r1[] = {
+		{
+			.refname = "a",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "b",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "c",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		}
+	};
+	struct reftable_ref_record r2[] = { {
+		.refname = "a",
+		.update_index = 2,
+		.value_type = REFTABLE_REF_DELETION,
+	} };
+	struct reftable_ref_record r3[] = {
+		{
+			.refname = "c",
+			.update_index = 3,
+			.value_type = REFTABLE_REF_VAL2,
+			.value.val2.value = hash2,
+			.value.val2.target_value = hash3,
+		},
+		{
+			.refname = "d",
+			.update_index = 3,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+	};
+	struct {
+		uint8_t *oid;
+		const char *want[3];
+	} cases[] = {
+		/* "a" is deleted, and "c" was changed. */
+		{ hash1, { "b", "d", NULL } },
+		{ hash2, { "c", NULL } },
+		{ hash3, { "c", NULL } },
+	};
+	struct reftable_ref_record *refs[] = { r1, r2, r3 };
+	int sizes[3] = { 3, 1, 2 };
+	struct strbuf bufs[3] = { STRBUF_INIT, STRBUF_INIT, STRBUF_INIT };
+	struct reftable_block_source *bs = NULL;
+	struct reftable_reader **readers = NULL;
+	struct reftable_merged_table *mt =
+		merged_table_from_records(refs, &bs, &readers, sizes, bufs, 3);
+	int i = 0;
+	int j = 0;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		struct reftable_iterator it = { NULL };
+		struct reftable_ref_record ref = { NULL };
+		int err = reftable_merged_table_refs_for(mt, &it, cases[i].oid);
+		EXPECT_ERR(err);
+		for (j = 0; cases[i].want[j] != NULL; j++) {
+			err = reftable_iterator_next_ref(&it, &ref);
+			EXPECT_ERR(err);
+			EXPECT_STREQ(ref.refname, cases[i].want[j]);
+		}
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT(err == 1);
+		reftable_ref_record_release(&ref);
+		reftable_iterator_destroy(&it);
+	}
+
+	for (i = 0; i < 3; i++) {
+		strbuf_release(&bufs[i]);
+	}
+	readers_destroy(readers, 3);
+	reftable_merged_table_free(mt);
+	reftable_free(bs);
+}
+
 static void test_default_write_opts(void)
 {
 	struct reftable_write_options opts = { 0 };
@@ -331,11 +419,120 @@ static void test_default_write_opts(void)
 	strbuf_release(&buf);
 }
 
-/* XXX test refs_for(oid) */
+static int advertise_ref(void *arg, const struct reftable_ref_record *ref)
+{
+	struct strbuf *out = arg;
+	char line[200];
+	int n = reftable_ref_record_format_pkt_line(ref, SHA1_ID, line,
+						    sizeof(line));
+	EXPECT(n >= 0 && n <= sizeof(line));
+	strbuf_add(out, line, n);
+	return 0;
+}
+
+static int stop_visit(void *arg, const struct reftable_ref_record *ref)
+{
+	int *calls = arg;
+	(*calls)++;
+	return 7;
+}
+
+static void test_merged_visit_refs(void)
+{
+	uint8_t hash1[SHA1_SIZE] = { 1 };
+	uint8_t hash2[SHA1_SIZE] = { 2 };
+	uint8_t hash3[SHA1_SIZE] = { 3 };
+	struct reftable_ref_record r1[] = {
+		{
+			.refname = "refs/heads/a",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "refs/heads/b",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "refs/tags/v1",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL2,
+			.value.val2.value = hash2,
+			.value.val2.target_value = hash3,
+		},
+	};
+	struct reftable_ref_record r2[] = {
+		{
+			.refname = "HEAD",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "refs/heads/a",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_DELETION,
+		},
+		{
+			.refname = "refs/heads/c",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "refs/heads/b",
+		},
+	};
+	struct reftable_ref_record *refs[] = { r1, r2 };
+	int sizes[] = { 3, 3 };
+	struct strbuf bufs[2] = { STRBUF_INIT, STRBUF_INIT };
+	struct reftable_block_source *bs = NULL;
+	struct reftable_reader **readers = NULL;
+	struct reftable_merged_table *mt =
+		merged_table_from_records(refs, &bs, &readers, sizes, bufs, 2);
+	struct strbuf out = STRBUF_INIT;
+	int calls = 0;
+	int err = 0;
+	int i = 0;
+
+	err = reftable_merged_table_visit_refs(mt, "refs/", &advertise_ref,
+					       &out);
+	EXPECT_ERR(err);
+	EXPECT_STREQ(out.buf,
+		     "003a0100000000000000000000000000000000000000 refs/heads/b\n"
+		     "003a0200000000000000000000000000000000000000 refs/tags/v1\n"
+		     "003d0300000000000000000000000000000000000000 refs/tags/v1^{}\n");
+
+	strbuf_reset(&out);
+	err = reftable_merged_table_visit_refs(mt, "refs/heads/",
+					       &advertise_ref, &out);
+	EXPECT_ERR(err);
+	EXPECT_STREQ(out.buf,
+		     "003a0100000000000000000000000000000000000000 refs/heads/b\n");
+
+	err = reftable_merged_table_visit_refs(mt, "", &stop_visit, &calls);
+	EXPECT(err == 7);
+	EXPECT(calls == 1);
+
+	/* a buffer that is too small is left alone. */
+	strbuf_reset(&out);
+	strbuf_addstr(&out, "xyz");
+	EXPECT(reftable_ref_record_format_pkt_line(&r1[2], SHA1_ID, out.buf,
+						   out.len) == 119);
+	EXPECT_STREQ(out.buf, "xyz");
+
+	strbuf_release(&out);
+	for (i = 0; i < ARRAY_SIZE(bufs); i++)
+		strbuf_release(&bufs[i]);
+	readers_destroy(readers, 2);
+	reftable_merged_table_free(mt);
+	reftable_free(bs);
+}
 
 int merged_test_main(int argc, const char *argv[])
 {
 	test_merged_between();
+	test_merged_refs_for();
+	test_merged_visit_refs();
 	test_pq();
 	test_merged();
 	test_default_write_opts();
@@ -0,0 +1,366 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "obj_index.h"
+
+#include "basics.h"
+#include "reftable-error.h"
+
+/* Once there are this many runs, they are merged into one, so we don't run
+ * out of file descriptors. */
+#define OBJ_INDEX_MAX_RUNS 32
+
+void obj_index_init(struct obj_index *idx, int hash_size,
+		    uint64_t memory_limit)
+{
+	memset(idx, 0, sizeof(*idx));
+	idx->hash_size = hash_size;
+	idx->memory_limit = memory_limit;
+}
+
+static int obj_index_entry_compare(const void *a, const void *b)
+{
+	const struct obj_index_entry *ea = a;
+	const struct obj_index_entry *eb = b;
+	int c = memcmp(ea->hash, eb->hash, sizeof(ea->hash));
+	if (c != 0)
+		return c;
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	return 0;
+}
+
+/* raises *max to the common prefix of a and b, if their object IDs differ. */
+static void update_common_prefix(int *max, struct obj_index_entry *a,
+				 struct obj_index_entry *b, int hash_size)
+{
+	int n = common_prefix_len(a->hash, b->hash, hash_size);
+	if (n < hash_size && n > *max)
+		*max = n;
+}
+
+static void obj_index_sort(struct obj_index *idx)
+{
+	size_t len = 0;
+	size_t i = 0;
+	if (idx->sorted)
+		return;
+
+	QSORT(idx->entries, idx->len, obj_index_entry_compare);
+	idx->common_prefix = 0;
+	for (i = 0; i < idx->len; i++) {
+		if (len > 0) {
+			if (!obj_index_entry_compare(&idx->entries[len - 1],
+						     &idx->entries[i]))
+				continue;
+			update_common_prefix(&idx->common_prefix,
+					     &idx->entries[len - 1],
+					     &idx->entries[i], idx->hash_size);
+		}
+		idx->entries[len++] = idx->entries[i];
+	}
+	idx->len = len;
+	idx->sorted = 1;
+}
+
+struct run_cursor {
+	FILE *f;
+	struct obj_index_entry cur;
+};
+
+/* 0 = OK, 1 = EOF, < 0 = error. */
+static int run_cursor_next(struct run_cursor *c)
+{
+	if (fread(&c->cur, sizeof(c->cur), 1, c->f) == 1)
+		return 0;
+	return ferror(c->f) ? REFTABLE_IO_ERROR : 1;
+}
+
+static void run_heap_sift_down(struct run_cursor **heap, size_t len, size_t i)
+{
+	while (1) {
+		size_t min = i;
+		size_t l = 2 * i + 1;
+		size_t r = 2 * i + 2;
+		if (l < len &&
+		    obj_index_entry_compare(&heap[l]->cur, &heap[min]->cur) < 0)
+			min = l;
+		if (r < len &&
+		    obj_index_entry_compare(&heap[r]->cur, &heap[min]->cur) < 0)
+			min = r;
+		if (min == i)
+			return;
+		SWAP(heap[i], heap[min]);
+		i = min;
+	}
+}
+
+/* Merges all runs, and calls `emit` for each distinct entry in order. */
+static int obj_index_merge_runs(struct obj_index *idx,
+				int (*emit)(void *arg,
+					    struct obj_index_entry *e),
+				void *arg)
+{
+	struct run_cursor *cursors =
+		reftable_calloc(sizeof(struct run_cursor) * idx->runs_len);
+	struct run_cursor **heap =
+		reftable_calloc(sizeof(struct run_cursor *) * idx->runs_len);
+	struct obj_index_entry last = { { 0 } };
+	int have_last = 0;
+	int common_prefix = 0;
+	size_t heap_len = 0;
+	size_t i = 0;
+	int err = 0;
+
+	for (i = 0; i < idx->runs_len; i++) {
+		cursors[i].f = idx->runs[i];
+		rewind(cursors[i].f);
+		err = run_cursor_next(&cursors[i]);
+		if (err < 0)
+			goto done;
+		if (err == 0)
+			heap[heap_len++] = &cursors[i];
+	}
+	err = 0;
+	for (i = heap_len / 2; i-- > 0;)
+		run_heap_sift_down(heap, heap_len, i);
+
+	while (heap_len > 0) {
+		struct run_cursor *top = heap[0];
+		if (!have_last || obj_index_entry_compare(&last, &top->cur)) {
+			if (have_last)
+				update_common_prefix(&common_prefix, &last,
+						     &top->cur, idx->hash_size);
+			last = top->cur;
+			have_last = 1;
+			err = emit(arg, &last);
+			if (err != 0)
+				goto done;
+		}
+
+		err = run_cursor_next(top);
+		if (err < 0)
+			goto done;
+		if (err > 0)
+			heap[0] = heap[--heap_len];
+		err = 0;
+		run_heap_sift_down(heap, heap_len, 0);
+	}
+	idx->common_prefix = common_prefix;
+
+done:
+	reftable_free(heap);
+	reftable_free(cursors);
+	return err;
+}
+
+static int write_entry(void *arg, struct obj_index_entry *e)
+{
+	FILE *f = arg;
+	return fwrite(e, sizeof(*e), 1, f) == 1 ? 0 : REFTABLE_IO_ERROR;
+}
+
+static int obj_index_compact_runs(struct obj_index *idx)
+{
+	FILE *f = tmpfile();
+	size_t i = 0;
+	int err = 0;
+	if (f == NULL)
+		return REFTABLE_IO_ERROR;
+
+	err = obj_index_merge_runs(idx, &write_entry, f);
+	if (err == 0 && fflush(f) != 0)
+		err = REFTABLE_IO_ERROR;
+	if (err != 0) {
+		fclose(f);
+		return err;
+	}
+
+	for (i = 0; i < idx->runs_len; i++)
+		fclose(idx->runs[i]);
+	idx->runs[0] = f;
+	idx->runs_len = 1;
+	return 0;
+}
+
+/* Writes the in-memory entries to a new run. */
+static int obj_index_spill(struct obj_index *idx)
+{
+	FILE *f = NULL;
+	size_t i = 0;
+	int err = 0;
+	if (idx->len == 0)
+		return 0;
+
+	obj_index_sort(idx);
+	f = tmpfile();
+	if (f == NULL)
+		return REFTABLE_IO_ERROR;
+	for (i = 0; i < idx->len && err == 0; i++)
+		err = write_entry(f, &idx->entries[i]);
+	if (err == 0 && fflush(f) != 0)
+		err = REFTABLE_IO_ERROR;
+	if (err != 0) {
+		fclose(f);
+		return err;
+	}
+
+	idx->runs = reftable_realloc(idx->runs,
+				     sizeof(FILE *) * (idx->runs_len + 1));
+	idx->runs[idx->runs_len++] = f;
+	idx->len = 0;
+
+	if (idx->runs_len >= OBJ_INDEX_MAX_RUNS)
+		return obj_index_compact_runs(idx);
+	return 0;
+}
+
+int obj_index_add(struct obj_index *idx, uint8_t *hash, uint64_t offset)
+{
+	struct obj_index_entry *e = NULL;
+	size_t max_len = 0;
+
+	if (idx->len > 0) {
+		e = &idx->entries[idx->len - 1];
+		if (e->offset == offset && !memcmp(e->hash, hash, idx->hash_size))
+			return 0;
+	}
+
+	if (idx->memory_limit > 0) {
+		max_len = idx->memory_limit / sizeof(struct obj_index_entry);
+		if (max_len == 0)
+			max_len = 1;
+		if (idx->len == max_len) {
+			int err = obj_index_spill(idx);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	if (idx->len == idx->cap) {
+		idx->cap = 2 * idx->cap + 1;
+		if (max_len > 0 && idx->cap > max_len)
+			idx->cap = max_len;
+		idx->entries = reftable_realloc(
+			idx->entries, sizeof(struct obj_index_entry) * idx->cap);
+	}
+
+	e = &idx->entries[idx->len++];
+	memset(e->hash, 0, sizeof(e->hash));
+	memcpy(e->hash, hash, idx->hash_size);
+	e->offset = offset;
+	idx->sorted = 0;
+	return 0;
+}
+
+struct obj_index_group {
+	int (*fn)(void *arg, uint8_t *hash, uint64_t *offsets,
+		  size_t offsets_len);
+	void *arg;
+	int hash_size;
+
+	uint8_t hash[SHA256_SIZE];
+	uint64_t *offsets;
+	size_t len;
+	size_t cap;
+};
+
+static int obj_index_group_flush(struct obj_index_group *g)
+{
+	int err = 0;
+	if (g->len == 0)
+		return 0;
+	err = g->fn(g->arg, g->hash, g->offsets, g->len);
+	g->len = 0;
+	return err;
+}
+
+static int obj_index_group_add(void *arg, struct obj_index_entry *e)
+{
+	struct obj_index_group *g = arg;
+	if (g->len > 0 && memcmp(g->hash, e->hash, g->hash_size)) {
+		int err = obj_index_group_flush(g);
+		if (err != 0)
+			return err;
+	}
+	if (g->len == 0)
+		memcpy(g->hash, e->hash, sizeof(g->hash));
+
+	if (g->len == g->cap) {
+		g->cap = 2 * g->cap + 1;
+		g->offsets = reftable_realloc(g->offsets,
+					      sizeof(uint64_t) * g->cap);
+	}
+	g->offsets[g->len++] = e->offset;
+	return 0;
+}
+
+int obj_index_walk(struct obj_index *idx,
+		   int (*fn)(void *arg, uint8_t *hash, uint64_t *offsets,
+			     size_t offsets_len),
+		   void *arg)
+{
+	struct obj_index_group g = {
+		.fn = fn,
+		.arg = arg,
+		.hash_size = idx->hash_size,
+	};
+	size_t i = 0;
+	int err = 0;
+
+	if (idx->runs_len > 0) {
+		err = obj_index_spill(idx);
+		if (err == 0)
+			err = obj_index_merge_runs(idx, &obj_index_group_add,
+						   &g);
+	} else {
+		obj_index_sort(idx);
+		for (i = 0; i < idx->len && err == 0; i++)
+			err = obj_index_group_add(&g, &idx->entries[i]);
+	}
+	if (err == 0)
+		err = obj_index_group_flush(&g);
+
+	reftable_free(g.offsets);
+	return err;
+}
+
+int obj_index_common_prefix(struct obj_index *idx, int *dest)
+{
+	int err = 0;
+	if (idx->runs_len > 0) {
+		err = obj_index_spill(idx);
+		if (err == 0 && idx->runs_len > 1)
+			err = obj_index_compact_runs(idx);
+		if (err < 0)
+			return err;
+	} else {
+		obj_index_sort(idx);
+	}
+	*dest = idx->common_prefix;
+	return 0;
+}
+
+void obj_index_reset(struct obj_index *idx)
+{
+	size_t i = 0;
+	for (i = 0; i < idx->runs_len; i++)
+		fclose(idx->runs[i]);
+	idx->runs_len = 0;
+	idx->len = 0;
+	idx->sorted = 0;
+	idx->common_prefix = 0;
+}
+
+void obj_index_release(struct obj_index *idx)
+{
+	obj_index_reset(idx);
+	FREE_AND_NULL(idx->runs);
+	FREE_AND_NULL(idx->entries);
+	idx->cap = 0;
+}
@@ -0,0 +1,69 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef OBJ_INDEX_H
+#define OBJ_INDEX_H
+
+#include "system.h"
+
+/* an object ID, referenced from the ref block at `offset`. */
+struct obj_index_entry {
+	uint8_t hash[SHA256_SIZE];
+	uint64_t offset;
+};
+
+/*
+ * obj_index collects (object ID, ref block offset) pairs for the 'o' section.
+ * If a memory limit is set, the pairs are sorted and spilled to temporary
+ * files ("runs") whenever the limit is reached, and merged when they are
+ * walked.
+ */
+struct obj_index {
+	int hash_size;
+	/* in bytes; 0 means unlimited. */
+	uint64_t memory_limit;
+
+	/* pairs not yet spilled. */
+	struct obj_index_entry *entries;
+	size_t len;
+	size_t cap;
+	/* whether entries is sorted and free of duplicates. */
+	int sorted;
+	/* length of the longest prefix shared by two distinct object IDs,
+	 * found while sorting entries or merging runs. */
+	int common_prefix;
+
+	FILE **runs;
+	size_t runs_len;
+};
+
+void obj_index_init(struct obj_index *idx, int hash_size,
+		    uint64_t memory_limit);
+
+/* adds a pair. Consecutive duplicates are dropped. */
+int obj_index_add(struct obj_index *idx, uint8_t *hash, uint64_t offset);
+
+/* calls `fn` for each distinct object ID in sorted order, with its sorted
+ * offsets. Stops at the first non-zero return of `fn`, and returns it. Can be
+ * called repeatedly. */
+int obj_index_walk(struct obj_index *idx,
+		   int (*fn)(void *arg, uint8_t *hash, uint64_t *offsets,
+			     size_t offsets_len),
+		   void *arg);
+
+/* sets `dest` to the length of the longest prefix shared by two distinct
+ * object IDs. This merges all runs into one, so a following obj_index_walk
+ * reads the pairs in a single pass. */
+int obj_index_common_prefix(struct obj_index *idx, int *dest);
+
+/* drops all pairs, keeping the allocated storage for reuse. */
+void obj_index_reset(struct obj_index *idx);
+
+void obj_index_release(struct obj_index *idx);
+
+#endif
@@ -0,0 +1,333 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "radix.h"
+
+#include <pthread.h>
+
+#include "basics.h"
+
+/* below this, buckets are finished with an insertion sort. */
+#define RADIX_INSERTION_THRESHOLD 32
+
+/* inputs smaller than this are always sorted on the calling thread. */
+#define RADIX_PARALLEL_THRESHOLD (1 << 16)
+
+/* the key of a record, and its position in the input. The records themselves
+ * are only moved once, after the entries are sorted. */
+struct radix_entry {
+	const uint8_t *key;
+	uint64_t update_index;
+	size_t idx;
+};
+
+/* a range of entries whose keys share their first `depth` bytes. */
+struct radix_task {
+	struct radix_entry *entries;
+	struct radix_entry *tmp;
+	size_t len;
+	size_t depth;
+};
+
+struct radix_sort {
+	/* boolean: order equal keys by descending update_index. */
+	int logs;
+
+	/* for threaded sorts. */
+	struct radix_task *tasks;
+	size_t tasks_len;
+	size_t tasks_cap;
+	size_t task_size;
+	size_t next_task;
+	pthread_mutex_t mu;
+};
+
+/* compares the keys from `depth` onwards, then the update_index. */
+static int radix_entry_compare(struct radix_sort *rs,
+			       const struct radix_entry *a,
+			       const struct radix_entry *b, size_t depth)
+{
+	int cmp = strcmp((const char *)a->key + depth,
+			 (const char *)b->key + depth);
+	if (cmp || !rs->logs)
+		return cmp;
+	if (a->update_index > b->update_index)
+		return -1;
+	return (a->update_index < b->update_index) ? 1 : 0;
+}
+
+/* orders entries with equal keys: descending update_index, then input order
+ * so the sort stays stable. */
+static int radix_entry_compare_update_index(const void *a, const void *b)
+{
+	const struct radix_entry *ea = a;
+	const struct radix_entry *eb = b;
+	if (ea->update_index != eb->update_index)
+		return ea->update_index > eb->update_index ? -1 : 1;
+	if (ea->idx != eb->idx)
+		return ea->idx < eb->idx ? -1 : 1;
+	return 0;
+}
+
+static void radix_insertion_sort(struct radix_sort *rs,
+				 struct radix_entry *entries, size_t len,
+				 size_t depth)
+{
+	size_t i = 0;
+	for (i = 1; i < len; i++) {
+		struct radix_entry e = entries[i];
+		size_t j = i;
+		while (j > 0 &&
+		       radix_entry_compare(rs, &entries[j - 1], &e, depth) > 0) {
+			entries[j] = entries[j - 1];
+			j--;
+		}
+		entries[j] = e;
+	}
+}
+
+/* returns how many bytes from t->depth onwards all keys in `t` share. */
+static size_t radix_common_prefix(struct radix_task *t)
+{
+	const uint8_t *first = t->entries[0].key + t->depth;
+	size_t n = strlen((const char *)first);
+	size_t i = 0;
+	for (i = 1; i < t->len && n > 0; i++) {
+		const uint8_t *key = t->entries[i].key + t->depth;
+		size_t j = 0;
+		while (j < n && key[j] == first[j])
+			j++;
+		n = j;
+	}
+	return n;
+}
+
+/*
+ * Distributes `t` over buckets by the key byte at t->depth, skipping bytes
+ * that all keys share. Returns 1 if the range is already sorted, and 0 if it
+ * was partitioned; then counts[] holds the bucket sizes and t->depth the byte
+ * they were split on. Bucket 0 (keys that end at t->depth) is sorted
+ * completely.
+ */
+static int radix_partition(struct radix_sort *rs, struct radix_task *t,
+			   size_t counts[256])
+{
+	size_t starts[256];
+	size_t i = 0;
+	int b = 0;
+
+	while (1) {
+		int single = -1;
+		if (t->len <= RADIX_INSERTION_THRESHOLD) {
+			radix_insertion_sort(rs, t->entries, t->len, t->depth);
+			return 1;
+		}
+
+		memset(counts, 0, sizeof(size_t) * 256);
+		for (i = 0; i < t->len; i++)
+			counts[t->entries[i].key[t->depth]]++;
+
+		for (b = 0; b < 256; b++) {
+			if (counts[b] == t->len) {
+				single = b;
+				break;
+			}
+		}
+		if (single == 0) {
+			/* all keys are equal. */
+			if (rs->logs)
+				QSORT(t->entries, t->len,
+				      radix_entry_compare_update_index);
+			return 1;
+		}
+		if (single < 0)
+			break;
+		t->depth += radix_common_prefix(t);
+	}
+
+	starts[0] = 0;
+	for (b = 1; b < 256; b++)
+		starts[b] = starts[b - 1] + counts[b - 1];
+	for (i = 0; i < t->len; i++)
+		t->tmp[starts[t->entries[i].key[t->depth]]++] = t->entries[i];
+	memcpy(t->entries, t->tmp, sizeof(struct radix_entry) * t->len);
+
+	if (rs->logs && counts[0] > 1)
+		QSORT(t->entries, counts[0], radix_entry_compare_update_index);
+	return 0;
+}
+
+static void radix_sort_task(struct radix_sort *rs, struct radix_task *t)
+{
+	size_t counts[256];
+	size_t off = 0;
+	int b = 0;
+
+	if (radix_partition(rs, t, counts))
+		return;
+
+	off = counts[0];
+	for (b = 1; b < 256; b++) {
+		struct radix_task sub = {
+			.entries = t->entries + off,
+			.tmp = t->tmp + off,
+			.len = counts[b],
+			.depth = t->depth + 1,
+		};
+		if (sub.len > 1)
+			radix_sort_task(rs, &sub);
+		off += counts[b];
+	}
+}
+
+/* Partitions `t` on the calling thread until the ranges are at most
+ * rs->task_size entries, and queues them as tasks. */
+static void radix_split_tasks(struct radix_sort *rs, struct radix_task *t)
+{
+	size_t counts[256];
+	size_t off = 0;
+	int b = 0;
+
+	if (t->len <= rs->task_size) {
+		if (rs->tasks_len == rs->tasks_cap) {
+			rs->tasks_cap = 2 * rs->tasks_cap + 1;
+			rs->tasks = reftable_realloc(
+				rs->tasks, sizeof(struct radix_task) *
+						   rs->tasks_cap);
+		}
+		rs->tasks[rs->tasks_len++] = *t;
+		return;
+	}
+
+	if (radix_partition(rs, t, counts))
+		return;
+
+	off = counts[0];
+	for (b = 1; b < 256; b++) {
+		struct radix_task sub = {
+			.entries = t->entries + off,
+			.tmp = t->tmp + off,
+			.len = counts[b],
+			.depth = t->depth + 1,
+		};
+		if (sub.len > 1)
+			radix_split_tasks(rs, &sub);
+		off += counts[b];
+	}
+}
+
+static void *radix_worker(void *arg)
+{
+	struct radix_sort *rs = arg;
+	while (1) {
+		struct radix_task *t = NULL;
+		pthread_mutex_lock(&rs->mu);
+		if (rs->next_task < rs->tasks_len)
+			t = &rs->tasks[rs->next_task++];
+		pthread_mutex_unlock(&rs->mu);
+		if (t == NULL)
+			break;
+		radix_sort_task(rs, t);
+	}
+	return NULL;
+}
+
+static void radix_sort_entries(struct radix_entry *entries, size_t len,
+			       int logs, int threads)
+{
+	struct radix_entry *tmp = NULL;
+	struct radix_sort rs = { .logs = logs };
+	struct radix_task all = { .entries = entries, .len = len };
+	pthread_t *workers = NULL;
+	int started = 0;
+	int i = 0;
+
+	if (len < 2)
+		return;
+	tmp = reftable_malloc(sizeof(struct radix_entry) * len);
+	all.tmp = tmp;
+
+	if (threads <= 1 || len < RADIX_PARALLEL_THRESHOLD) {
+		radix_sort_task(&rs, &all);
+		reftable_free(tmp);
+		return;
+	}
+
+	/* several tasks per thread, so a skewed split still balances. */
+	rs.task_size = len / (4 * threads) + 1;
+	radix_split_tasks(&rs, &all);
+
+	pthread_mutex_init(&rs.mu, NULL);
+	workers = reftable_calloc(sizeof(pthread_t) * (threads - 1));
+	for (i = 0; i < threads - 1; i++) {
+		if (pthread_create(&workers[i], NULL, &radix_worker, &rs))
+			break;
+		started++;
+	}
+	radix_worker(&rs);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&rs.mu);
+
+	reftable_free(workers);
+	reftable_free(rs.tasks);
+	reftable_free(tmp);
+}
+
+static const uint8_t *radix_key(const char *name)
+{
+	return (const uint8_t *)(name ? name : "");
+}
+
+void radix_sort_refs(struct reftable_ref_record *refs, size_t n, int threads)
+{
+	struct radix_entry *entries = NULL;
+	struct reftable_ref_record *copy = NULL;
+	size_t i = 0;
+	if (n < 2)
+		return;
+
+	entries = reftable_malloc(sizeof(struct radix_entry) * n);
+	for (i = 0; i < n; i++) {
+		entries[i].key = radix_key(refs[i].refname);
+		entries[i].update_index = refs[i].update_index;
+		entries[i].idx = i;
+	}
+	radix_sort_entries(entries, n, 0, threads);
+
+	copy = reftable_malloc(sizeof(struct reftable_ref_record) * n);
+	memcpy(copy, refs, sizeof(struct reftable_ref_record) * n);
+	for (i = 0; i < n; i++)
+		refs[i] = copy[entries[i].idx];
+	reftable_free(copy);
+	reftable_free(entries);
+}
+
+void radix_sort_logs(struct reftable_log_record *logs, size_t n, int threads)
+{
+	struct radix_entry *entries = NULL;
+	struct reftable_log_record *copy = NULL;
+	size_t i = 0;
+	if (n < 2)
+		return;
+
+	entries = reftable_malloc(sizeof(struct radix_entry) * n);
+	for (i = 0; i < n; i++) {
+		entries[i].key = radix_key(logs[i].refname);
+		entries[i].update_index = logs[i].update_index;
+		entries[i].idx = i;
+	}
+	radix_sort_entries(entries, n, 1, threads);
+
+	copy = reftable_malloc(sizeof(struct reftable_log_record) * n);
+	memcpy(copy, logs, sizeof(struct reftable_log_record) * n);
+	for (i = 0; i < n; i++)
+		logs[i] = copy[entries[i].idx];
+	reftable_free(copy);
+	reftable_free(entries);
+}
@@ -0,0 +1,25 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef RADIX_H
+#define RADIX_H
+
+#include "system.h"
+
+#include "reftable-record.h"
+
+/*
+ * Stable MSD radix sorts that put records in the order the writer requires:
+ * refs by name, logs by name and then by descending update_index. Large
+ * inputs are sorted using up to `threads` threads; 0 or 1 sorts on the calling
+ * thread.
+ */
+void radix_sort_refs(struct reftable_ref_record *refs, size_t n, int threads);
+void radix_sort_logs(struct reftable_log_record *logs, size_t n, int threads);
+
+#endif
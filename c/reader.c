@@ -148,11 +148,16 @@ static int parse_footer(struct reftable_reader *r, uint8_t *footer,
 	}
 
 	first_block_typ = header[header_size(r->version)];
-	r->ref_offsets.is_present = (first_block_typ == BLOCK_TYPE_REF);
+	r->ref_offsets.is_present = (first_block_typ == BLOCK_TYPE_REF ||
+				     first_block_typ == BLOCK_TYPE_REF_DICT ||
+				     first_block_typ == BLOCK_TYPE_REF_COLUMNS);
 	r->ref_offsets.offset = 0;
 	r->log_offsets.is_present = (first_block_typ == BLOCK_TYPE_LOG ||
 				     r->log_offsets.offset > 0);
 	r->obj_offsets.is_present = r->obj_offsets.offset > 0;
+	r->obj_full_width = r->obj_offsets.is_present && r->object_id_len == 0;
+	if (r->obj_full_width)
+		r->object_id_len = hash_size(r->hash_id);
 	err = 0;
 done:
 	return err;
@@ -209,6 +214,10 @@ struct table_iter {
 	uint64_t block_off;
 	struct block_iter bi;
 	int is_finished;
+
+	/* if set, records that don't point to this object ID may be skipped.
+	 * Not owned. */
+	uint8_t *filter_oid;
 };
 #define TABLE_ITER_INIT                          \
 	{                                        \
@@ -228,7 +237,14 @@ static void table_iter_copy_from(struct table_iter *dest,
 static int table_iter_next_in_block(struct table_iter *ti,
 				    struct reftable_record *rec)
 {
-	int res = block_iter_next(&ti->bi, rec);
+	int res = 0;
+	if (ti->filter_oid != NULL) {
+		res = block_iter_seek_oid(&ti->bi, ti->filter_oid);
+		if (res < 0)
+			return res;
+	}
+
+	res = block_iter_next(&ti->bi, rec);
 	if (res == 0 && reftable_record_type(rec) == BLOCK_TYPE_REF) {
 		((struct reftable_ref_record *)rec->data)->update_index +=
 			ti->r->min_update_index;
@@ -262,6 +278,9 @@ static int32_t extract_block_size(uint8_t *data, uint8_t *typ, uint64_t off,
 	if (reftable_is_block_type(*typ)) {
 		result = get_be24(data + 1);
 	}
+	/* dictionary and columnar ref blocks hold ref records. */
+	if (*typ == BLOCK_TYPE_REF_DICT || *typ == BLOCK_TYPE_REF_COLUMNS)
+		*typ = BLOCK_TYPE_REF;
 	return result;
 }
 
@@ -282,6 +301,7 @@ int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
 	err = reader_get_block(r, &block, next_off, guess_block_size);
 	if (err < 0)
 		return err;
+	r->blocks_read++;
 
 	block_size = extract_block_size(block.data, &block_typ, next_off,
 					r->version);
@@ -292,6 +312,8 @@ int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
 		reftable_block_done(&block);
 		return 1;
 	}
+	if (block_typ == BLOCK_TYPE_LOG)
+		r->blocks_inflated++;
 
 	if (block_size > guess_block_size) {
 		reftable_block_done(&block);
@@ -609,6 +631,278 @@ int reftable_reader_seek_log(struct reftable_reader *r,
 	return reftable_reader_seek_log_at(r, it, name, max);
 }
 
+/* iterates over the log records from a key onwards that have a time in
+ * [min_time, max_time], and over all deletions. */
+struct log_time_iter {
+	struct reftable_reader *r;
+	struct strbuf want;
+	uint64_t min_time;
+	uint64_t max_time;
+
+	/* the log blocks that may hold matches, from the log index. */
+	uint64_t *offsets;
+	size_t offsets_len;
+	size_t offsets_cap;
+	size_t offsets_idx;
+	struct table_iter ti;
+	int in_block;
+
+	/* without a log index, all records from `want` are read. */
+	int linear;
+	struct reftable_iterator it;
+};
+
+/* returns how many index levels of the section at `offs` are below the top
+ * one, and where the bottom level starts. The bottom level is found by its
+ * first record, which points at the first block of the section. */
+static int reader_index_depth(struct reftable_reader *r,
+			      struct reftable_reader_offsets *offs, int *depth,
+			      uint64_t *bottom)
+{
+	struct table_iter ti = TABLE_ITER_INIT;
+	struct reftable_index_record idx = { .last_key = STRBUF_INIT };
+	struct reftable_record rec = { NULL };
+	uint64_t off = offs->index_offset;
+	int err = 0;
+
+	reftable_record_from_index(&rec, &idx);
+	*depth = 0;
+	while (1) {
+		err = reader_table_iter_at(r, &ti, off, BLOCK_TYPE_INDEX);
+		if (err == 0)
+			err = table_iter_next_in_block(&ti, &rec);
+		table_iter_block_done(&ti);
+		if (err > 0)
+			err = REFTABLE_FORMAT_ERROR;
+		if (err < 0 || idx.offset == offs->offset)
+			break;
+		if (idx.offset >= off) {
+			/* levels are written bottom up. */
+			err = REFTABLE_FORMAT_ERROR;
+			break;
+		}
+		off = idx.offset;
+		(*depth)++;
+	}
+	*bottom = off;
+
+	block_iter_close(&ti.bi);
+	reftable_record_release(&rec);
+	return err;
+}
+
+int reader_section_blocks(struct reftable_reader *r, uint8_t typ,
+			  struct reftable_index_record **dest, size_t *len,
+			  uint64_t *end)
+{
+	struct reftable_reader_offsets *offs = reader_offsets_for(r, typ);
+	struct table_iter ti = TABLE_ITER_INIT;
+	struct reftable_index_record idx = { .last_key = STRBUF_INIT };
+	struct reftable_record rec = { NULL };
+	size_t cap = 0;
+	int depth = 0;
+	int err = 0;
+
+	*dest = NULL;
+	*len = 0;
+	if (!offs->is_present || offs->index_offset == 0)
+		return 1;
+
+	err = reader_index_depth(r, offs, &depth, end);
+	if (err == 0)
+		err = reader_table_iter_at(r, &ti, *end, BLOCK_TYPE_INDEX);
+	if (err > 0)
+		err = REFTABLE_FORMAT_ERROR;
+
+	reftable_record_from_index(&rec, &idx);
+	while (err == 0) {
+		err = table_iter_next(&ti, &rec);
+		if (err > 0) {
+			err = 0;
+			break;
+		}
+		/* the level above points at the blocks of this one. */
+		if (err < 0 || idx.offset >= *end)
+			break;
+
+		if (*len == cap) {
+			cap = 2 * cap + 1;
+			*dest = reftable_realloc(
+				*dest, sizeof(struct reftable_index_record) * cap);
+		}
+		(*dest)[(*len)++] = idx;
+		strbuf_init(&idx.last_key, 0);
+	}
+
+	table_iter_close(&ti);
+	reftable_record_release(&rec);
+	if (err < 0) {
+		while (*len > 0)
+			strbuf_release(&(*dest)[--(*len)].last_key);
+		FREE_AND_NULL(*dest);
+	}
+	return err;
+}
+
+/* collects the log blocks below the index block at `off` that may hold
+ * matches. `depth` is the number of index levels below it. On the top level,
+ * the blocks after `off` are read too. */
+static int log_time_iter_collect(struct log_time_iter *lt, uint64_t off,
+				 int depth, int top)
+{
+	struct table_iter ti = TABLE_ITER_INIT;
+	struct reftable_index_record idx = { .last_key = STRBUF_INIT };
+	struct reftable_record rec = { NULL };
+	int err = reader_table_iter_at(lt->r, &ti, off, BLOCK_TYPE_INDEX);
+	if (err > 0)
+		err = REFTABLE_FORMAT_ERROR;
+
+	reftable_record_from_index(&rec, &idx);
+	while (err == 0) {
+		err = top ? table_iter_next(&ti, &rec) :
+			    table_iter_next_in_block(&ti, &rec);
+		if (err > 0) {
+			err = 0;
+			break;
+		}
+		if (err < 0)
+			break;
+
+		if (strbuf_cmp(&idx.last_key, &lt->want) < 0)
+			continue;
+		if (idx.has_time && (idx.max_time < lt->min_time ||
+				     idx.min_time > lt->max_time))
+			continue;
+
+		if (depth > 0) {
+			err = log_time_iter_collect(lt, idx.offset, depth - 1,
+						    0);
+			continue;
+		}
+		if (lt->offsets_len == lt->offsets_cap) {
+			lt->offsets_cap = 2 * lt->offsets_cap + 1;
+			lt->offsets = reftable_realloc(
+				lt->offsets, sizeof(uint64_t) * lt->offsets_cap);
+		}
+		lt->offsets[lt->offsets_len++] = idx.offset;
+	}
+
+	table_iter_close(&ti);
+	reftable_record_release(&rec);
+	return err;
+}
+
+static int log_time_iter_next(void *p, struct reftable_record *rec)
+{
+	struct log_time_iter *lt = (struct log_time_iter *)p;
+	struct reftable_log_record *log = NULL;
+
+	if (reftable_record_type(rec) != BLOCK_TYPE_LOG)
+		return REFTABLE_API_ERROR;
+	log = (struct reftable_log_record *)rec->data;
+
+	while (1) {
+		int err = 0;
+		if (lt->linear) {
+			err = iterator_next(&lt->it, rec);
+		} else {
+			if (!lt->in_block) {
+				if (lt->offsets_idx == lt->offsets_len)
+					return 1;
+				table_iter_block_done(&lt->ti);
+				err = reader_table_iter_at(
+					lt->r, &lt->ti,
+					lt->offsets[lt->offsets_idx++],
+					BLOCK_TYPE_LOG);
+				if (err > 0)
+					/* indexed block does not exist. */
+					err = REFTABLE_FORMAT_ERROR;
+				if (err == 0)
+					err = block_iter_seek(&lt->ti.bi,
+							      &lt->want);
+				if (err < 0)
+					return err;
+				lt->in_block = 1;
+			}
+
+			err = table_iter_next_in_block(&lt->ti, rec);
+			if (err > 0) {
+				lt->in_block = 0;
+				continue;
+			}
+		}
+		if (err != 0)
+			return err;
+
+		if (reftable_log_record_is_deletion(log) ||
+		    (log->time >= lt->min_time && log->time <= lt->max_time))
+			return 0;
+	}
+}
+
+static void log_time_iter_close(void *p)
+{
+	struct log_time_iter *lt = (struct log_time_iter *)p;
+	table_iter_close(&lt->ti);
+	reftable_iterator_destroy(&lt->it);
+	strbuf_release(&lt->want);
+	reftable_free(lt->offsets);
+}
+
+static struct reftable_iterator_vtable log_time_iter_vtable = {
+	.next = &log_time_iter_next,
+	.close = &log_time_iter_close,
+};
+
+int reftable_reader_seek_log_time(struct reftable_reader *r,
+				  struct reftable_iterator *it,
+				  const char *name, uint64_t min_time,
+				  uint64_t max_time)
+{
+	struct reftable_log_record log = {
+		.refname = (char *)name,
+		.update_index = ~((uint64_t)0),
+	};
+	struct reftable_record rec = { NULL };
+	struct table_iter ti_empty = TABLE_ITER_INIT;
+	struct log_time_iter *lt = reftable_calloc(sizeof(*lt));
+	int depth = 0;
+	int err = 0;
+
+	lt->r = r;
+	lt->ti = ti_empty;
+	strbuf_init(&lt->want, 0);
+	lt->min_time = min_time;
+	lt->max_time = max_time;
+	reftable_record_from_log(&rec, &log);
+	reftable_record_key(&rec, &lt->want);
+
+	if (!r->log_offsets.is_present || r->log_offsets.index_offset == 0) {
+		lt->linear = 1;
+		err = reader_seek(r, &lt->it, &rec);
+		if (err > 0) {
+			iterator_set_empty(&lt->it);
+			err = 0;
+		}
+	} else {
+		uint64_t bottom = 0;
+		err = reader_index_depth(r, &r->log_offsets, &depth, &bottom);
+		if (err == 0)
+			err = log_time_iter_collect(
+				lt, r->log_offsets.index_offset, depth, 1);
+	}
+	if (err < 0) {
+		log_time_iter_close(lt);
+		reftable_free(lt);
+		return err;
+	}
+
+	assert(it->ops == NULL);
+	it->iter_arg = lt;
+	it->ops = &log_time_iter_vtable;
+	return 0;
+}
+
 void reader_close(struct reftable_reader *r)
 {
 	block_source_close(&r->source);
@@ -636,6 +930,38 @@ void reftable_reader_free(struct reftable_reader *r)
 	reftable_free(r);
 }
 
+static int reftable_reader_refs_for_unindexed(struct reftable_reader *r,
+					      struct reftable_iterator *it,
+					      uint8_t *oid)
+{
+	struct table_iter ti_empty = TABLE_ITER_INIT;
+	struct table_iter *ti = reftable_calloc(sizeof(struct table_iter));
+	struct filtering_ref_iterator *filter = NULL;
+	struct filtering_ref_iterator empty = FILTERING_REF_ITERATOR_INIT;
+	int oid_len = hash_size(r->hash_id);
+	int err;
+
+	*ti = ti_empty;
+	err = reader_start(r, ti, BLOCK_TYPE_REF, 0);
+	if (err < 0) {
+		reftable_free(ti);
+		return err;
+	}
+
+	filter = reftable_malloc(sizeof(struct filtering_ref_iterator));
+	*filter = empty;
+
+	strbuf_add(&filter->oid, oid, oid_len);
+	reftable_table_from_reader(&filter->tab, r);
+	filter->double_check = 0;
+	/* columnar blocks can skip to the matches. */
+	ti->filter_oid = (uint8_t *)filter->oid.buf;
+	iterator_from_table_iter(&filter->it, ti);
+
+	iterator_from_filtering_ref_iterator(it, filter);
+	return 0;
+}
+
 static int reftable_reader_refs_for_indexed(struct reftable_reader *r,
 					    struct reftable_iterator *it,
 					    uint8_t *oid)
@@ -653,13 +979,14 @@ static int reftable_reader_refs_for_indexed(struct reftable_reader *r,
 
 	/* Look through the reverse index. */
 	reftable_record_from_obj(&want_rec, &want);
+	reftable_record_from_obj(&got_rec, &got);
 	err = reader_seek(r, &oit, &want_rec);
-	if (err != 0)
+	if (err < 0)
 		goto done;
 
 	/* read out the reftable_obj_record */
-	reftable_record_from_obj(&got_rec, &got);
-	err = iterator_next(&oit, &got_rec);
+	if (err == 0)
+		err = iterator_next(&oit, &got_rec);
 	if (err < 0)
 		goto done;
 
@@ -670,6 +997,11 @@ static int reftable_reader_refs_for_indexed(struct reftable_reader *r,
 		err = 0;
 		goto done;
 	}
+	if (got.offset_len == 0) {
+		/* on too many blocks for the index to list them. */
+		err = reftable_reader_refs_for_unindexed(r, it, oid);
+		goto done;
+	}
 
 	err = new_indexed_table_ref_iter(&itr, r, oid, hash_size(r->hash_id),
 					 got.offsets, got.offset_len);
@@ -684,42 +1016,284 @@ done:
 	return err;
 }
 
-static int reftable_reader_refs_for_unindexed(struct reftable_reader *r,
-					      struct reftable_iterator *it,
-					      uint8_t *oid)
+int reftable_reader_refs_for(struct reftable_reader *r,
+			     struct reftable_iterator *it, uint8_t *oid)
 {
-	struct table_iter ti_empty = TABLE_ITER_INIT;
-	struct table_iter *ti = reftable_calloc(sizeof(struct table_iter));
-	struct filtering_ref_iterator *filter = NULL;
-	struct filtering_ref_iterator empty = FILTERING_REF_ITERATOR_INIT;
-	int oid_len = hash_size(r->hash_id);
-	int err;
+	if (r->obj_offsets.is_present)
+		return reftable_reader_refs_for_indexed(r, it, oid);
+	return reftable_reader_refs_for_unindexed(r, it, oid);
+}
 
-	*ti = ti_empty;
-	err = reader_start(r, ti, BLOCK_TYPE_REF, 0);
-	if (err < 0) {
-		reftable_free(ti);
-		return err;
-	}
+/* OIDs are looked up in the obj index by stepping forward if the next one is
+ * within this many records, and by seeking otherwise. */
+#define REFS_FOR_OIDS_MAX_STEPS 16
 
-	filter = reftable_malloc(sizeof(struct filtering_ref_iterator));
-	*filter = empty;
+struct oid_list {
+	uint8_t *oids;
+	size_t len;
+	int hash_size;
+	uint8_t *want;
+};
 
-	strbuf_add(&filter->oid, oid, oid_len);
-	reftable_table_from_reader(&filter->tab, r);
-	filter->double_check = 0;
-	iterator_from_table_iter(&filter->it, ti);
+static int oid_list_find_less(size_t k, void *arg)
+{
+	struct oid_list *l = arg;
+	return memcmp(l->oids + k * l->hash_size, l->want, l->hash_size) >= 0;
+}
 
-	iterator_from_filtering_ref_iterator(it, filter);
+/* returns the index of `oid` in the list, or -1. */
+static int oid_list_find(struct oid_list *l, uint8_t *oid)
+{
+	size_t idx = 0;
+	if (oid == NULL || l->len == 0)
+		return -1;
+	l->want = oid;
+	idx = binsearch(l->len, &oid_list_find_less, l);
+	if (idx < l->len &&
+	    !memcmp(l->oids + idx * l->hash_size, oid, l->hash_size))
+		return idx;
+	return -1;
+}
+
+/* calls `fn` once for every requested OID that `ref` points to. */
+static int refs_for_oids_emit(struct oid_list *l,
+			      struct reftable_ref_record *ref,
+			      int (*fn)(void *arg, size_t oid_idx,
+					struct reftable_ref_record *ref),
+			      void *arg)
+{
+	int idx1 = oid_list_find(l, reftable_ref_record_val1(ref));
+	int idx2 = oid_list_find(l, reftable_ref_record_val2(ref));
+	int err = 0;
+	if (idx1 >= 0)
+		err = fn(arg, idx1, ref);
+	if (err == 0 && idx2 >= 0 && idx2 != idx1)
+		err = fn(arg, idx2, ref);
+	return err;
+}
+
+static int uint64_compare(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a;
+	uint64_t ub = *(const uint64_t *)b;
+	if (ua != ub)
+		return ua < ub ? -1 : 1;
 	return 0;
 }
 
-int reftable_reader_refs_for(struct reftable_reader *r,
-			     struct reftable_iterator *it, uint8_t *oid)
+/* collects the sorted, distinct offsets of ref blocks that the obj index
+ * lists for any of the OIDs, in one forward pass over the index. Sets
+ * `scan_all` if an ID is on too many blocks for the index to list them. */
+static int reader_obj_offsets_for(struct reftable_reader *r,
+				  struct oid_list *l, uint64_t **offsets,
+				  size_t *offsets_len, int *scan_all)
+{
+	struct reftable_obj_record want = {
+		.hash_prefix_len = r->object_id_len,
+	};
+	struct reftable_obj_record got = { NULL };
+	struct reftable_record want_rec = { NULL };
+	struct reftable_record got_rec = { NULL };
+	struct reftable_iterator oit = { NULL };
+	uint64_t *offs = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+	int have = 0;
+	size_t i = 0;
+	int err = 0;
+
+	reftable_record_from_obj(&want_rec, &want);
+	reftable_record_from_obj(&got_rec, &got);
+	for (i = 0; i < l->len; i++) {
+		uint8_t *oid = l->oids + i * l->hash_size;
+		int steps = 0;
+		int cmp = 0;
+		while (have && steps++ < REFS_FOR_OIDS_MAX_STEPS &&
+		       memcmp(got.hash_prefix, oid, r->object_id_len) < 0) {
+			err = iterator_next(&oit, &got_rec);
+			if (err < 0)
+				goto done;
+			have = (err == 0);
+		}
+		if (!have && steps > 0)
+			/* the index is exhausted. */
+			break;
+
+		if (!have || memcmp(got.hash_prefix, oid, r->object_id_len) < 0) {
+			reftable_iterator_destroy(&oit);
+			want.hash_prefix = oid;
+			err = reader_seek(r, &oit, &want_rec);
+			if (err < 0)
+				goto done;
+			/* > 0 if `oid` is past the last indexed ID. */
+			if (err == 0)
+				err = iterator_next(&oit, &got_rec);
+			if (err < 0)
+				goto done;
+			have = (err == 0);
+			if (!have)
+				break;
+		}
+
+		cmp = memcmp(got.hash_prefix, oid, r->object_id_len);
+		if (cmp > 0)
+			continue;
+		if (got.offset_len == 0)
+			*scan_all = 1;
+
+		if (len + got.offset_len > cap) {
+			cap = 2 * cap + got.offset_len;
+			offs = reftable_realloc(offs, sizeof(uint64_t) * cap);
+		}
+		memcpy(offs + len, got.offsets, sizeof(uint64_t) * got.offset_len);
+		len += got.offset_len;
+	}
+	err = 0;
+
+	QSORT(offs, len, uint64_compare);
+	*offsets_len = 0;
+	for (i = 0; i < len; i++) {
+		if (*offsets_len > 0 && offs[*offsets_len - 1] == offs[i])
+			continue;
+		offs[(*offsets_len)++] = offs[i];
+	}
+	*offsets = offs;
+	offs = NULL;
+
+done:
+	reftable_free(offs);
+	reftable_iterator_destroy(&oit);
+	reftable_record_release(&got_rec);
+	return err;
+}
+
+static int reftable_reader_refs_for_oids_unindexed(
+	struct reftable_reader *r, struct oid_list *l,
+	int (*fn)(void *arg, size_t oid_idx, struct reftable_ref_record *ref),
+	void *arg)
+{
+	struct table_iter ti = TABLE_ITER_INIT;
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_record rec = { NULL };
+	int err = reader_start(r, &ti, BLOCK_TYPE_REF, 0);
+	if (err != 0)
+		return err < 0 ? err : 0;
+
+	reftable_record_from_ref(&rec, &ref);
+	while (err == 0) {
+		err = table_iter_next(&ti, &rec);
+		if (err > 0) {
+			err = 0;
+			break;
+		}
+		if (err < 0)
+			break;
+		err = refs_for_oids_emit(l, &ref, fn, arg);
+	}
+
+	table_iter_close(&ti);
+	reftable_ref_record_release(&ref);
+	return err;
+}
+
+static int reftable_reader_refs_for_oids_indexed(
+	struct reftable_reader *r, struct oid_list *l,
+	int (*fn)(void *arg, size_t oid_idx, struct reftable_ref_record *ref),
+	void *arg)
+{
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_record rec = { NULL };
+	struct block_reader br = { 0 };
+	struct block_iter bi = { .last_key = STRBUF_INIT };
+	uint64_t *offsets = NULL;
+	size_t offsets_len = 0;
+	uint64_t block_off = 0;
+	int scan_all = 0;
+	size_t i = 0;
+	int err = reader_obj_offsets_for(r, l, &offsets, &offsets_len,
+					 &scan_all);
+	if (err < 0)
+		goto done;
+	if (scan_all) {
+		err = reftable_reader_refs_for_oids_unindexed(r, l, fn, arg);
+		goto done;
+	}
+
+	reftable_record_from_ref(&rec, &ref);
+	for (i = 0; i < offsets_len && err == 0; i++) {
+		uint64_t off = offsets[i];
+		uint32_t end = 0;
+		if (r->obj_full_width)
+			off >>= OBJ_POS_RESTART_BITS;
+
+		/* positions in a full-width index are sorted by block, so
+		 * each block is still read once. */
+		if (br.block.data == NULL || off != block_off) {
+			reftable_block_done(&br.block);
+			err = reader_init_block_reader(r, &br, off,
+						       BLOCK_TYPE_REF);
+			if (err > 0)
+				/* indexed block does not exist. */
+				err = REFTABLE_FORMAT_ERROR;
+			if (err < 0)
+				goto done;
+			block_off = off;
+		}
+
+		block_reader_start(&br, &bi);
+		end = br.block_len;
+		if (r->obj_full_width) {
+			err = block_iter_seek_restart_run(
+				&bi,
+				offsets[i] & ((1 << OBJ_POS_RESTART_BITS) - 1),
+				&end);
+			if (err < 0)
+				goto done;
+		}
+		while (err == 0 && bi.next_off < end) {
+			err = block_iter_next(&bi, &rec);
+			if (err > 0) {
+				err = 0;
+				break;
+			}
+			if (err < 0)
+				break;
+			ref.update_index += r->min_update_index;
+			err = refs_for_oids_emit(l, &ref, fn, arg);
+		}
+	}
+
+done:
+	reftable_block_done(&br.block);
+	block_iter_close(&bi);
+	reftable_ref_record_release(&ref);
+	reftable_free(offsets);
+	return err;
+}
+
+int reftable_reader_refs_for_oids(struct reftable_reader *r, uint8_t *oids,
+				  size_t n,
+				  int (*fn)(void *arg, size_t oid_idx,
+					    struct reftable_ref_record *ref),
+				  void *arg)
 {
+	struct oid_list l = {
+		.oids = oids,
+		.len = n,
+		.hash_size = hash_size(r->hash_id),
+	};
+	size_t i = 0;
+	for (i = 1; i < n; i++) {
+		if (memcmp(oids + (i - 1) * l.hash_size, oids + i * l.hash_size,
+			   l.hash_size) >= 0)
+			return REFTABLE_API_ERROR;
+	}
+	if (n == 0 || !r->ref_offsets.is_present)
+		return 0;
+
 	if (r->obj_offsets.is_present)
-		return reftable_reader_refs_for_indexed(r, it, oid);
-	return reftable_reader_refs_for_unindexed(r, it, oid);
+		return reftable_reader_refs_for_oids_indexed(r, &l, fn, arg);
+	return reftable_reader_refs_for_oids_unindexed(r, &l, fn, arg);
 }
 
 uint64_t reftable_reader_max_update_index(struct reftable_reader *r)
@@ -45,11 +45,19 @@ struct reftable_reader {
 	uint64_t max_update_index;
 	/* Length of the OID keys in the 'o' section */
 	int object_id_len;
+	/* boolean: the 'o' section keys are complete OIDs, and its offsets
+	 * are positions of restart points (see OBJ_POS_RESTART_BITS). */
+	int obj_full_width;
 	int version;
 
 	struct reftable_reader_offsets ref_offsets;
 	struct reftable_reader_offsets obj_offsets;
 	struct reftable_reader_offsets log_offsets;
+
+	/* number of blocks read from the source, and how many of those were
+	 * inflated. Used for stack statistics. */
+	uint64_t blocks_read;
+	uint64_t blocks_inflated;
 };
 
 int init_reader(struct reftable_reader *r, struct reftable_block_source *source,
@@ -63,6 +71,13 @@ const char *reader_name(struct reftable_reader *r);
 int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
 			     uint64_t next_off, uint8_t want_typ);
 
+/* reads the bottom level of the index of the `typ` section into `dest`: one
+ * record per block, in order, with the block's offset and last key. `end` is
+ * set to where the blocks end. Returns 1 if the section has no index. */
+int reader_section_blocks(struct reftable_reader *r, uint8_t typ,
+			  struct reftable_index_record **dest, size_t *len,
+			  uint64_t *end);
+
 /* generic interface to reftables */
 struct reftable_table_vtable {
 	int (*seek_record)(void *tab, struct reftable_iterator *it,
@@ -70,6 +85,10 @@ struct reftable_table_vtable {
 	uint32_t (*hash_id)(void *tab);
 	uint64_t (*min_update_index)(void *tab);
 	uint64_t (*max_update_index)(void *tab);
+	int (*refs_for)(void *tab, struct reftable_iterator *it, uint8_t *oid);
+	int (*seek_log_time)(void *tab, struct reftable_iterator *it,
+			     const char *name, uint64_t min_time,
+			     uint64_t max_time);
 };
 
 
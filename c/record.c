@@ -17,19 +17,31 @@ https://developers.google.com/open-source/licenses/bsd
 
 int get_var_int(uint64_t *dest, struct string_view *in)
 {
+	const uint8_t *buf = in->buf;
 	int ptr = 0;
 	uint64_t val;
 
 	if (in->len == 0)
 		return -1;
-	val = in->buf[ptr] & 0x7f;
 
-	while (in->buf[ptr] & 0x80) {
+	/* Nearly all varints in a table (prefix and suffix lengths, update
+	 * index deltas) take one or two bytes. */
+	if (!(buf[0] & 0x80)) {
+		*dest = buf[0];
+		return 1;
+	}
+	if (in->len >= 2 && !(buf[1] & 0x80)) {
+		*dest = ((uint64_t)(buf[0] & 0x7f) + 1) << 7 | buf[1];
+		return 2;
+	}
+
+	val = buf[ptr] & 0x7f;
+	while (buf[ptr] & 0x80) {
 		ptr++;
-		if (ptr > in->len) {
+		if (ptr >= in->len) {
 			return -1;
 		}
-		val = (val + 1) << 7 | (uint64_t)(in->buf[ptr] & 0x7f);
+		val = (val + 1) << 7 | (uint64_t)(buf[ptr] & 0x7f);
 	}
 
 	*dest = val;
@@ -41,6 +53,13 @@ int put_var_int(struct string_view *dest, uint64_t val)
 	uint8_t buf[10] = { 0 };
 	int i = 9;
 	int n = 0;
+	if (val < 0x80) {
+		if (dest->len < 1)
+			return -1;
+		dest->buf[0] = (uint8_t)val;
+		return 1;
+	}
+
 	buf[i] = (uint8_t)(val & 0x7f);
 	i--;
 	while (1) {
@@ -64,6 +83,8 @@ int reftable_is_block_type(uint8_t typ)
 {
 	switch (typ) {
 	case BLOCK_TYPE_REF:
+	case BLOCK_TYPE_REF_DICT:
+	case BLOCK_TYPE_REF_COLUMNS:
 	case BLOCK_TYPE_LOG:
 	case BLOCK_TYPE_OBJ:
 	case BLOCK_TYPE_INDEX:
@@ -181,8 +202,10 @@ int reftable_decode_key(struct strbuf *key, uint8_t *extra,
 		return -1;
 
 	strbuf_reset(key);
-	strbuf_add(key, last_key.buf, prefix_len);
-	strbuf_add(key, in.buf, suffix_len);
+	strbuf_grow(key, prefix_len + suffix_len);
+	memcpy(key->buf, last_key.buf, prefix_len);
+	memcpy(key->buf + prefix_len, in.buf, suffix_len);
+	strbuf_setlen(key, prefix_len + suffix_len);
 	string_view_consume(&in, suffix_len);
 
 	return start_len - in.len;
@@ -251,6 +274,68 @@ static void hex_format(char *dest, uint8_t *src, int hash_size)
 	}
 }
 
+/* the largest pkt-line, including its length prefix. */
+#define PKT_LINE_MAX 65520
+
+/* writes "<len><hex> <name><suffix>\n" to dest, if it fits in `len`. Returns
+ * the length of the line. */
+static int format_pkt_line(char *dest, size_t len, uint8_t *hash,
+			   int hash_size, const char *name, const char *suffix)
+{
+	size_t name_len = strlen(name);
+	size_t suffix_len = strlen(suffix);
+	size_t n = 4 + 2 * hash_size + 1 + name_len + suffix_len + 1;
+	char hex[2 * SHA256_SIZE + 1];
+	char prefix[5];
+	if (n > PKT_LINE_MAX)
+		return REFTABLE_API_ERROR;
+	if (n > len)
+		return n;
+
+	hex_format(hex, hash, hash_size);
+	snprintf(prefix, sizeof(prefix), "%04x", (unsigned)n);
+	memcpy(dest, prefix, 4);
+	memcpy(dest + 4, hex, 2 * hash_size);
+	dest[4 + 2 * hash_size] = ' ';
+	memcpy(dest + 4 + 2 * hash_size + 1, name, name_len);
+	memcpy(dest + n - 1 - suffix_len, suffix, suffix_len);
+	dest[n - 1] = '\n';
+	return n;
+}
+
+int reftable_ref_record_format_pkt_line(const struct reftable_ref_record *ref,
+					uint32_t hash_id, char *dest,
+					size_t len)
+{
+	int hsize = hash_size(hash_id);
+	int n = 0;
+	int m = 0;
+	switch (ref->value_type) {
+	case REFTABLE_REF_VAL1:
+		return format_pkt_line(dest, len, ref->value.val1, hsize,
+				       ref->refname, "");
+	case REFTABLE_REF_VAL2:
+		/* measure both lines first, so neither is written if they
+		 * don't fit together. */
+		n = format_pkt_line(dest, 0, ref->value.val2.value, hsize,
+				    ref->refname, "");
+		m = format_pkt_line(dest, 0, ref->value.val2.target_value,
+				    hsize, ref->refname, "^{}");
+		if (n < 0 || m < 0)
+			return REFTABLE_API_ERROR;
+		if ((size_t)(n + m) > len)
+			return n + m;
+		format_pkt_line(dest, n, ref->value.val2.value, hsize,
+				ref->refname, "");
+		format_pkt_line(dest + n, m, ref->value.val2.target_value,
+				hsize, ref->refname, "^{}");
+		return n + m;
+	default:
+		/* symrefs are advertised as capabilities, if at all. */
+		return 0;
+	}
+}
+
 void reftable_ref_record_print(struct reftable_ref_record *ref,
 			       uint32_t hash_id)
 {
@@ -358,6 +443,46 @@ static int reftable_ref_record_encode(const void *rec, struct string_view s,
 	return start.len - s.len;
 }
 
+void reftable_ref_record_prepare(struct reftable_ref_record *ref,
+				 size_t refname_len, uint8_t value_type,
+				 int hash_size)
+{
+	uint8_t *hashes[2] = { NULL, NULL };
+	switch (ref->value_type) {
+	case REFTABLE_REF_VAL1:
+		hashes[0] = ref->value.val1;
+		break;
+	case REFTABLE_REF_VAL2:
+		hashes[0] = ref->value.val2.value;
+		hashes[1] = ref->value.val2.target_value;
+		break;
+	case REFTABLE_REF_SYMREF:
+		reftable_free(ref->value.symref);
+		break;
+	case REFTABLE_REF_DELETION:
+		break;
+	}
+	memset(&ref->value, 0, sizeof(ref->value));
+
+	ref->refname = reftable_realloc(ref->refname, refname_len + 1);
+	ref->value_type = value_type;
+	switch (value_type) {
+	case REFTABLE_REF_VAL1:
+		ref->value.val1 = reftable_realloc(hashes[0], hash_size);
+		hashes[0] = NULL;
+		break;
+	case REFTABLE_REF_VAL2:
+		ref->value.val2.value = reftable_realloc(hashes[0], hash_size);
+		ref->value.val2.target_value =
+			reftable_realloc(hashes[1], hash_size);
+		hashes[0] = NULL;
+		hashes[1] = NULL;
+		break;
+	}
+	reftable_free(hashes[0]);
+	reftable_free(hashes[1]);
+}
+
 static int reftable_ref_record_decode(void *rec, struct strbuf key,
 				      uint8_t val_type, struct string_view in,
 				      int hash_size)
@@ -370,36 +495,38 @@ static int reftable_ref_record_decode(void *rec, struct strbuf key,
 		return n;
 	string_view_consume(&in, n);
 
-	reftable_ref_record_release(r);
-
 	assert(hash_size > 0);
+	switch (val_type) {
+	case REFTABLE_REF_VAL1:
+		if (in.len < hash_size)
+			return -1;
+		break;
+	case REFTABLE_REF_VAL2:
+		if (in.len < 2 * hash_size)
+			return -1;
+		break;
+	case REFTABLE_REF_SYMREF:
+	case REFTABLE_REF_DELETION:
+		break;
+	default:
+		abort();
+		break;
+	}
 
-	r->refname = reftable_realloc(r->refname, key.len + 1);
+	reftable_ref_record_prepare(r, key.len, val_type, hash_size);
 	memcpy(r->refname, key.buf, key.len);
 	r->update_index = update_index;
 	r->refname[key.len] = 0;
-	r->value_type = val_type;
 	switch (val_type) {
 	case REFTABLE_REF_VAL1:
-		if (in.len < hash_size) {
-			return -1;
-		}
-
-		r->value.val1 = reftable_malloc(hash_size);
 		memcpy(r->value.val1, in.buf, hash_size);
 		string_view_consume(&in, hash_size);
 		break;
 
 	case REFTABLE_REF_VAL2:
-		if (in.len < 2 * hash_size) {
-			return -1;
-		}
-
-		r->value.val2.value = reftable_malloc(hash_size);
 		memcpy(r->value.val2.value, in.buf, hash_size);
 		string_view_consume(&in, hash_size);
 
-		r->value.val2.target_value = reftable_malloc(hash_size);
 		memcpy(r->value.val2.target_value, in.buf, hash_size);
 		string_view_consume(&in, hash_size);
 		break;
@@ -413,12 +540,6 @@ static int reftable_ref_record_decode(void *rec, struct strbuf key,
 		string_view_consume(&in, n);
 		r->value.symref = dest.buf;
 	} break;
-
-	case REFTABLE_REF_DELETION:
-		break;
-	default:
-		abort();
-		break;
 	}
 
 	return start.len - in.len;
@@ -527,6 +648,8 @@ static int reftable_obj_record_decode(void *rec, struct strbuf key,
 	int n = 0;
 	uint64_t last;
 	int j;
+	/* the record may hold a previously decoded one. */
+	reftable_obj_record_release(r);
 	r->hash_prefix = reftable_malloc(key.len);
 	memcpy(r->hash_prefix, key.buf, key.len);
 	r->hash_prefix_len = key.len;
@@ -753,6 +876,9 @@ static int reftable_log_record_decode(void *rec, struct strbuf key,
 		FREE_AND_NULL(r->message);
 		FREE_AND_NULL(r->email);
 		FREE_AND_NULL(r->name);
+		/* `r` may be reused, and a deletion has no time. */
+		r->time = 0;
+		r->tz_offset = 0;
 		return 0;
 	}
 
@@ -904,6 +1030,30 @@ struct reftable_record reftable_new_record(uint8_t typ)
 	return rec;
 }
 
+void reftable_record_swap(struct reftable_record *a,
+			  struct reftable_record *b)
+{
+	assert(reftable_record_type(a) == reftable_record_type(b));
+	switch (reftable_record_type(a)) {
+	case BLOCK_TYPE_REF:
+		SWAP(*(struct reftable_ref_record *)a->data,
+		     *(struct reftable_ref_record *)b->data);
+		break;
+	case BLOCK_TYPE_LOG:
+		SWAP(*(struct reftable_log_record *)a->data,
+		     *(struct reftable_log_record *)b->data);
+		break;
+	case BLOCK_TYPE_OBJ:
+		SWAP(*(struct reftable_obj_record *)a->data,
+		     *(struct reftable_obj_record *)b->data);
+		break;
+	case BLOCK_TYPE_INDEX:
+		SWAP(*(struct reftable_index_record *)a->data,
+		     *(struct reftable_index_record *)b->data);
+		break;
+	}
+}
+
 /* clear out the record, yielding the reftable_record data that was
  * encapsulated. */
 static void *reftable_record_yield(struct reftable_record *rec)
@@ -936,6 +1086,9 @@ static void reftable_index_record_copy_from(void *rec, const void *src_rec,
 	strbuf_reset(&dst->last_key);
 	strbuf_addbuf(&dst->last_key, &src->last_key);
 	dst->offset = src->offset;
+	dst->has_time = src->has_time;
+	dst->min_time = src->min_time;
+	dst->max_time = src->max_time;
 }
 
 static void reftable_index_record_release(void *rec)
@@ -946,7 +1099,10 @@ static void reftable_index_record_release(void *rec)
 
 static uint8_t reftable_index_record_val_type(const void *rec)
 {
-	return 0;
+	const struct reftable_index_record *r =
+		(const struct reftable_index_record *)rec;
+	/* 1 if the offset is followed by a time range. */
+	return r->has_time ? 1 : 0;
 }
 
 static int reftable_index_record_encode(const void *rec, struct string_view out,
@@ -961,6 +1117,18 @@ static int reftable_index_record_encode(const void *rec, struct string_view out,
 		return n;
 
 	string_view_consume(&out, n);
+	if (!r->has_time)
+		return start.len - out.len;
+
+	n = put_var_int(&out, r->min_time);
+	if (n < 0)
+		return n;
+	string_view_consume(&out, n);
+
+	n = put_var_int(&out, r->max_time - r->min_time);
+	if (n < 0)
+		return n;
+	string_view_consume(&out, n);
 
 	return start.len - out.len;
 }
@@ -981,6 +1149,22 @@ static int reftable_index_record_decode(void *rec, struct strbuf key,
 		return n;
 
 	string_view_consume(&in, n);
+
+	r->has_time = (val_type == 1);
+	r->min_time = 0;
+	r->max_time = 0;
+	if (r->has_time) {
+		n = get_var_int(&r->min_time, &in);
+		if (n < 0)
+			return n;
+		string_view_consume(&in, n);
+
+		n = get_var_int(&r->max_time, &in);
+		if (n < 0)
+			return n;
+		string_view_consume(&in, n);
+		r->max_time += r->min_time;
+	}
 	return start.len - in.len;
 }
 
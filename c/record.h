@@ -86,6 +86,14 @@ int reftable_decode_key(struct strbuf *key, uint8_t *extra,
 struct reftable_index_record {
 	uint64_t offset; /* Offset of block */
 	struct strbuf last_key; /* Last key of the block. */
+
+	/* boolean: min_time and max_time are set. Only log indices written
+	 * with the log_time_index option have them. */
+	int has_time;
+	/* bounds of the log times in the block, and in the blocks it
+	 * indexes. */
+	uint64_t min_time;
+	uint64_t max_time;
 };
 
 /* reftable_obj_record stores an object ID => ref mapping. */
@@ -104,6 +112,12 @@ uint8_t reftable_record_type(struct reftable_record *rec);
 void reftable_record_copy_from(struct reftable_record *rec,
 			       struct reftable_record *src, int hash_size);
 uint8_t reftable_record_val_type(struct reftable_record *rec);
+
+/* exchanges the contents of two records of the same type, so a record can be
+ * handed over without copying it. */
+void reftable_record_swap(struct reftable_record *a,
+			  struct reftable_record *b);
+
 int reftable_record_encode(struct reftable_record *rec, struct string_view dest,
 			   int hash_size);
 int reftable_record_decode(struct reftable_record *rec, struct strbuf key,
@@ -130,6 +144,14 @@ void reftable_record_from_log(struct reftable_record *rec,
 struct reftable_ref_record *reftable_record_as_ref(struct reftable_record *ref);
 struct reftable_log_record *reftable_record_as_log(struct reftable_record *ref);
 
+/* readies `ref` to be filled with a name of `refname_len` bytes and a value
+ * of `value_type`, with room for the hashes it needs. Its allocations are
+ * reused where possible; decoding a stream of records into one record then
+ * allocates little. */
+void reftable_ref_record_prepare(struct reftable_ref_record *ref,
+				 size_t refname_len, uint8_t value_type,
+				 int hash_size);
+
 /* for qsort. */
 int reftable_ref_record_compare_name(const void *a, const void *b);
 
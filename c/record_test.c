@@ -68,6 +68,30 @@ static void test_varint_roundtrip(void)
 	}
 }
 
+static void test_varint_boundaries(void)
+{
+	uint64_t i = 0;
+	for (i = 0; i < 40000; i++) {
+		uint8_t dest[10];
+		struct string_view out = {
+			.buf = dest,
+			.len = sizeof(dest),
+		};
+		uint64_t got = 0;
+		int n = put_var_int(&out, i);
+		int m = 0;
+		EXPECT(n > 0);
+		out.len = n;
+		m = get_var_int(&got, &out);
+		EXPECT(m == n);
+		EXPECT(got == i);
+
+		/* a varint cut short is an error. */
+		out.len = n - 1;
+		EXPECT(get_var_int(&got, &out) < 0);
+	}
+}
+
 static void test_common_prefix(void)
 {
 	struct {
@@ -162,6 +186,119 @@ static void test_reftable_ref_record_roundtrip(void)
 	}
 }
 
+static void test_reftable_record_reuse(void)
+{
+	uint8_t types[] = { REFTABLE_REF_VAL2, REFTABLE_REF_SYMREF,
+			    REFTABLE_REF_VAL1, REFTABLE_REF_DELETION,
+			    REFTABLE_REF_VAL2 };
+	struct reftable_record out = reftable_new_record(BLOCK_TYPE_REF);
+	struct reftable_record other = reftable_new_record(BLOCK_TYPE_REF);
+	struct reftable_log_record logs[2] = {
+		{
+			.refname = xstrdup("refs/heads/master"),
+			.old_hash = reftable_malloc(SHA1_SIZE),
+			.new_hash = reftable_malloc(SHA1_SIZE),
+			.name = xstrdup("han-wen"),
+			.email = xstrdup("hanwen@google.com"),
+			.message = xstrdup("test"),
+			.update_index = 42,
+			.time = 1577123507,
+			.tz_offset = 100,
+		},
+		{
+			.refname = xstrdup("refs/heads/master"),
+			.update_index = 22,
+		}
+	};
+	struct reftable_record log_out = reftable_new_record(BLOCK_TYPE_LOG);
+	int i = 0;
+
+	/* decoding into the same record reuses or frees its storage. */
+	for (i = 0; i < ARRAY_SIZE(types); i++) {
+		struct reftable_ref_record in = {
+			.refname = xstrdup(i % 2 ? "refs/heads/a-much-longer-name" :
+						   "HEAD"),
+			.update_index = i,
+			.value_type = types[i],
+		};
+		struct reftable_record rec = { NULL };
+		struct strbuf key = STRBUF_INIT;
+		uint8_t buffer[1024] = { 0 };
+		struct string_view dest = {
+			.buf = buffer,
+			.len = sizeof(buffer),
+		};
+		int n, m;
+
+		switch (types[i]) {
+		case REFTABLE_REF_VAL1:
+			in.value.val1 = reftable_malloc(SHA1_SIZE);
+			set_hash(in.value.val1, i);
+			break;
+		case REFTABLE_REF_VAL2:
+			in.value.val2.value = reftable_malloc(SHA1_SIZE);
+			set_hash(in.value.val2.value, i);
+			in.value.val2.target_value = reftable_malloc(SHA1_SIZE);
+			set_hash(in.value.val2.target_value, i + 1);
+			break;
+		case REFTABLE_REF_SYMREF:
+			in.value.symref = xstrdup("target");
+			break;
+		}
+
+		reftable_record_from_ref(&rec, &in);
+		reftable_record_key(&rec, &key);
+		n = reftable_record_encode(&rec, dest, SHA1_SIZE);
+		EXPECT(n > 0);
+		m = reftable_record_decode(&out, key, types[i], dest,
+					   SHA1_SIZE);
+		EXPECT(n == m);
+		EXPECT(reftable_ref_record_equal(&in, reftable_record_as_ref(&out),
+						 SHA1_SIZE));
+
+		/* swapping hands over the contents. */
+		reftable_record_swap(&out, &other);
+		EXPECT(reftable_ref_record_equal(
+			&in, reftable_record_as_ref(&other), SHA1_SIZE));
+
+		strbuf_release(&key);
+		reftable_ref_record_release(&in);
+	}
+
+	set_test_hash(logs[0].new_hash, 1);
+	set_test_hash(logs[0].old_hash, 2);
+	for (i = 0; i < ARRAY_SIZE(logs); i++) {
+		struct reftable_record rec = { NULL };
+		struct strbuf key = STRBUF_INIT;
+		uint8_t buffer[1024] = { 0 };
+		struct string_view dest = {
+			.buf = buffer,
+			.len = sizeof(buffer),
+		};
+		int n, m;
+
+		reftable_record_from_log(&rec, &logs[i]);
+		reftable_record_key(&rec, &key);
+		n = reftable_record_encode(&rec, dest, SHA1_SIZE);
+		EXPECT(n >= 0);
+		m = reftable_record_decode(&log_out, key,
+					   reftable_record_val_type(&rec), dest,
+					   SHA1_SIZE);
+		EXPECT(n == m);
+		EXPECT(reftable_log_record_equal(
+			&logs[i], reftable_record_as_log(&log_out), SHA1_SIZE));
+		strbuf_release(&key);
+	}
+	/* the deletion doesn't keep the time of the record before it. */
+	EXPECT(reftable_record_is_deletion(&log_out));
+
+	for (i = 0; i < ARRAY_SIZE(logs); i++)
+		reftable_log_record_release(&logs[i]);
+	reftable_record_destroy(&out);
+	reftable_record_destroy(&other);
+	reftable_record_destroy(&log_out);
+}
+
 static void test_reftable_log_record_equal(void)
 {
 	struct reftable_log_record in[2] = {
@@ -377,6 +514,23 @@ static void test_reftable_index_record_roundtrip(void)
 	EXPECT(m == n);
 
 	EXPECT(in.offset == out.offset);
+	EXPECT(!out.has_time);
+
+	/* with a time range. */
+	in.has_time = 1;
+	in.min_time = 1577123507;
+	in.max_time = 1577123507 + 3600;
+	n = reftable_record_encode(&rec, dest, SHA1_SIZE);
+	EXPECT(n > 0);
+
+	extra = reftable_record_val_type(&rec);
+	EXPECT(extra == 1);
+	m = reftable_record_decode(&out_rec, key, extra, dest, SHA1_SIZE);
+	EXPECT(m == n);
+	EXPECT(in.offset == out.offset);
+	EXPECT(out.has_time);
+	EXPECT(in.min_time == out.min_time);
+	EXPECT(in.max_time == out.max_time);
 
 	reftable_record_release(&out_rec);
 	strbuf_release(&key);
@@ -388,7 +542,9 @@ int record_test_main(int argc, const char *argv[])
 	test_reftable_log_record_equal();
 	test_reftable_log_record_roundtrip();
 	test_reftable_ref_record_roundtrip();
+	test_reftable_record_reuse();
 	test_varint_roundtrip();
+	test_varint_boundaries();
 	test_key_roundtrip();
 	test_common_prefix();
 	test_reftable_obj_record_roundtrip();
@@ -9,6 +9,7 @@
 #include "system.h"
 #include "reftable-error.h"
 #include "basics.h"
+#include "iter.h"
 #include "refname.h"
 #include "reftable-iterator.h"
 
@@ -153,7 +154,7 @@ int validate_ref_record_addition(struct reftable_table tab,
 		}
 	}
 
-	err = modification_validate(&mod);
+	err = modification_validate_batch(&mod);
 	modification_release(&mod);
 	return err;
 }
@@ -207,3 +208,140 @@ done:
 	strbuf_release(&slashed);
 	return err;
 }
+
+static int modification_deletes(struct modification *mod, const char *name)
+{
+	struct find_arg arg = {
+		.names = mod->del,
+		.want = name,
+	};
+	int idx = 0;
+	if (mod->del_len == 0)
+		return 0;
+	idx = binsearch(mod->del_len, find_name, &arg);
+	return idx < mod->del_len && !strcmp(mod->del[idx], name);
+}
+
+/* skips refs that the modification deletes. */
+static int modification_deletes_ref(void *arg, struct reftable_ref_record *ref)
+{
+	return modification_deletes(arg, ref->refname);
+}
+
+/* a name that must not exist (a parent directory of an added ref), or a
+ * prefix no ref may have (an added ref, plus '/'). */
+struct name_query {
+	const char *name;
+	int is_prefix;
+};
+
+static int name_query_compare(const void *a, const void *b)
+{
+	const struct name_query *qa = a;
+	const struct name_query *qb = b;
+	return strcmp(qa->name, qb->name);
+}
+
+static int modification_adds_prefix(struct modification *mod,
+				    const char *prefix)
+{
+	struct find_arg arg = {
+		.names = mod->add,
+		.want = prefix,
+	};
+	int idx = binsearch(mod->add_len, find_name, &arg);
+	return idx < mod->add_len &&
+	       !strncmp(prefix, mod->add[idx], strlen(prefix));
+}
+
+static int modification_adds(struct modification *mod, const char *name)
+{
+	struct find_arg arg = {
+		.names = mod->add,
+		.want = name,
+	};
+	int idx = binsearch(mod->add_len, find_name, &arg);
+	return idx < mod->add_len && !strcmp(mod->add[idx], name);
+}
+
+int modification_validate_batch(struct modification *mod)
+{
+	struct strbuf names = STRBUF_INIT;
+	struct name_query *queries = NULL;
+	size_t *offsets = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+	struct ref_cursor cursor = {
+		.tab = mod->tab,
+		.skip = &modification_deletes_ref,
+		.skip_arg = mod,
+	};
+	size_t i = 0;
+	int err = 0;
+
+	/* all queries go into one buffer; their pointers are only taken once
+	 * it stops growing. */
+	for (i = 0; i < mod->add_len; i++) {
+		const char *name = mod->add[i];
+		const char *slash = NULL;
+		err = validate_refname(name);
+		if (err)
+			goto done;
+
+		if (len + 1 + strlen(name) >= cap) {
+			cap = 2 * cap + 2 + strlen(name);
+			queries = reftable_realloc(queries,
+						   sizeof(*queries) * cap);
+			offsets = reftable_realloc(offsets,
+						   sizeof(*offsets) * cap);
+		}
+
+		offsets[len] = names.len;
+		queries[len++].is_prefix = 1;
+		strbuf_addstr(&names, name);
+		strbuf_add(&names, "/", 2);
+
+		for (slash = strchr(name, '/'); slash != NULL;
+		     slash = strchr(slash + 1, '/')) {
+			offsets[len] = names.len;
+			queries[len++].is_prefix = 0;
+			strbuf_add(&names, name, slash - name);
+			strbuf_add(&names, "", 1);
+		}
+	}
+	for (i = 0; i < len; i++)
+		queries[i].name = names.buf + offsets[i];
+	QSORT(queries, len, name_query_compare);
+
+	for (i = 0; i < len; i++) {
+		struct name_query *q = &queries[i];
+		if (i > 0 && !strcmp(q->name, queries[i - 1].name))
+			continue;
+
+		if (q->is_prefix ? modification_adds_prefix(mod, q->name) :
+				   modification_adds(mod, q->name)) {
+			err = REFTABLE_NAME_CONFLICT;
+			goto done;
+		}
+
+		err = ref_cursor_seek(&cursor, q->name);
+		if (err > 0)
+			continue;
+		if (err < 0)
+			goto done;
+		if (q->is_prefix ? !strncmp(cursor.ref.refname, q->name,
+					    strlen(q->name)) :
+				   !strcmp(cursor.ref.refname, q->name)) {
+			err = REFTABLE_NAME_CONFLICT;
+			goto done;
+		}
+	}
+	err = 0;
+
+done:
+	ref_cursor_release(&cursor);
+	reftable_free(queries);
+	reftable_free(offsets);
+	strbuf_release(&names);
+	return err;
+}
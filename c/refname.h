@@ -26,4 +26,9 @@ int validate_ref_record_addition(struct reftable_table tab,
 
 int modification_validate(struct modification *mod);
 
+/* Like modification_validate, but resolves the parent directories of all
+ * added names, and the names as directories, in one forward pass over the
+ * table. add and del must be sorted. */
+int modification_validate_batch(struct modification *mod);
+
 #endif
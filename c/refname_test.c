@@ -89,7 +89,99 @@ static void test_conflict(void)
 
 		err = modification_validate(&mod);
 		EXPECT(err == cases[i].error_code);
+		err = modification_validate_batch(&mod);
+		EXPECT(err == cases[i].error_code);
+	}
+
+	reftable_reader_free(rd);
+	strbuf_release(&buf);
+}
+
+static int name_compare(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* the batched validator agrees with the per-name one on a table with many
+ * refs, for additions hitting every kind of conflict. */
+static void test_conflict_batch(void)
+{
+	struct reftable_write_options opts = { 0 };
+	struct strbuf buf = STRBUF_INIT;
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_table tab = { NULL };
+	char *pool[] = {
+		"refs/heads/d001",	 "refs/heads/d001/x",
+		"refs/heads/d002/x/y",	 "refs/heads/d003/r0001",
+		"refs/heads/d500",	 "refs/heads/d500/r0001",
+		"refs/heads/new/a",	 "refs/heads/new/b",
+		"refs/heads/new/b/c",	 "refs/heads/zzz",
+		"refs/tags/d010",	 "refs/heads/d010/r0001/q",
+		"refs/heads/d999/r0009", "refs/heads",
+	};
+	int conflicts = 0;
+	int round = 0;
+	int i = 0;
+	int err;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < 1000; i++) {
+		char name[100];
+		struct reftable_ref_record rec = {
+			.refname = name,
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "HEAD",
+			.update_index = 1,
+		};
+		snprintf(name, sizeof(name), "refs/heads/d%03d/r%04d", i / 10,
+			 i);
+		err = reftable_writer_add_ref(w, &rec);
+		EXPECT_ERR(err);
+	}
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	reftable_writer_free(w);
+
+	block_source_from_strbuf(&source, &buf);
+	err = reftable_new_reader(&rd, &source, "filename");
+	EXPECT_ERR(err);
+	reftable_table_from_reader(&tab, rd);
+
+	for (round = 0; round < 200; round++) {
+		char *add[ARRAY_SIZE(pool)];
+		char *del[ARRAY_SIZE(pool)];
+		char deleted[ARRAY_SIZE(pool)][100];
+		struct modification mod = {
+			.tab = tab,
+			.add = add,
+			.del = del,
+		};
+		int want = 0;
+		int got = 0;
+
+		for (i = 0; i < ARRAY_SIZE(pool); i++) {
+			if ((round * 7 + i * 13) % 5 == 0)
+				add[mod.add_len++] = pool[i];
+		}
+		for (i = 0; i < round % 4; i++) {
+			snprintf(deleted[i], sizeof(deleted[i]),
+				 "refs/heads/d%03d/r%04d", (round * 3 + i) % 100,
+				 ((round * 3 + i) % 100) * 10 + round % 10);
+			del[mod.del_len++] = deleted[i];
+		}
+		QSORT(add, mod.add_len, name_compare);
+		QSORT(del, mod.del_len, name_compare);
+
+		want = modification_validate(&mod);
+		got = modification_validate_batch(&mod);
+		EXPECT(want == got);
+		if (want == REFTABLE_NAME_CONFLICT)
+			conflicts++;
 	}
+	EXPECT(conflicts > 0 && conflicts < 200);
 
 	reftable_reader_free(rd);
 	strbuf_release(&buf);
@@ -98,5 +190,6 @@ static void test_conflict(void)
 int refname_test_main(int argc, const char *argv[])
 {
 	test_conflict();
+	test_conflict_batch();
 	return 0;
 }
@@ -32,11 +32,30 @@ static uint64_t reftable_reader_max_update_index_void(void *tab)
 	return reftable_reader_max_update_index((struct reftable_reader *)tab);
 }
 
+static int reftable_reader_refs_for_void(void *tab,
+					 struct reftable_iterator *it,
+					 uint8_t *oid)
+{
+	return reftable_reader_refs_for((struct reftable_reader *)tab, it, oid);
+}
+
+static int reftable_reader_seek_log_time_void(void *tab,
+					      struct reftable_iterator *it,
+					      const char *name,
+					      uint64_t min_time,
+					      uint64_t max_time)
+{
+	return reftable_reader_seek_log_time((struct reftable_reader *)tab, it,
+					     name, min_time, max_time);
+}
+
 static struct reftable_table_vtable reader_vtable = {
 	.seek_record = reftable_reader_seek_void,
 	.hash_id = reftable_reader_hash_id_void,
 	.min_update_index = reftable_reader_min_update_index_void,
 	.max_update_index = reftable_reader_max_update_index_void,
+	.refs_for = reftable_reader_refs_for_void,
+	.seek_log_time = reftable_reader_seek_log_time_void,
 };
 
 int reftable_table_seek_ref(struct reftable_table *tab,
@@ -82,6 +101,20 @@ done:
 	return err;
 }
 
+int reftable_table_refs_for(struct reftable_table *tab,
+			    struct reftable_iterator *it, uint8_t *oid)
+{
+	return tab->ops->refs_for(tab->table_arg, it, oid);
+}
+
+int reftable_table_seek_log_time(struct reftable_table *tab,
+				 struct reftable_iterator *it, const char *name,
+				 uint64_t min_time, uint64_t max_time)
+{
+	return tab->ops->seek_log_time(tab->table_arg, it, name, min_time,
+				       max_time);
+}
+
 uint64_t reftable_table_max_update_index(struct reftable_table *tab)
 {
 	return tab->ops->max_update_index(tab->table_arg);
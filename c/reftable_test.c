@@ -12,6 +12,8 @@ https://developers.google.com/open-source/licenses/bsd
 #include "block.h"
 #include "blocksource.h"
 #include "constants.h"
+#include "obj_index.h"
+#include "radix.h"
 #include "reader.h"
 #include "record.h"
 #include "test_framework.h"
@@ -248,6 +250,143 @@ static void test_log_write_read(void)
 	reader_close(&rd);
 }
 
+/* appends the log entries that `it` produces, one per line. */
+static void collect_logs(struct reftable_iterator *it, struct strbuf *out)
+{
+	struct reftable_log_record log = { NULL };
+	while (1) {
+		char line[100];
+		int err = reftable_iterator_next_log(it, &log);
+		EXPECT(err >= 0);
+		if (err > 0)
+			break;
+		snprintf(line, sizeof(line), "%s@%d\n", log.refname,
+			 (int)log.update_index);
+		strbuf_addstr(out, line);
+	}
+	reftable_log_record_release(&log);
+	reftable_iterator_destroy(it);
+}
+
+static void test_log_time_index(void)
+{
+	struct {
+		const char *name;
+		uint64_t min_time;
+		uint64_t max_time;
+	} queries[] = {
+		{ "", 0, ~((uint64_t)0) },
+		{ "", 5000, 7999 },
+		{ "", 12345, 12345 },
+		{ "refs/heads/b10", 0, 12000 },
+		{ "refs/heads/b30", 100000, 200000 },
+	};
+	int indexed = 0;
+
+	for (indexed = 0; indexed < 2; indexed++) {
+		struct reftable_write_options opts = {
+			.block_size = 256,
+			.log_time_index = indexed,
+		};
+		struct strbuf buf = STRBUF_INIT;
+		struct reftable_writer *w =
+			reftable_new_writer(&strbuf_add_void, &buf, &opts);
+		struct reftable_block_source source = { NULL };
+		struct reftable_reader rd = { NULL };
+		struct reftable_iterator it = { NULL };
+		struct reftable_log_record log = { NULL };
+		struct strbuf want = STRBUF_INIT;
+		struct strbuf got = STRBUF_INIT;
+		uint64_t inflated = 0;
+		int log_blocks = 0;
+		int i = 0;
+		int j = 0;
+		int err;
+
+		reftable_writer_set_limits(w, 1, 50);
+		for (i = 0; i < 40; i++) {
+			for (j = 50; j > 0; j--) {
+				uint8_t hash1[SHA1_SIZE];
+				uint8_t hash2[SHA1_SIZE];
+				char name[100];
+				struct reftable_log_record log = {
+					.refname = name,
+					.update_index = j,
+					.old_hash = hash1,
+					.new_hash = hash2,
+					.name = "Han-Wen Nienhuys",
+					.email = "hanwen@google.com",
+					/* each ref has its own range. */
+					.time = 1000 * i + 10 * j,
+					.message = "commit: fix up",
+				};
+				snprintf(name, sizeof(name), "refs/heads/b%02d",
+					 i);
+				set_test_hash(hash1, j);
+				set_test_hash(hash2, j + 1);
+				if (i == 6 && j == 7) {
+					struct reftable_log_record del = {
+						.refname = name,
+						.update_index = j,
+					};
+					log = del;
+				}
+				err = reftable_writer_add_log(w, &log);
+				EXPECT_ERR(err);
+			}
+		}
+		err = reftable_writer_close(w);
+		EXPECT_ERR(err);
+		log_blocks = writer_stats(w)->log_stats.blocks;
+		EXPECT(log_blocks > 10);
+		reftable_writer_free(w);
+
+		block_source_from_strbuf(&source, &buf);
+		err = init_reader(&rd, &source, "file.ref");
+		EXPECT_ERR(err);
+
+		for (i = 0; i < ARRAY_SIZE(queries); i++) {
+			strbuf_reset(&want);
+			strbuf_reset(&got);
+
+			/* what filtering a plain scan yields. */
+			err = reftable_reader_seek_log(&rd, &it,
+						       queries[i].name);
+			EXPECT_ERR(err);
+			while (reftable_iterator_next_log(&it, &log) == 0) {
+				char line[100];
+				if (!reftable_log_record_is_deletion(&log) &&
+				    (log.time < queries[i].min_time ||
+				     log.time > queries[i].max_time))
+					continue;
+				snprintf(line, sizeof(line), "%s@%d\n",
+					 log.refname, (int)log.update_index);
+				strbuf_addstr(&want, line);
+			}
+			reftable_iterator_destroy(&it);
+
+			inflated = rd.blocks_inflated;
+			err = reftable_reader_seek_log_time(
+				&rd, &it, queries[i].name, queries[i].min_time,
+				queries[i].max_time);
+			EXPECT_ERR(err);
+			collect_logs(&it, &got);
+			EXPECT_STREQ(want.buf, got.buf);
+
+			/* b05-b07, with the deletion in b06. */
+			if (indexed && i == 1)
+				EXPECT(rd.blocks_inflated - inflated <
+				       log_blocks / 4);
+		}
+
+		reftable_log_record_release(&log);
+		strbuf_release(&want);
+		strbuf_release(&got);
+		strbuf_release(&buf);
+		reader_close(&rd);
+	}
+}
+
 static void test_table_read_write_sequential(void)
 {
 	char **names;
@@ -415,6 +554,68 @@ static void test_table_read_write_seek_index(void)
 	test_table_read_write_seek(1, SHA1_ID);
 }
 
+static void test_table_seek_multilevel_index(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader rd = { NULL };
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int N = 5000;
+	int i = 0;
+	int err;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < N; i++) {
+		uint8_t hash[SHA1_SIZE];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%06d", i);
+		set_test_hash(hash, i);
+		err = reftable_writer_add_ref(w, &ref);
+		EXPECT_ERR(err);
+	}
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	/* several blocks on more than one level, so the last block of a level
+	 * must be indexed too. */
+	EXPECT(writer_stats(w)->ref_stats.max_index_level > 1);
+	reftable_writer_free(w);
+
+	block_source_from_strbuf(&source, &buf);
+	err = init_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+	for (i = 0; i < N; i += 7) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/branch%06d", i);
+		err = reftable_reader_seek_ref(&rd, &it, name);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT_STREQ(name, ref.refname);
+		reftable_iterator_destroy(&it);
+	}
+	err = reftable_reader_seek_ref(&rd, &it, "refs/heads/branch004999");
+	EXPECT_ERR(err);
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT_ERR(err);
+	reftable_iterator_destroy(&it);
+
+	reftable_ref_record_release(&ref);
+	strbuf_release(&buf);
+	reader_close(&rd);
+}
+
 static void test_table_refs_for(int indexed)
 {
 	int N = 50;
@@ -526,6 +727,268 @@ static void test_table_refs_for_obj_index(void)
 	test_table_refs_for(1);
 }
 
+struct refs_for_oids_arg {
+	struct strbuf *out;
+	int stop_after;
+};
+
+static int collect_refs_for_oids(void *arg, size_t oid_idx,
+				 struct reftable_ref_record *ref)
+{
+	struct refs_for_oids_arg *a = arg;
+	char line[150];
+	snprintf(line, sizeof(line), "%d:%s@%d\n", (int)oid_idx, ref->refname,
+		 (int)ref->update_index);
+	strbuf_addstr(a->out, line);
+	if (a->stop_after > 0 && --a->stop_after == 0)
+		return 42;
+	return 0;
+}
+
+static void test_table_refs_for_oids(int indexed)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	struct strbuf want = STRBUF_INIT;
+	struct strbuf got = STRBUF_INIT;
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader rd = { NULL };
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	struct refs_for_oids_arg arg = { &got };
+	int ids[] = { 0, 5, 17, 50, 96, 200 };
+	uint8_t oids[ARRAY_SIZE(ids) * SHA1_SIZE];
+	int i = 0;
+	int j = 0;
+	int err;
+
+	reftable_writer_set_limits(w, 7, 7);
+	for (i = 0; i < 500; i++) {
+		uint8_t hash1[SHA1_SIZE];
+		uint8_t hash2[SHA1_SIZE];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 7,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+		set_test_hash(hash1, i % 97);
+		set_test_hash(hash2, (i + 1) % 97);
+		if (i % 3 == 0) {
+			ref.value_type = REFTABLE_REF_VAL2;
+			ref.value.val2.value = hash1;
+			ref.value.val2.target_value = hash2;
+		}
+		err = reftable_writer_add_ref(w, &ref);
+		EXPECT_ERR(err);
+	}
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	reftable_writer_free(w);
+
+	block_source_from_strbuf(&source, &buf);
+	err = init_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+	EXPECT(rd.obj_offsets.is_present);
+	if (!indexed)
+		rd.obj_offsets.is_present = 0;
+
+	for (i = 0; i < ARRAY_SIZE(ids); i++)
+		set_test_hash(oids + i * SHA1_SIZE, ids[i]);
+
+	/* what a scan over all refs finds. */
+	err = reftable_reader_seek_ref(&rd, &it, "");
+	EXPECT_ERR(err);
+	while (reftable_iterator_next_ref(&it, &ref) == 0) {
+		uint8_t *vals[2] = { reftable_ref_record_val1(&ref),
+				     reftable_ref_record_val2(&ref) };
+		for (j = 0; j < 2; j++) {
+			if (vals[j] == NULL)
+				continue;
+			for (i = 0; i < ARRAY_SIZE(ids); i++) {
+				if (!memcmp(vals[j], oids + i * SHA1_SIZE,
+					    SHA1_SIZE))
+					collect_refs_for_oids(&arg, i, &ref);
+			}
+		}
+	}
+	reftable_iterator_destroy(&it);
+	reftable_ref_record_release(&ref);
+	SWAP(want, got);
+	EXPECT(want.len > 0);
+
+	err = reftable_reader_refs_for_oids(&rd, oids, ARRAY_SIZE(ids),
+					    &collect_refs_for_oids, &arg);
+	EXPECT_ERR(err);
+	EXPECT_STREQ(want.buf, got.buf);
+
+	/* stops when the callback asks to. */
+	strbuf_reset(&got);
+	arg.stop_after = 3;
+	err = reftable_reader_refs_for_oids(&rd, oids, ARRAY_SIZE(ids),
+					    &collect_refs_for_oids, &arg);
+	EXPECT(err == 42);
+
+	/* the IDs must be sorted. */
+	err = reftable_reader_refs_for_oids(&rd, oids + SHA1_SIZE, 2,
+					    &collect_refs_for_oids, &arg);
+	EXPECT_ERR(err);
+	SWAP(oids[0], oids[SHA1_SIZE]);
+	err = reftable_reader_refs_for_oids(&rd, oids, 2,
+					    &collect_refs_for_oids, &arg);
+	EXPECT(err == REFTABLE_API_ERROR);
+
+	strbuf_release(&buf);
+	strbuf_release(&want);
+	strbuf_release(&got);
+	reader_close(&rd);
+}
+
+static void test_table_refs_for_oids_no_index(void)
+{
+	test_table_refs_for_oids(0);
+}
+
+static void test_table_refs_for_oids_obj_index(void)
+{
+	test_table_refs_for_oids(1);
+}
+
+/* appends the names of the refs that point to `oid`, one per line. */
+static void collect_refs_for(struct reftable_reader *rd, uint8_t *oid,
+			     struct strbuf *out)
+{
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int err = reftable_reader_refs_for(rd, &it, oid);
+	EXPECT_ERR(err);
+	while (1) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT(err >= 0);
+		if (err > 0)
+			break;
+		strbuf_addstr(out, ref.refname);
+		strbuf_addstr(out, "\n");
+	}
+	reftable_ref_record_release(&ref);
+	reftable_iterator_destroy(&it);
+}
+
+static void test_table_full_width_obj_index(void)
+{
+	struct reftable_write_options variants[] = {
+		{ .full_width_obj_index = 1 },
+		{ .full_width_obj_index = 1, .adaptive_restart_interval = 1 },
+		{ .full_width_obj_index = 1, .ref_block_dictionary = 1 },
+		{ .full_width_obj_index = 1, .columnar_ref_blocks = 1 },
+	};
+	int v = 0;
+
+	for (v = 0; v < ARRAY_SIZE(variants); v++) {
+		struct reftable_write_options opts = variants[v];
+		struct strbuf buf = STRBUF_INIT;
+		struct strbuf want = STRBUF_INIT;
+		struct strbuf got = STRBUF_INIT;
+		struct refs_for_oids_arg arg = { &got };
+		struct reftable_writer *w = NULL;
+		struct reftable_block_source source = { NULL };
+		struct reftable_reader rd = { NULL };
+		struct reftable_reader scan = { NULL };
+		uint8_t oids[40 * SHA1_SIZE];
+		int i = 0;
+		int err;
+
+		opts.block_size = 256;
+		w = reftable_new_writer(&strbuf_add_void, &buf, &opts);
+		reftable_writer_set_limits(w, 1, 1);
+		for (i = 0; i < 500; i++) {
+			uint8_t hash1[SHA1_SIZE];
+			uint8_t hash2[SHA1_SIZE];
+			char name[100];
+			struct reftable_ref_record ref = {
+				.refname = name,
+				.update_index = 1,
+				.value_type = REFTABLE_REF_VAL1,
+				.value.val1 = hash1,
+			};
+			snprintf(name, sizeof(name), "refs/heads/branch%04d",
+				 i);
+			/* IDs that only differ in their last byte, so a
+			 * prefix index can't tell them apart. */
+			memset(hash1, 0x5a, SHA1_SIZE);
+			hash1[SHA1_SIZE - 1] = i % 40;
+			memset(hash2, 0x5a, SHA1_SIZE);
+			hash2[SHA1_SIZE - 1] = (i / 7) % 40;
+			if (i % 5 == 0) {
+				ref.value_type = REFTABLE_REF_VAL2;
+				ref.value.val2.value = hash1;
+				ref.value.val2.target_value = hash2;
+			}
+			err = reftable_writer_add_ref(w, &ref);
+			EXPECT_ERR(err);
+		}
+		err = reftable_writer_close(w);
+		EXPECT_ERR(err);
+		reftable_writer_free(w);
+
+		block_source_from_strbuf(&source, &buf);
+		err = init_reader(&rd, &source, "file.ref");
+		EXPECT_ERR(err);
+		EXPECT(rd.obj_offsets.is_present);
+		EXPECT(rd.obj_full_width);
+		EXPECT(rd.object_id_len == SHA1_SIZE);
+		err = init_reader(&scan, &source, "file.ref");
+		EXPECT_ERR(err);
+		scan.obj_offsets.is_present = 0;
+
+		for (i = 0; i < 40; i++) {
+			uint8_t *oid = oids + i * SHA1_SIZE;
+			memset(oid, 0x5a, SHA1_SIZE);
+			oid[SHA1_SIZE - 1] = i;
+			strbuf_reset(&want);
+			strbuf_reset(&got);
+			collect_refs_for(&scan, oid, &want);
+			collect_refs_for(&rd, oid, &got);
+			EXPECT(want.len > 0);
+			EXPECT_STREQ(want.buf, got.buf);
+		}
+
+		/* past the last indexed ID. */
+		memset(oids, 0xff, SHA1_SIZE);
+		strbuf_reset(&got);
+		collect_refs_for(&rd, oids, &got);
+		EXPECT(got.len == 0);
+		memset(oids, 0x5a, SHA1_SIZE);
+		oids[SHA1_SIZE - 1] = 0;
+
+		strbuf_reset(&want);
+		strbuf_reset(&got);
+		arg.out = &want;
+		err = reftable_reader_refs_for_oids(&scan, oids, 40,
+						    &collect_refs_for_oids,
+						    &arg);
+		EXPECT_ERR(err);
+		arg.out = &got;
+		err = reftable_reader_refs_for_oids(&rd, oids, 40,
+						    &collect_refs_for_oids,
+						    &arg);
+		EXPECT_ERR(err);
+		EXPECT_STREQ(want.buf, got.buf);
+
+		reader_close(&rd);
+		reader_close(&scan);
+		strbuf_release(&buf);
+		strbuf_release(&want);
+		strbuf_release(&got);
+	}
+}
+
 static void test_table_empty(void)
 {
 	struct reftable_write_options opts = { 0 };
@@ -562,9 +1025,663 @@ static void test_table_empty(void)
 	strbuf_release(&buf);
 }
 
+/* adds refs whose object IDs fill several 'o' blocks. */
+static void add_obj_index_refs(struct reftable_writer *w)
+{
+	int N = 500;
+	int i = 0;
+	int err;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < N; i++) {
+		uint8_t hash1[SHA1_SIZE];
+		uint8_t hash2[SHA1_SIZE];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL2,
+			.value.val2.value = hash1,
+			.value.val2.target_value = hash2,
+		};
+
+		snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+		/* spread the IDs out, and share some between refs. */
+		set_test_hash(hash1, (i * 7919) % 331);
+		set_test_hash(hash2, i / 3);
+		err = reftable_writer_add_ref(w, &ref);
+		EXPECT_ERR(err);
+	}
+}
+
+static void write_obj_index_table(struct strbuf *buf,
+				  uint64_t obj_index_memory_limit)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+		.obj_index_memory_limit = obj_index_memory_limit,
+	};
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, &opts);
+	int err;
+
+	add_obj_index_refs(w);
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	reftable_writer_free(w);
+}
+
+static void test_table_obj_index_memory_limit(void)
+{
+	struct strbuf unlimited = STRBUF_INIT;
+	struct strbuf limited = STRBUF_INIT;
+	struct strbuf tiny = STRBUF_INIT;
+
+	write_obj_index_table(&unlimited, 0);
+	/* spills about every 10 refs, which also merges runs. */
+	write_obj_index_table(&limited, 20 * sizeof(struct obj_index_entry));
+	write_obj_index_table(&tiny, 1);
+
+	EXPECT(unlimited.len == limited.len);
+	EXPECT(!memcmp(unlimited.buf, limited.buf, unlimited.len));
+	EXPECT(unlimited.len == tiny.len);
+	EXPECT(!memcmp(unlimited.buf, tiny.buf, unlimited.len));
+
+	strbuf_release(&unlimited);
+	strbuf_release(&limited);
+	strbuf_release(&tiny);
+}
+
+static void test_table_writer_reset(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	struct strbuf fresh = STRBUF_INIT;
+	struct strbuf small = STRBUF_INIT;
+	struct strbuf empty = STRBUF_INIT;
+	struct strbuf reused = STRBUF_INIT;
+	struct reftable_writer *w = NULL;
+	uint8_t hash[SHA1_SIZE];
+	struct reftable_ref_record ref = {
+		.refname = "refs/heads/main",
+		.update_index = 5,
+		.value_type = REFTABLE_REF_VAL1,
+		.value.val1 = hash,
+	};
+	int err;
+
+	write_obj_index_table(&fresh, 0);
+
+	set_test_hash(hash, 1);
+	w = reftable_new_writer(&strbuf_add_void, &small, &opts);
+	reftable_writer_set_limits(w, 5, 5);
+	err = reftable_writer_add_ref(w, &ref);
+	EXPECT_ERR(err);
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+
+	reftable_writer_reset(w, &strbuf_add_void, &empty);
+	err = reftable_writer_close(w);
+	EXPECT(err == REFTABLE_EMPTY_TABLE_ERROR);
+	EXPECT(writer_stats(w)->ref_stats.blocks == 0);
+
+	/* none of the earlier tables leaks into this one. */
+	reftable_writer_reset(w, &strbuf_add_void, &reused);
+	add_obj_index_refs(w);
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	EXPECT(writer_stats(w)->obj_stats.blocks > 0);
+
+	EXPECT(fresh.len == reused.len);
+	EXPECT(!memcmp(fresh.buf, reused.buf, fresh.len));
+
+	reftable_writer_free(w);
+	strbuf_release(&fresh);
+	strbuf_release(&small);
+	strbuf_release(&empty);
+	strbuf_release(&reused);
+}
+
+static void test_radix_sort(int n, int threads)
+{
+	struct reftable_ref_record *refs =
+		reftable_calloc(sizeof(struct reftable_ref_record) * n);
+	struct reftable_ref_record *want_refs =
+		reftable_calloc(sizeof(struct reftable_ref_record) * n);
+	struct reftable_log_record *logs =
+		reftable_calloc(sizeof(struct reftable_log_record) * n);
+	struct reftable_log_record *want_logs =
+		reftable_calloc(sizeof(struct reftable_log_record) * n);
+	char **names = reftable_calloc(sizeof(char *) * n);
+	uint32_t x = 1;
+	int i = 0;
+
+	for (i = 0; i < n; i++) {
+		char name[100];
+		x = x * 1103515245 + 12345;
+		/* shared prefixes, names that are prefixes of others, and
+		 * bytes >= 0x80. */
+		snprintf(name, sizeof(name), "refs/%s/%u%s",
+			 (x >> 8) % 3 ? "heads" : "tags\xe9", (x >> 12) % (n / 2 + 1),
+			 (x >> 4) % 5 ? "" : "/x");
+		names[i] = xstrdup(name);
+		refs[i].refname = names[i];
+		refs[i].update_index = i;
+		logs[i].refname = names[(x >> 16) % (i + 1)];
+		logs[i].update_index = (x >> 10) % 1000;
+	}
+	/* make ref names unique, as the writer requires. */
+	QSORT(refs, n, reftable_ref_record_compare_name);
+	for (i = 1; i < n; i++) {
+		if (!strcmp(refs[i - 1].refname, refs[i].refname))
+			refs[i - 1].refname = "";
+	}
+
+	memcpy(want_refs, refs, sizeof(*refs) * n);
+	QSORT(want_refs, n, reftable_ref_record_compare_name);
+	memcpy(want_logs, logs, sizeof(*logs) * n);
+	QSORT(want_logs, n, reftable_log_record_compare_key);
+
+	radix_sort_refs(refs, n, threads);
+	radix_sort_logs(logs, n, threads);
+	for (i = 0; i < n; i++) {
+		EXPECT_STREQ(want_refs[i].refname, refs[i].refname);
+		EXPECT(!reftable_log_record_compare_key(&want_logs[i],
+							&logs[i]));
+	}
+	for (i = 1; i < n; i++) {
+		EXPECT(reftable_log_record_compare_key(&logs[i - 1],
+						       &logs[i]) <= 0);
+	}
+
+	for (i = 0; i < n; i++)
+		reftable_free(names[i]);
+	reftable_free(names);
+	reftable_free(refs);
+	reftable_free(want_refs);
+	reftable_free(logs);
+	reftable_free(want_logs);
+}
+
+static void test_radix_sort_small(void)
+{
+	test_radix_sort(1, 1);
+	test_radix_sort(30, 1);
+	test_radix_sort(1000, 1);
+}
+
+static void test_radix_sort_threaded(void)
+{
+	test_radix_sort(100000, 4);
+}
+
+struct counting_writer {
+	struct strbuf buf;
+	int calls;
+};
+
+static int counting_write(void *arg, const void *data, size_t sz)
+{
+	struct counting_writer *cw = arg;
+	cw->calls++;
+	return strbuf_add(&cw->buf, data, sz);
+}
+
+static void test_table_write_coalesced(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	struct counting_writer cw = { .buf = STRBUF_INIT };
+	struct reftable_writer *w =
+		reftable_new_writer(&counting_write, &cw, &opts);
+	const struct reftable_stats *stats = NULL;
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	uint8_t hash[SHA1_SIZE];
+	int N = 1000;
+	int i = 0;
+	int err;
+
+	set_test_hash(hash, 1);
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record rec = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+		err = reftable_writer_add_ref(w, &rec);
+		EXPECT_ERR(err);
+	}
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	stats = writer_stats(w);
+
+	/* padded blocks are passed to the callback in large chunks. */
+	EXPECT(stats->ref_stats.blocks > 100);
+	EXPECT(cw.calls < stats->blocks / 10);
+	reftable_writer_free(w);
+
+	block_source_from_strbuf(&source, &cw.buf);
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+	err = reftable_reader_seek_ref(rd, &it, "refs/heads/branch0999");
+	EXPECT_ERR(err);
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT_ERR(err);
+	EXPECT_STREQ(ref.refname, "refs/heads/branch0999");
+
+	reftable_ref_record_release(&ref);
+	reftable_iterator_destroy(&it);
+	reftable_reader_free(rd);
+	strbuf_release(&cw.buf);
+}
+
+static void write_section_block_size_table(struct strbuf *buf,
+					   struct reftable_write_options *opts,
+					   int N)
+{
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, opts);
+	int i = 0;
+	int err;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < N; i++) {
+		uint8_t hash[SHA1_SIZE];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL2,
+			.value.val2.value = hash,
+			.value.val2.target_value = hash,
+		};
+		set_test_hash(hash, i % 97);
+		snprintf(name, sizeof(name), "refs/changes/%02d/%06d/%d",
+			 i / 20, i, 1 + i % 3);
+		err = reftable_writer_add_ref(w, &ref);
+		EXPECT_ERR(err);
+	}
+	for (i = 0; i < N / 10; i++) {
+		uint8_t hash[SHA1_SIZE];
+		char name[100];
+		struct reftable_log_record log = {
+			.refname = name,
+			.update_index = 1,
+			.new_hash = hash,
+			.old_hash = hash,
+			.name = "John Doe",
+			.email = "john@example.com",
+			.message = "update",
+		};
+		set_test_hash(hash, i);
+		snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+		err = reftable_writer_add_log(w, &log);
+		EXPECT_ERR(err);
+	}
+
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	reftable_writer_free(w);
+}
+
+static void test_table_section_block_sizes(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 4096,
+		.ref_block_size = 512,
+		.obj_block_size = 256,
+		.index_block_size = 1024,
+		.log_block_size = 8192,
+		.adaptive_restart_interval = 1,
+	};
+	struct reftable_write_options fixed_opts = {
+		.block_size = 512,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	struct strbuf fixed_buf = STRBUF_INIT;
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_log_record log = { NULL };
+	uint8_t want_hash[SHA1_SIZE];
+	int N = 2000;
+	int i = 0;
+	int err;
+
+	write_section_block_size_table(&buf, &opts, N);
+	write_section_block_size_table(&fixed_buf, &fixed_opts, N);
+	/* unpadded 512-byte ref blocks beat padded ones. */
+	EXPECT(buf.len < fixed_buf.len);
+
+	block_source_from_strbuf(&source, &buf);
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+
+	err = reftable_reader_seek_ref(rd, &it, "");
+	EXPECT_ERR(err);
+	for (i = 0; i < N; i++) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+	}
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT(err > 0);
+	reftable_iterator_destroy(&it);
+
+	for (i = 0; i < N; i += 37) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/changes/%02d/%06d/%d",
+			 i / 20, i, 1 + i % 3);
+		err = reftable_reader_seek_ref(rd, &it, name);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT_STREQ(name, ref.refname);
+		reftable_iterator_destroy(&it);
+	}
+
+	set_test_hash(want_hash, 5);
+	err = reftable_reader_refs_for(rd, &it, want_hash);
+	EXPECT_ERR(err);
+	for (i = 0; i < N; i++) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		if (err > 0)
+			break;
+		EXPECT_ERR(err);
+		EXPECT(!memcmp(ref.value.val2.value, want_hash, SHA1_SIZE));
+	}
+	EXPECT(i == (N + 96 - 5) / 97);
+	reftable_iterator_destroy(&it);
+
+	err = reftable_reader_seek_log(rd, &it, "");
+	EXPECT_ERR(err);
+	for (i = 0; i < N / 10; i++) {
+		err = reftable_iterator_next_log(&it, &log);
+		EXPECT_ERR(err);
+	}
+	err = reftable_iterator_next_log(&it, &log);
+	EXPECT(err > 0);
+	reftable_iterator_destroy(&it);
+
+	reftable_ref_record_release(&ref);
+	reftable_log_record_release(&log);
+	reftable_reader_free(rd);
+	strbuf_release(&buf);
+	strbuf_release(&fixed_buf);
+}
+
+static void write_pull_request_table(struct strbuf *buf,
+				    struct reftable_write_options *opts, int N)
+{
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, opts);
+	int i = 0;
+	int err;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < N; i++) {
+		uint8_t hash[SHA1_SIZE];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL2,
+			.value.val2.value = hash,
+			.value.val2.target_value = hash,
+		};
+		set_test_hash(hash, i % 97);
+		snprintf(name, sizeof(name), "refs/pull/%06d/%s", i / 2,
+			 (i % 2) ? "merge" : "head");
+		err = reftable_writer_add_ref(w, &ref);
+		EXPECT_ERR(err);
+	}
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	reftable_writer_free(w);
+}
+
+static void test_table_ref_block_dictionary(void)
+{
+	struct reftable_write_options opts = {
+		.ref_block_dictionary = 1,
+	};
+	struct reftable_write_options plain_opts = { 0 };
+	struct strbuf buf = STRBUF_INIT;
+	struct strbuf plain_buf = STRBUF_INIT;
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	uint8_t want_hash[SHA1_SIZE];
+	int N = 5000;
+	int i = 0;
+	int err;
+
+	write_pull_request_table(&buf, &opts, N);
+	write_pull_request_table(&plain_buf, &plain_opts, N);
+	EXPECT(buf.len < plain_buf.len);
+	EXPECT(buf.buf[header_size(1)] == BLOCK_TYPE_REF_DICT);
+
+	block_source_from_strbuf(&source, &buf);
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+
+	err = reftable_reader_seek_ref(rd, &it, "");
+	EXPECT_ERR(err);
+	for (i = 0; i < N; i++) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/pull/%06d/%s", i / 2,
+			 (i % 2) ? "merge" : "head");
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT_STREQ(name, ref.refname);
+	}
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT(err > 0);
+	reftable_iterator_destroy(&it);
+
+	for (i = 0; i < N; i += 37) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/pull/%06d/%s", i / 2,
+			 (i % 2) ? "merge" : "head");
+		err = reftable_reader_seek_ref(rd, &it, name);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT_STREQ(name, ref.refname);
+		reftable_iterator_destroy(&it);
+	}
+
+	set_test_hash(want_hash, 5);
+	err = reftable_reader_refs_for(rd, &it, want_hash);
+	EXPECT_ERR(err);
+	for (i = 0; i < N; i++) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		if (err > 0)
+			break;
+		EXPECT_ERR(err);
+		EXPECT(!memcmp(ref.value.val2.value, want_hash, SHA1_SIZE));
+	}
+	EXPECT(i == (N + 96 - 5) / 97);
+	reftable_iterator_destroy(&it);
+
+	reftable_ref_record_release(&ref);
+	reftable_reader_free(rd);
+	strbuf_release(&buf);
+	strbuf_release(&plain_buf);
+}
+
+static void write_mixed_ref_table(struct strbuf *buf,
+				  struct reftable_write_options *opts, int N)
+{
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, opts);
+	int i = 0;
+	int err;
+
+	reftable_writer_set_limits(w, 1, 3);
+	for (i = 0; i < N; i++) {
+		uint8_t hash[SHA1_SIZE];
+		uint8_t target[SHA1_SIZE];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1 + i % 3,
+			.value_type = i % 4,
+		};
+		set_test_hash(hash, i % 97);
+		set_test_hash(target, i % 89);
+		snprintf(name, sizeof(name), "refs/heads/topic/%06d", i);
+		switch (ref.value_type) {
+		case REFTABLE_REF_VAL1:
+			ref.value.val1 = hash;
+			break;
+		case REFTABLE_REF_VAL2:
+			ref.value.val2.value = hash;
+			ref.value.val2.target_value = target;
+			break;
+		case REFTABLE_REF_SYMREF:
+			ref.value.symref = "refs/heads/master";
+			break;
+		case REFTABLE_REF_DELETION:
+			break;
+		}
+		err = reftable_writer_add_ref(w, &ref);
+		EXPECT_ERR(err);
+	}
+	err = reftable_writer_close(w);
+	EXPECT_ERR(err);
+	reftable_writer_free(w);
+}
+
+/* returns the names of the refs pointing to `oid`, as found by refs_for. */
+static void refs_for_names(struct strbuf *buf, uint8_t *oid,
+			   struct strbuf *names)
+{
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int err;
+
+	block_source_from_strbuf(&source, buf);
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+	err = reftable_reader_refs_for(rd, &it, oid);
+	EXPECT_ERR(err);
+	while (1) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		if (err > 0)
+			break;
+		EXPECT_ERR(err);
+		strbuf_addstr(names, ref.refname);
+		strbuf_addstr(names, "\n");
+	}
+	reftable_iterator_destroy(&it);
+	reftable_ref_record_release(&ref);
+	reftable_reader_free(rd);
+}
+
+static void test_table_columnar_ref_blocks(void)
+{
+	struct reftable_write_options opts = {
+		.columnar_ref_blocks = 1,
+		.skip_index_objects = 1,
+	};
+	struct reftable_write_options plain_opts = {
+		.skip_index_objects = 1,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	struct strbuf plain_buf = STRBUF_INIT;
+	struct strbuf names = STRBUF_INIT;
+	struct strbuf plain_names = STRBUF_INIT;
+	struct reftable_block_source source = { NULL };
+	struct reftable_block_source plain_source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_reader *plain_rd = NULL;
+	struct reftable_iterator it = { NULL };
+	struct reftable_iterator plain_it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_ref_record plain_ref = { NULL };
+	uint8_t want_hash[SHA1_SIZE];
+	int N = 3000;
+	int i = 0;
+	int err;
+
+	write_mixed_ref_table(&buf, &opts, N);
+	write_mixed_ref_table(&plain_buf, &plain_opts, N);
+	EXPECT(buf.buf[header_size(1)] == BLOCK_TYPE_REF_COLUMNS);
+
+	block_source_from_strbuf(&source, &buf);
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+	block_source_from_strbuf(&plain_source, &plain_buf);
+	err = reftable_new_reader(&plain_rd, &plain_source, "plain.ref");
+	EXPECT_ERR(err);
+
+	err = reftable_reader_seek_ref(rd, &it, "");
+	EXPECT_ERR(err);
+	err = reftable_reader_seek_ref(plain_rd, &plain_it, "");
+	EXPECT_ERR(err);
+	for (i = 0; i < N; i++) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_ref(&plain_it, &plain_ref);
+		EXPECT_ERR(err);
+		EXPECT(reftable_ref_record_equal(&ref, &plain_ref, SHA1_SIZE));
+	}
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT(err > 0);
+	reftable_iterator_destroy(&it);
+	reftable_iterator_destroy(&plain_it);
+
+	for (i = 0; i < N; i += 41) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/topic/%06d", i);
+		err = reftable_reader_seek_ref(rd, &it, name);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT_STREQ(name, ref.refname);
+		EXPECT(ref.update_index == 1 + i % 3);
+		reftable_iterator_destroy(&it);
+	}
+
+	/* 7 is both a value and a peeled value. */
+	set_test_hash(want_hash, 7);
+	refs_for_names(&buf, want_hash, &names);
+	refs_for_names(&plain_buf, want_hash, &plain_names);
+	EXPECT(names.len > 0);
+	EXPECT_STREQ(plain_names.buf, names.buf);
+
+	set_test_hash(want_hash, 200);
+	strbuf_reset(&names);
+	refs_for_names(&buf, want_hash, &names);
+	EXPECT(names.len == 0);
+
+	reftable_ref_record_release(&ref);
+	reftable_ref_record_release(&plain_ref);
+	reftable_reader_free(rd);
+	reftable_reader_free(plain_rd);
+	strbuf_release(&buf);
+	strbuf_release(&plain_buf);
+	strbuf_release(&names);
+	strbuf_release(&plain_names);
+}
+
 int reftable_test_main(int argc, const char *argv[])
 {
 	test_log_write_read();
+	test_log_time_index();
 	test_table_read_write_seek_linear_sha256();
 	test_log_buffer_size();
 	test_table_write_small_table();
@@ -573,8 +1690,20 @@ int reftable_test_main(int argc, const char *argv[])
 	test_table_read_write_sequential();
 	test_table_read_write_seek_linear();
 	test_table_read_write_seek_index();
+	test_table_seek_multilevel_index();
 	test_table_refs_for_no_index();
 	test_table_refs_for_obj_index();
+	test_table_refs_for_oids_no_index();
+	test_table_refs_for_oids_obj_index();
+	test_table_full_width_obj_index();
 	test_table_empty();
+	test_table_obj_index_memory_limit();
+	test_table_writer_reset();
+	test_table_write_coalesced();
+	test_table_section_block_sizes();
+	test_table_ref_block_dictionary();
+	test_table_columnar_ref_blocks();
+	test_radix_sort_small();
+	test_radix_sort_threaded();
 	return 0;
 }
@@ -9,6 +9,7 @@ https://developers.google.com/open-source/licenses/bsd
 #include "stack.h"
 
 #include "system.h"
+#include "iter.h"
 #include "merged.h"
 #include "reader.h"
 #include "refname.h"
@@ -16,6 +17,8 @@ https://developers.google.com/open-source/licenses/bsd
 #include "reftable-record.h"
 #include "writer.h"
 
+#include <pthread.h>
+
 static int stack_try_add(struct reftable_stack *st,
 			 int (*write_table)(struct reftable_writer *wr,
 					    void *arg),
@@ -23,16 +26,96 @@ static int stack_try_add(struct reftable_stack *st,
 static int stack_write_compact(struct reftable_stack *st,
 			       struct reftable_writer *wr, int first, int last,
 			       struct reftable_log_expiry_config *config);
+static int stack_write_expired_logs(struct reftable_stack *st,
+				    struct reftable_writer *wr, int i,
+				    struct reftable_log_expiry_config *config);
 static int stack_check_addition(struct reftable_stack *st,
 				const char *new_tab_name);
+static int stack_check_written_names(struct reftable_stack *st,
+				     struct writer_names *names);
 static void reftable_addition_close(struct reftable_addition *add);
 static int reftable_stack_reload_maybe_reuse(struct reftable_stack *st,
 					     int reuse_open);
+static void compaction_worker_trigger(struct compaction_worker *w);
+static void compaction_worker_fold_stats(struct reftable_stack *st);
+struct fd_sink;
+static void compaction_worker_begin_write(struct compaction_worker *w,
+					  struct fd_sink *sink);
+static int compaction_worker_write(void *arg, const void *data, size_t sz);
+static struct group_commit *group_commit_new(void);
+static void group_commit_free(struct group_commit *g);
+
+/* a table file being written. */
+struct fd_sink {
+	int fd;
+	/* boolean: start writeback as the data comes in, so the final fsync
+	 * has less to wait for. */
+	int writeback;
+	uint64_t offset;
+};
 
 static int reftable_fd_write(void *arg, const void *data, size_t sz)
 {
-	int *fdp = (int *)arg;
-	return write(*fdp, data, sz);
+	struct fd_sink *sink = arg;
+	const char *p = data;
+	size_t left = sz;
+	while (left > 0) {
+		ssize_t n = write(sink->fd, p, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		p += n;
+		left -= n;
+	}
+#ifdef SYNC_FILE_RANGE_WRITE
+	if (sink->writeback)
+		sync_file_range(sink->fd, sink->offset, sz,
+				SYNC_FILE_RANGE_WRITE);
+#endif
+	sink->offset += sz;
+	return sz;
+}
+
+static void fd_sink_init(struct fd_sink *sink, struct reftable_stack *st,
+			 int fd)
+{
+	sink->fd = fd;
+	sink->writeback = st->config.fsync_mode != REFTABLE_FSYNC_NONE;
+	sink->offset = 0;
+}
+
+/* Makes the contents of `fd` durable, as configured by fsync_mode. */
+static int stack_fsync(struct reftable_stack *st, int fd)
+{
+	int err = 0;
+	switch (st->config.fsync_mode) {
+	case REFTABLE_FSYNC_NONE:
+		return 0;
+	case REFTABLE_FSYNC_DATA:
+		err = fdatasync(fd);
+		break;
+	default:
+		err = fsync(fd);
+		break;
+	}
+	return err < 0 ? REFTABLE_IO_ERROR : 0;
+}
+
+/* Makes renames in the stack directory durable, for REFTABLE_FSYNC_FULL. */
+static int stack_fsync_dir(struct reftable_stack *st)
+{
+	int fd = 0;
+	int err = 0;
+	if (st->config.fsync_mode != REFTABLE_FSYNC_FULL)
+		return 0;
+
+	fd = open(st->reftable_dir, O_RDONLY);
+	if (fd < 0)
+		return REFTABLE_IO_ERROR;
+	err = fsync(fd);
+	close(fd);
+	return err < 0 ? REFTABLE_IO_ERROR : 0;
 }
 
 int reftable_new_stack(struct reftable_stack **dest, const char *dir,
@@ -56,6 +139,7 @@ int reftable_new_stack(struct reftable_stack **dest, const char *dir,
 	p->list_file = strbuf_detach(&list_file_name, NULL);
 	p->reftable_dir = xstrdup(dir);
 	p->config = config;
+	p->group = group_commit_new();
 
 	err = reftable_stack_reload_maybe_reuse(p, 1);
 	if (err < 0) {
@@ -121,6 +205,7 @@ reftable_stack_merged_table(struct reftable_stack *st)
 /* Close and free the stack */
 void reftable_stack_destroy(struct reftable_stack *st)
 {
+	reftable_stack_stop_compaction_worker(st);
 	if (st->merged != NULL) {
 		reftable_merged_table_free(st->merged);
 		st->merged = NULL;
@@ -136,6 +221,9 @@ void reftable_stack_destroy(struct reftable_stack *st)
 	}
 	FREE_AND_NULL(st->list_file);
 	FREE_AND_NULL(st->reftable_dir);
+	FREE_AND_NULL(st->probe_snapshot);
+	reftable_writer_free(st->writer);
+	group_commit_free(st->group);
 	reftable_free(st);
 }
 
@@ -235,6 +323,15 @@ static int reftable_stack_reload_once(struct reftable_stack *st, char **names,
 
 done:
 	for (i = 0; i < new_readers_len; i++) {
+		/* readers taken over from the current stack are still in
+		 * use. */
+		int j = 0;
+		for (j = 0; j < cur_len; j++) {
+			if (st->readers[j] == new_readers[i])
+				break;
+		}
+		if (j < cur_len)
+			continue;
 		reader_close(new_readers[i]);
 		reftable_reader_free(new_readers[i]);
 	}
@@ -324,6 +421,28 @@ static int reftable_stack_reload_maybe_reuse(struct reftable_stack *st,
 	return 0;
 }
 
+static uint64_t now_usecs(void)
+{
+	struct timeval tv = { 0 };
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* returns the CPU time used by the calling thread. */
+static uint64_t thread_cpu_usecs(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* returns the current size of the file written through `fd`. */
+static uint64_t fd_written_size(int fd)
+{
+	off_t off = lseek(fd, 0, SEEK_CUR);
+	return off < 0 ? 0 : off;
+}
+
 /* -1 = error
  0 = up to date
  1 = changed. */
@@ -380,7 +499,8 @@ int reftable_stack_add(struct reftable_stack *st,
 		return err;
 	}
 
-	if (!st->disable_auto_compact)
+	/* with a worker, the commit has already triggered compaction. */
+	if (st->worker == NULL && !st->disable_auto_compact)
 		return reftable_stack_auto_compact(st);
 
 	return 0;
@@ -402,6 +522,13 @@ struct reftable_addition {
 	char **new_tables;
 	int new_tables_len;
 	uint64_t next_update_index;
+
+	/* Optimistic additions take the lock only in commit. Until then,
+	 * new_tables holds temporary names, since concurrent writers may
+	 * produce tables with the same final name. */
+	int optimistic;
+	char **new_tables_final;
+	uint64_t *new_tables_min_update_index;
 };
 
 #define REFTABLE_ADDITION_INIT                \
@@ -409,6 +536,33 @@ struct reftable_addition {
 		.lock_file_name = STRBUF_INIT \
 	}
 
+/* How long an addition waits for the table list lock held by the compaction
+ * worker, which only holds it briefly. */
+#define ADDITION_LOCK_TIMEOUT_MS 100
+
+/* How long a compaction waits to install its result. */
+#define COMPACTION_LOCK_TIMEOUT_MS 1000
+
+/* Creates `lock_name` exclusively. While it is held by someone else, retry
+ * with exponential backoff for up to `timeout_ms`. Returns the file
+ * descriptor, or -1 with errno set. */
+static int open_lock_with_backoff(const char *lock_name, int timeout_ms)
+{
+	int delay = 1;
+	int waited = 0;
+	while (1) {
+		int fd = open(lock_name, O_EXCL | O_CREAT | O_WRONLY, 0644);
+		if (fd >= 0 || errno != EEXIST || waited >= timeout_ms)
+			return fd;
+
+		if (delay > timeout_ms - waited)
+			delay = timeout_ms - waited;
+		sleep_millisec(delay);
+		waited += delay;
+		delay *= 2;
+	}
+}
+
 static int reftable_stack_init_addition(struct reftable_addition *add,
 					struct reftable_stack *st)
 {
@@ -419,20 +573,35 @@ static int reftable_stack_init_addition(struct reftable_addition *add,
 	strbuf_addstr(&add->lock_file_name, st->list_file);
 	strbuf_addstr(&add->lock_file_name, ".lock");
 
-	add->lock_file_fd = open(add->lock_file_name.buf,
-				 O_EXCL | O_CREAT | O_WRONLY, 0644);
+	add->lock_file_fd = open_lock_with_backoff(
+		add->lock_file_name.buf,
+		st->worker != NULL ? ADDITION_LOCK_TIMEOUT_MS : 0);
 	if (add->lock_file_fd < 0) {
 		if (errno == EEXIST) {
 			err = REFTABLE_LOCK_ERROR;
 		} else {
 			err = REFTABLE_IO_ERROR;
 		}
+		/* the lock isn't ours, so don't remove it. */
+		strbuf_release(&add->lock_file_name);
 		goto done;
 	}
 	err = stack_uptodate(st);
 	if (err < 0)
 		goto done;
 
+	if (err > 0 && st->worker != NULL) {
+		/* Our worker may have compacted the stack. That doesn't change
+		 * its contents, so reload, unless another addition happened in
+		 * the meantime. */
+		uint64_t next = reftable_stack_next_update_index(st);
+		err = reftable_stack_reload_maybe_reuse(st, 1);
+		if (err < 0)
+			goto done;
+		if (next != reftable_stack_next_update_index(st))
+			err = 1;
+	}
+
 	if (err > 1) {
 		err = REFTABLE_LOCK_ERROR;
 		goto done;
@@ -461,6 +630,12 @@ static void reftable_addition_close(struct reftable_addition *add)
 	}
 	reftable_free(add->new_tables);
 	add->new_tables = NULL;
+	if (add->new_tables_final != NULL) {
+		for (i = 0; i < add->new_tables_len; i++)
+			reftable_free(add->new_tables_final[i]);
+		FREE_AND_NULL(add->new_tables_final);
+	}
+	FREE_AND_NULL(add->new_tables_min_update_index);
 	add->new_tables_len = 0;
 
 	if (add->lock_file_fd > 0) {
@@ -484,14 +659,107 @@ void reftable_addition_destroy(struct reftable_addition *add)
 	reftable_free(add);
 }
 
+/* Takes the lock for an optimistic addition, and checks that its tables still
+ * fit on top of the stack. Conflicts with additions that happened since the
+ * tables were written are reported as REFTABLE_LOCK_ERROR. */
+static int reftable_addition_lock_optimistic(struct reftable_addition *add)
+{
+	struct reftable_stack *st = add->stack;
+	struct strbuf temp_path = STRBUF_INIT;
+	struct strbuf path = STRBUF_INIT;
+	uint64_t next = 0;
+	int changed = 0;
+	int err = 0;
+	int i = 0;
+
+	strbuf_reset(&add->lock_file_name);
+	strbuf_addstr(&add->lock_file_name, st->list_file);
+	strbuf_addstr(&add->lock_file_name, ".lock");
+
+	add->lock_file_fd = open_lock_with_backoff(add->lock_file_name.buf,
+						   ADDITION_LOCK_TIMEOUT_MS);
+	if (add->lock_file_fd < 0) {
+		if (errno == EEXIST) {
+			err = REFTABLE_LOCK_ERROR;
+		} else {
+			err = REFTABLE_IO_ERROR;
+		}
+		strbuf_release(&add->lock_file_name);
+		goto done;
+	}
+
+	err = stack_uptodate(st);
+	if (err < 0)
+		goto done;
+	if (err > 0) {
+		err = reftable_stack_reload_maybe_reuse(st, 1);
+		if (err < 0)
+			goto done;
+		changed = 1;
+	}
+
+	next = reftable_stack_next_update_index(st);
+	for (i = 0; i < add->new_tables_len; i++) {
+		if (add->new_tables_min_update_index[i] < next) {
+			err = REFTABLE_LOCK_ERROR;
+			goto done;
+		}
+		if (!changed)
+			continue;
+
+		strbuf_reset(&temp_path);
+		strbuf_addstr(&temp_path, st->reftable_dir);
+		strbuf_addstr(&temp_path, "/");
+		strbuf_addstr(&temp_path, add->new_tables[i]);
+		err = stack_check_addition(st, temp_path.buf);
+		if (err == REFTABLE_NAME_CONFLICT)
+			err = REFTABLE_LOCK_ERROR;
+		if (err < 0)
+			goto done;
+	}
+
+	for (i = 0; i < add->new_tables_len; i++) {
+		strbuf_reset(&temp_path);
+		strbuf_addstr(&temp_path, st->reftable_dir);
+		strbuf_addstr(&temp_path, "/");
+		strbuf_addstr(&temp_path, add->new_tables[i]);
+
+		strbuf_reset(&path);
+		strbuf_addstr(&path, st->reftable_dir);
+		strbuf_addstr(&path, "/");
+		strbuf_addstr(&path, add->new_tables_final[i]);
+
+		err = rename(temp_path.buf, path.buf);
+		if (err < 0) {
+			err = REFTABLE_IO_ERROR;
+			goto done;
+		}
+		reftable_free(add->new_tables[i]);
+		add->new_tables[i] = add->new_tables_final[i];
+		add->new_tables_final[i] = NULL;
+	}
+
+done:
+	strbuf_release(&temp_path);
+	strbuf_release(&path);
+	return err;
+}
+
 int reftable_addition_commit(struct reftable_addition *add)
 {
 	struct strbuf table_list = STRBUF_INIT;
 	int i = 0;
 	int err = 0;
+	int fsync_err = 0;
 	if (add->new_tables_len == 0)
 		goto done;
 
+	if (add->optimistic) {
+		err = reftable_addition_lock_optimistic(add);
+		if (err < 0)
+			goto done;
+	}
+
 	for (i = 0; i < add->stack->merged->stack_len; i++) {
 		strbuf_addstr(&table_list, add->stack->readers[i]->name);
 		strbuf_addstr(&table_list, "\n");
@@ -501,13 +769,21 @@ int reftable_addition_commit(struct reftable_addition *add)
 		strbuf_addstr(&table_list, "\n");
 	}
 
+	/* the new tables must be in place before tables.list names them. */
+	err = stack_fsync_dir(add->stack);
+	if (err < 0)
+		goto done;
+
 	err = write(add->lock_file_fd, table_list.buf, table_list.len);
-	strbuf_release(&table_list);
 	if (err < 0) {
 		err = REFTABLE_IO_ERROR;
 		goto done;
 	}
 
+	err = stack_fsync(add->stack, add->lock_file_fd);
+	if (err < 0)
+		goto done;
+
 	err = close(add->lock_file_fd);
 	add->lock_file_fd = 0;
 	if (err < 0) {
@@ -530,12 +806,38 @@ int reftable_addition_commit(struct reftable_addition *add)
 	add->new_tables = NULL;
 	add->new_tables_len = 0;
 
+	/* tables.list is in place, so the addition is committed even if the
+	 * directory can't be synced. Reload before reporting that. */
+	fsync_err = stack_fsync_dir(add->stack);
 	err = reftable_stack_reload(add->stack);
+	if (err == 0)
+		err = fsync_err;
+	if (add->stack->worker != NULL)
+		compaction_worker_trigger(add->stack->worker);
 done:
+	strbuf_release(&table_list);
 	reftable_addition_close(add);
 	return err;
 }
 
+int reftable_stack_new_optimistic_addition(struct reftable_addition **dest,
+					   struct reftable_stack *st)
+{
+	struct reftable_addition empty = REFTABLE_ADDITION_INIT;
+	int err = reftable_stack_reload(st);
+	if (err < 0) {
+		*dest = NULL;
+		return err;
+	}
+
+	*dest = reftable_calloc(sizeof(**dest));
+	**dest = empty;
+	(*dest)->stack = st;
+	(*dest)->optimistic = 1;
+	(*dest)->next_update_index = reftable_stack_next_update_index(st);
+	return 0;
+}
+
 int reftable_stack_new_addition(struct reftable_addition **dest,
 				struct reftable_stack *st)
 {
@@ -575,6 +877,42 @@ done:
 	return err;
 }
 
+/* writers that grew larger than this while writing a big table are not kept
+ * in the stack's writer cache. */
+#define STACK_WRITER_CACHE_LIMIT (1 << 20)
+
+/* returns the cached writer, reset to write to `writer_func`, or a new one. */
+static struct reftable_writer *
+stack_take_writer(struct reftable_stack *st,
+		  int (*writer_func)(void *, const void *, size_t),
+		  void *writer_arg)
+{
+	struct reftable_writer *wr = st->writer;
+	if (wr == NULL)
+		return reftable_new_writer(writer_func, writer_arg,
+					   &st->config);
+
+	st->writer = NULL;
+	reftable_writer_reset(wr, writer_func, writer_arg);
+	return wr;
+}
+
+static void stack_return_writer(struct reftable_stack *st,
+				struct reftable_writer *wr)
+{
+	size_t retained = 0;
+	if (wr == NULL)
+		return;
+
+	retained = wr->index_cap * sizeof(struct reftable_index_record) +
+		   wr->obj_index.cap * sizeof(struct obj_index_entry);
+	if (st->writer != NULL || retained > STACK_WRITER_CACHE_LIMIT) {
+		reftable_writer_free(wr);
+		return;
+	}
+	st->writer = wr;
+}
+
 int reftable_addition_add(struct reftable_addition *add,
 			  int (*write_table)(struct reftable_writer *wr,
 					     void *arg),
@@ -586,6 +924,7 @@ int reftable_addition_add(struct reftable_addition *add,
 	struct reftable_writer *wr = NULL;
 	int err = 0;
 	int tab_fd = 0;
+	struct fd_sink sink = { 0 };
 
 	strbuf_reset(&next_name);
 	format_name(&next_name, add->next_update_index, add->next_update_index);
@@ -601,8 +940,9 @@ int reftable_addition_add(struct reftable_addition *add,
 		goto done;
 	}
 
-	wr = reftable_new_writer(reftable_fd_write, &tab_fd,
-				 &add->stack->config);
+	fd_sink_init(&sink, add->stack, tab_fd);
+	wr = stack_take_writer(add->stack, reftable_fd_write, &sink);
+	wr->record_names = !add->stack->config.skip_name_check;
 	err = write_table(wr, arg);
 	if (err < 0)
 		goto done;
@@ -615,6 +955,10 @@ int reftable_addition_add(struct reftable_addition *add,
 	if (err < 0)
 		goto done;
 
+	add->stack->stack_stats.addition_bytes += fd_written_size(tab_fd);
+	err = stack_fsync(add->stack, tab_fd);
+	if (err < 0)
+		goto done;
 	err = close(tab_fd);
 	tab_fd = 0;
 	if (err < 0) {
@@ -622,7 +966,7 @@ int reftable_addition_add(struct reftable_addition *add,
 		goto done;
 	}
 
-	err = stack_check_addition(add->stack, temp_tab_file_name.buf);
+	err = stack_check_written_names(add->stack, &wr->names);
 	if (err < 0)
 		goto done;
 
@@ -634,6 +978,31 @@ int reftable_addition_add(struct reftable_addition *add,
 	format_name(&next_name, wr->min_update_index, wr->max_update_index);
 	strbuf_addstr(&next_name, ".ref");
 
+	if (add->optimistic) {
+		int n = add->new_tables_len + 1;
+		add->new_tables = reftable_realloc(
+			add->new_tables, sizeof(*add->new_tables) * n);
+		add->new_tables_final = reftable_realloc(
+			add->new_tables_final,
+			sizeof(*add->new_tables_final) * n);
+		add->new_tables_min_update_index = reftable_realloc(
+			add->new_tables_min_update_index,
+			sizeof(*add->new_tables_min_update_index) * n);
+
+		add->new_tables[add->new_tables_len] = xstrdup(
+			temp_tab_file_name.buf +
+			strlen(add->stack->reftable_dir) + 1);
+		add->new_tables_final[add->new_tables_len] =
+			strbuf_detach(&next_name, NULL);
+		add->new_tables_min_update_index[add->new_tables_len] =
+			wr->min_update_index;
+		add->new_tables_len++;
+
+		/* keep the temporary file around until commit. */
+		strbuf_reset(&temp_tab_file_name);
+		goto done;
+	}
+
 	strbuf_addstr(&tab_file_name, add->stack->reftable_dir);
 	strbuf_addstr(&tab_file_name, "/");
 	strbuf_addbuf(&tab_file_name, &next_name);
@@ -662,7 +1031,7 @@ done:
 	strbuf_release(&temp_tab_file_name);
 	strbuf_release(&tab_file_name);
 	strbuf_release(&next_name);
-	reftable_writer_free(wr);
+	stack_return_writer(add->stack, wr);
 	return err;
 }
 
@@ -677,10 +1046,12 @@ uint64_t reftable_stack_next_update_index(struct reftable_stack *st)
 
 static int stack_compact_locked(struct reftable_stack *st, int first, int last,
 				struct strbuf *temp_tab,
-				struct reftable_log_expiry_config *config)
+				struct reftable_log_expiry_config *config,
+				int logs_only)
 {
 	struct strbuf next_name = STRBUF_INIT;
 	int tab_fd = -1;
+	struct fd_sink sink = { 0 };
 	struct reftable_writer *wr = NULL;
 	int err = 0;
 
@@ -695,15 +1066,30 @@ static int stack_compact_locked(struct reftable_stack *st, int first, int last,
 	strbuf_addstr(temp_tab, ".temp.XXXXXX");
 
 	tab_fd = mkstemp(temp_tab->buf);
-	wr = reftable_new_writer(reftable_fd_write, &tab_fd, &st->config);
+	fd_sink_init(&sink, st, tab_fd);
+	if (st->throttle != NULL) {
+		compaction_worker_begin_write(st->throttle, &sink);
+		wr = reftable_new_writer(compaction_worker_write, st->throttle,
+					 &st->config);
+	} else {
+		wr = reftable_new_writer(reftable_fd_write, &sink,
+					 &st->config);
+	}
 
-	err = stack_write_compact(st, wr, first, last, config);
+	if (logs_only)
+		err = stack_write_expired_logs(st, wr, first, config);
+	else
+		err = stack_write_compact(st, wr, first, last, config);
 	if (err < 0)
 		goto done;
 	err = reftable_writer_close(wr);
 	if (err < 0)
 		goto done;
 
+	st->stack_stats.compaction_bytes += fd_written_size(tab_fd);
+	err = stack_fsync(st, tab_fd);
+	if (err < 0)
+		goto done;
 	err = close(tab_fd);
 	tab_fd = 0;
 
@@ -721,119 +1107,694 @@ done:
 	return err;
 }
 
-static int stack_write_compact(struct reftable_stack *st,
-			       struct reftable_writer *wr, int first, int last,
-			       struct reftable_log_expiry_config *config)
+static int log_record_expired(struct reftable_log_record *log,
+			      struct reftable_log_expiry_config *config)
 {
-	int subtabs_len = last - first + 1;
-	struct reftable_table *subtabs = reftable_calloc(
-		sizeof(struct reftable_table) * (last - first + 1));
-	struct reftable_merged_table *mt = NULL;
-	int err = 0;
-	struct reftable_iterator it = { NULL };
-	struct reftable_ref_record ref = { NULL };
-	struct reftable_log_record log = { NULL };
-
-	uint64_t entries = 0;
+	if (config == NULL || reftable_log_record_is_deletion(log))
+		return 0;
+	if (config->time > 0 && log->time < config->time)
+		return 1;
+	return config->min_update_index > 0 &&
+	       log->update_index < config->min_update_index;
+}
 
-	int i = 0, j = 0;
-	for (i = first, j = 0; i <= last; i++) {
-		struct reftable_reader *t = st->readers[i];
-		reftable_table_from_reader(&subtabs[j++], t);
-		st->stats.bytes += t->size;
+/* the tables below the ones being rewritten. An expired log entry that hides
+ * an entry of theirs is written as a deletion instead of being dropped, so
+ * the older entry stays hidden. */
+struct expiry_shadow {
+	struct reftable_merged_table *mt;
+	struct reftable_iterator it;
+	struct reftable_log_record log;
+	/* the key of `log`: the first key at or after the last seek. */
+	struct strbuf key;
+	struct strbuf want;
+	int has_key;
+	int done;
+};
+#define EXPIRY_SHADOW_INIT                              \
+	{                                               \
+		.key = STRBUF_INIT, .want = STRBUF_INIT \
 	}
-	reftable_writer_set_limits(wr, st->readers[first]->min_update_index,
-				   st->readers[last]->max_update_index);
 
-	err = reftable_new_merged_table(&mt, subtabs, subtabs_len,
+/* sets up `s`, which must be EXPIRY_SHADOW_INIT, for rewriting tables from
+ * `first` on. */
+static int expiry_shadow_init(struct expiry_shadow *s,
+			      struct reftable_stack *st, int first)
+{
+	struct reftable_table *tabs = NULL;
+	int err = 0;
+	int i = 0;
+
+	if (first == 0)
+		return 0;
+
+	tabs = reftable_calloc(sizeof(struct reftable_table) * first);
+	for (i = 0; i < first; i++)
+		reftable_table_from_reader(&tabs[i], st->readers[i]);
+	err = reftable_new_merged_table(&s->mt, tabs, first,
 					st->config.hash_id);
 	if (err < 0) {
-		reftable_free(subtabs);
-		goto done;
+		reftable_free(tabs);
+		return err;
 	}
+	/* an entry that is deleted below needs no deletion on top. */
+	s->mt->suppress_deletions = 1;
+	return 0;
+}
 
-	err = reftable_merged_table_seek_ref(mt, &it, "");
-	if (err < 0)
-		goto done;
-
-	while (1) {
-		err = reftable_iterator_next_ref(&it, &ref);
-		if (err > 0) {
-			err = 0;
-			break;
-		}
-		if (err < 0) {
-			break;
-		}
+static void expiry_shadow_release(struct expiry_shadow *s)
+{
+	reftable_iterator_destroy(&s->it);
+	reftable_log_record_release(&s->log);
+	strbuf_release(&s->key);
+	strbuf_release(&s->want);
+	reftable_merged_table_free(s->mt);
+	s->mt = NULL;
+}
 
-		if (first == 0 && reftable_ref_record_is_deletion(&ref)) {
-			continue;
-		}
+/* returns 1 if the tables below have an entry with the key of `log`. Keys may
+ * not decrease between calls. */
+static int expiry_shadow_covers(struct expiry_shadow *s,
+				struct reftable_log_record *log)
+{
+	struct reftable_record rec = { NULL };
+	struct reftable_record found = { NULL };
+	int err = 0;
+	if (s->mt == NULL || s->done)
+		return 0;
 
-		err = reftable_writer_add_ref(wr, &ref);
-		if (err < 0) {
-			break;
-		}
-		entries++;
+	reftable_record_from_log(&rec, log);
+	reftable_record_key(&rec, &s->want);
+	if (!s->has_key || strbuf_cmp(&s->key, &s->want) < 0) {
+		reftable_iterator_destroy(&s->it);
+		err = reftable_merged_table_seek_log_at(
+			s->mt, &s->it, log->refname, log->update_index);
+		if (err == 0)
+			err = reftable_iterator_next_log(&s->it, &s->log);
+		if (err > 0)
+			s->done = 1;
+		if (err != 0)
+			return err < 0 ? err : 0;
+		reftable_record_from_log(&found, &s->log);
+		reftable_record_key(&found, &s->key);
+		s->has_key = 1;
 	}
-	reftable_iterator_destroy(&it);
+	return !strbuf_cmp(&s->key, &s->want);
+}
 
-	err = reftable_merged_table_seek_log(mt, &it, "");
-	if (err < 0)
-		goto done;
+/* returns 1 if `log` is expired and can be dropped, and 0 if it must be
+ * written. An expired entry that hides one below is turned into a
+ * deletion. */
+static int expiry_shadow_filter(struct expiry_shadow *s,
+				struct reftable_log_record *log,
+				struct reftable_log_expiry_config *config)
+{
+	int err = 0;
+	if (!log_record_expired(log, config))
+		return 0;
+	err = expiry_shadow_covers(s, log);
+	if (err <= 0)
+		return err < 0 ? err : 1;
+
+	FREE_AND_NULL(log->new_hash);
+	FREE_AND_NULL(log->old_hash);
+	FREE_AND_NULL(log->name);
+	FREE_AND_NULL(log->email);
+	FREE_AND_NULL(log->message);
+	log->time = 0;
+	log->tz_offset = 0;
+	return 0;
+}
 
-	while (1) {
-		err = reftable_iterator_next_log(&it, &log);
-		if (err > 0) {
-			err = 0;
-			break;
-		}
-		if (err < 0) {
-			break;
-		}
-		if (first == 0 && reftable_log_record_is_deletion(&log)) {
-			continue;
-		}
+/* Compaction copies runs of at least this many blocks verbatim. Shorter runs
+ * aren't worth the partially filled blocks written around them. */
+#define COMPACT_MIN_COPY_BLOCKS 4
 
-		if (config != NULL && config->time > 0 &&
-		    log.time < config->time) {
-			continue;
-		}
+/* a ref or log block that compaction can copy verbatim: no other table has
+ * keys after the start key of the block, up to its last key. */
+struct compact_block {
+	struct writer_block b;
+	/* boolean: the preceding block of the table is planned too. */
+	int follows;
+};
 
-		if (config != NULL && config->min_update_index > 0 &&
-		    log.update_index < config->min_update_index) {
-			continue;
-		}
+struct compact_plan {
+	struct compact_block *blocks;
+	size_t len;
+	size_t cap;
+};
 
-		err = reftable_writer_add_log(wr, &log);
-		if (err < 0) {
-			break;
-		}
-		entries++;
+static void compact_plan_truncate(struct compact_plan *plan, size_t len)
+{
+	while (plan->len > len) {
+		struct compact_block *b = &plan->blocks[--plan->len];
+		strbuf_release(&b->b.idx.last_key);
+		strbuf_release(&b->b.start_key);
 	}
+}
 
-done:
-	reftable_iterator_destroy(&it);
-	if (mt != NULL) {
-		merged_table_release(mt);
-		reftable_merged_table_free(mt);
-	}
-	reftable_ref_record_release(&ref);
-	reftable_log_record_release(&log);
-	st->stats.entries_written += entries;
-	return err;
+static int compact_block_compare(const void *a, const void *b)
+{
+	const struct compact_block *ba = a;
+	const struct compact_block *bb = b;
+	return strbuf_cmp(&ba->b.idx.last_key, &bb->b.idx.last_key);
 }
 
-/* <  0: error. 0 == OK, > 0 attempt failed; could retry. */
-static int stack_compact_range(struct reftable_stack *st, int first, int last,
-			       struct reftable_log_expiry_config *expiry)
+/* sets `rec` to a record with key `key`, for seeking to it. */
+static int compact_record_from_key(struct reftable_record *rec,
+				   struct strbuf *key, int hash_size)
+{
+	/* a deletion, with update_index 0 for refs. */
+	uint8_t zero = 0;
+	struct string_view in = { .buf = &zero, .len = 1 };
+	int n = reftable_record_decode(rec, *key, 0, in, hash_size);
+	return n < 0 ? n : 0;
+}
+
+/* another table, for checking which keys it has in a block's range. */
+struct compact_probe {
+	struct reftable_reader *r;
+	struct reftable_iterator it;
+	struct reftable_record rec;
+	/* the first key after the last seek. */
+	struct strbuf key;
+	int has_key;
+	int done;
+};
+
+/* returns 1 if `p` has keys in (lo, hi], where an empty `lo` has no bound.
+ * `lo` may not decrease between calls. */
+static int compact_probe_overlaps(struct compact_probe *p, struct strbuf *lo,
+				  struct strbuf *hi, int hash_size)
+{
+	int err = 0;
+	if (p->done)
+		return 0;
+	if (!p->has_key || strbuf_cmp(&p->key, lo) <= 0) {
+		reftable_iterator_destroy(&p->it);
+		if (lo->len == 0) {
+			err = reftable_record_type(&p->rec) == BLOCK_TYPE_REF ?
+				      reftable_reader_seek_ref(p->r, &p->it, "") :
+				      reftable_reader_seek_log(p->r, &p->it, "");
+		} else {
+			err = compact_record_from_key(&p->rec, lo, hash_size);
+			if (err == 0)
+				err = reader_seek(p->r, &p->it, &p->rec);
+		}
+		while (err == 0) {
+			err = iterator_next(&p->it, &p->rec);
+			if (err != 0)
+				break;
+			reftable_record_key(&p->rec, &p->key);
+			if (strbuf_cmp(&p->key, lo) > 0)
+				break;
+		}
+		if (err > 0)
+			p->done = 1;
+		if (err != 0)
+			return err < 0 ? err : 0;
+		p->has_key = 1;
+	}
+	return strbuf_cmp(&p->key, hi) <= 0;
+}
+
+/* adds the blocks of table `k` that no table in [first, last] overlaps to
+ * `plan`, in runs of at least COMPACT_MIN_COPY_BLOCKS. The blocks are found in
+ * the index of the section, so they aren't read. */
+static int compact_plan_table(struct reftable_stack *st, int first, int last,
+			      int k, uint8_t typ, struct compact_plan *plan)
+{
+	struct reftable_reader *r = st->readers[k];
+	int hsize = hash_size(st->config.hash_id);
+	struct compact_probe *probes =
+		reftable_calloc(sizeof(struct compact_probe) * (last - first));
+	int probes_len = 0;
+	struct reftable_index_record *blocks = NULL;
+	size_t blocks_len = 0;
+	uint64_t end = 0;
+	struct strbuf start_key = STRBUF_INIT;
+	int prev_planned = 0;
+	size_t run_start = plan->len;
+	size_t j = 0;
+	int err = 0;
+	int i = 0;
+
+	/* sections without an index have too few blocks for a run. */
+	err = reader_section_blocks(r, typ, &blocks, &blocks_len, &end);
+	if (err != 0) {
+		err = err < 0 ? err : 0;
+		goto done;
+	}
+
+	for (i = first; i <= last; i++) {
+		struct compact_probe *p = &probes[probes_len];
+		if (i == k)
+			continue;
+		p->r = st->readers[i];
+		p->rec = reftable_new_record(typ);
+		strbuf_init(&p->key, 0);
+		probes_len++;
+	}
+
+	for (j = 0; j < blocks_len; j++) {
+		struct reftable_index_record *idx = &blocks[j];
+		uint64_t next_off =
+			(j + 1 < blocks_len) ? blocks[j + 1].offset : end;
+		int overlaps = 0;
+
+		for (i = 0; !overlaps && i < probes_len; i++) {
+			overlaps = compact_probe_overlaps(
+				&probes[i], &start_key, &idx->last_key, hsize);
+			if (overlaps < 0) {
+				err = overlaps;
+				goto done;
+			}
+		}
+		if (!overlaps) {
+			struct compact_block *b = NULL;
+			if (plan->len == plan->cap) {
+				plan->cap = 2 * plan->cap + 1;
+				plan->blocks = reftable_realloc(
+					plan->blocks, sizeof(struct compact_block) *
+							      plan->cap);
+			}
+			b = &plan->blocks[plan->len++];
+			memset(b, 0, sizeof(*b));
+			b->b.r = r;
+			b->b.idx = *idx;
+			strbuf_init(&b->b.idx.last_key, 0);
+			strbuf_addbuf(&b->b.idx.last_key, &idx->last_key);
+			b->b.len = next_off - idx->offset;
+			strbuf_init(&b->b.start_key, 0);
+			strbuf_addbuf(&b->b.start_key, &start_key);
+			b->follows = prev_planned;
+		} else {
+			if (plan->len - run_start < COMPACT_MIN_COPY_BLOCKS)
+				compact_plan_truncate(plan, run_start);
+			run_start = plan->len;
+		}
+		prev_planned = !overlaps;
+
+		strbuf_reset(&start_key);
+		strbuf_addbuf(&start_key, &idx->last_key);
+	}
+	if (plan->len - run_start < COMPACT_MIN_COPY_BLOCKS)
+		compact_plan_truncate(plan, run_start);
+	err = 0;
+
+done:
+	for (i = 0; i < probes_len; i++) {
+		reftable_iterator_destroy(&probes[i].it);
+		reftable_record_destroy(&probes[i].rec);
+		strbuf_release(&probes[i].key);
+	}
+	reftable_free(probes);
+	for (j = 0; j < blocks_len; j++)
+		strbuf_release(&blocks[j].last_key);
+	reftable_free(blocks);
+	strbuf_release(&start_key);
+	return err;
+}
+
+/* merges the records of tables [first, last] that the plan doesn't copy. */
+struct compact_merge {
+	struct reftable_writer *wr;
+	struct reftable_merged_table *mt;
+	int hash_size;
+	int drop_deletions;
+	struct reftable_iterator it;
+	/* the next record, if it was read but not written yet. */
+	struct reftable_record rec;
+	int has_rec;
+	int done;
+	struct strbuf key;
+	uint64_t entries;
+};
+
+/* writes the records up to `limit`; all of them if `limit` is NULL. */
+static int compact_merge_until(struct compact_merge *m, struct strbuf *limit)
 {
-	struct strbuf temp_tab_file_name = STRBUF_INIT;
-	struct strbuf new_table_name = STRBUF_INIT;
-	struct strbuf lock_file_name = STRBUF_INIT;
-	struct strbuf ref_list_contents = STRBUF_INIT;
-	struct strbuf new_table_path = STRBUF_INIT;
 	int err = 0;
+	while (!m->done) {
+		if (!m->has_rec) {
+			err = iterator_next(&m->it, &m->rec);
+			if (err > 0) {
+				m->done = 1;
+				break;
+			}
+			if (err < 0)
+				return err;
+			m->has_rec = 1;
+		}
+		if (limit != NULL) {
+			reftable_record_key(&m->rec, &m->key);
+			if (strbuf_cmp(&m->key, limit) > 0)
+				break;
+		}
+		m->has_rec = 0;
+
+		if (m->drop_deletions && reftable_record_is_deletion(&m->rec))
+			continue;
+		if (reftable_record_type(&m->rec) == BLOCK_TYPE_REF)
+			err = reftable_writer_add_ref(
+				m->wr, reftable_record_as_ref(&m->rec));
+		else
+			err = reftable_writer_add_log(
+				m->wr, reftable_record_as_log(&m->rec));
+		if (err < 0)
+			return err;
+		m->entries++;
+	}
+	return 0;
+}
+
+/* continues merging after the key `after`. */
+static int compact_merge_seek(struct compact_merge *m, struct strbuf *after)
+{
+	int err = 0;
+	reftable_iterator_destroy(&m->it);
+	m->has_rec = 0;
+	m->done = 0;
+	err = compact_record_from_key(&m->rec, after, m->hash_size);
+	if (err == 0)
+		err = merged_table_seek_record(m->mt, &m->it, &m->rec);
+	while (err == 0) {
+		err = iterator_next(&m->it, &m->rec);
+		if (err != 0)
+			break;
+		reftable_record_key(&m->rec, &m->key);
+		if (strbuf_cmp(&m->key, after) > 0) {
+			m->has_rec = 1;
+			return 0;
+		}
+	}
+	if (err > 0) {
+		m->done = 1;
+		err = 0;
+	}
+	return err;
+}
+
+/* Writes the refs or logs of tables [first, last]. Blocks that no other table
+ * overlaps are copied verbatim; the records around them are merged. */
+static int stack_write_compact_section(struct reftable_stack *st,
+				       struct reftable_writer *wr,
+				       struct reftable_merged_table *mt,
+				       int first, int last, uint8_t typ,
+				       uint64_t *entries)
+{
+	struct compact_plan plan = { NULL };
+	struct compact_merge m = {
+		.wr = wr,
+		.mt = mt,
+		.hash_size = hash_size(st->config.hash_id),
+		.drop_deletions = first == 0,
+		.rec = reftable_new_record(typ),
+		.key = STRBUF_INIT,
+	};
+	const struct reftable_block_stats *bstats =
+		(typ == BLOCK_TYPE_REF) ? &writer_stats(wr)->ref_stats :
+					  &writer_stats(wr)->log_stats;
+	/* the last key of the last copied block, after which merging
+	 * continues. */
+	struct strbuf *resume = NULL;
+	/* boolean: the merge iterator is behind the last copied block. */
+	int copied = 0;
+	size_t i = 0;
+	int err = 0;
+	int k = 0;
+
+	for (k = first; k <= last; k++) {
+		struct reftable_reader *r = st->readers[k];
+		/* ref blocks store update indices relative to their table's,
+		 * and small tables can't fill a run. */
+		if (typ == BLOCK_TYPE_REF &&
+		    r->min_update_index != st->readers[first]->min_update_index)
+			continue;
+		if (r->size < COMPACT_MIN_COPY_BLOCKS * r->block_size)
+			continue;
+		err = compact_plan_table(st, first, last, k, typ, &plan);
+		if (err < 0)
+			goto done;
+	}
+	QSORT(plan.blocks, plan.len, compact_block_compare);
+
+	if (typ == BLOCK_TYPE_REF)
+		err = reftable_merged_table_seek_ref(mt, &m.it, "");
+	else
+		err = reftable_merged_table_seek_log(mt, &m.it, "");
+	if (err < 0)
+		goto done;
+
+	for (i = 0; i < plan.len; i++) {
+		struct compact_block *b = &plan.blocks[i];
+		uint64_t block_entries = bstats->entries;
+		if (!(b->follows && copied)) {
+			if (copied)
+				err = compact_merge_seek(&m, resume);
+			if (err == 0)
+				err = compact_merge_until(&m, &b->b.start_key);
+			if (err < 0)
+				goto done;
+			copied = 0;
+		}
+
+		err = writer_add_block(wr, &b->b, m.drop_deletions);
+		if (err < 0)
+			goto done;
+		if (err == 0) {
+			resume = &b->b.idx.last_key;
+			m.entries += bstats->entries - block_entries;
+			copied = 1;
+		} else if (copied) {
+			/* merging has to catch up with the refused block. */
+			err = compact_merge_seek(&m, resume);
+			if (err < 0)
+				goto done;
+			copied = 0;
+		}
+		err = 0;
+	}
+
+	if (copied)
+		err = compact_merge_seek(&m, resume);
+	if (err == 0)
+		err = compact_merge_until(&m, NULL);
+
+done:
+	*entries += m.entries;
+	reftable_iterator_destroy(&m.it);
+	reftable_record_destroy(&m.rec);
+	strbuf_release(&m.key);
+	compact_plan_truncate(&plan, 0);
+	reftable_free(plan.blocks);
+	return err;
+}
+
+static int stack_write_compact(struct reftable_stack *st,
+			       struct reftable_writer *wr, int first, int last,
+			       struct reftable_log_expiry_config *config)
+{
+	int subtabs_len = last - first + 1;
+	struct reftable_table *subtabs = reftable_calloc(
+		sizeof(struct reftable_table) * (last - first + 1));
+	struct reftable_merged_table *mt = NULL;
+	int err = 0;
+	struct reftable_iterator it = { NULL };
+	struct reftable_log_record log = { NULL };
+	struct expiry_shadow shadow = EXPIRY_SHADOW_INIT;
+
+	uint64_t entries = 0;
+
+	int i = 0, j = 0;
+	for (i = first, j = 0; i <= last; i++) {
+		struct reftable_reader *t = st->readers[i];
+		reftable_table_from_reader(&subtabs[j++], t);
+		st->stats.bytes += t->size;
+	}
+	reftable_writer_set_limits(wr, st->readers[first]->min_update_index,
+				   st->readers[last]->max_update_index);
+
+	err = reftable_new_merged_table(&mt, subtabs, subtabs_len,
+					st->config.hash_id);
+	if (err < 0) {
+		reftable_free(subtabs);
+		goto done;
+	}
+
+	err = stack_write_compact_section(st, wr, mt, first, last,
+					  BLOCK_TYPE_REF, &entries);
+	if (err < 0)
+		goto done;
+
+	if (config == NULL ||
+	    (config->time == 0 && config->min_update_index == 0)) {
+		err = stack_write_compact_section(st, wr, mt, first, last,
+						  BLOCK_TYPE_LOG, &entries);
+		goto done;
+	}
+
+	err = expiry_shadow_init(&shadow, st, first);
+	if (err < 0)
+		goto done;
+	/* above the bottom table, expired entries have to be seen, in case
+	 * they hide an older one. */
+	if (first == 0 && config->time > 0)
+		err = reftable_merged_table_seek_log_time(mt, &it, "",
+							  config->time,
+							  ~((uint64_t)0));
+	else
+		err = reftable_merged_table_seek_log(mt, &it, "");
+	if (err < 0)
+		goto done;
+
+	while (1) {
+		err = reftable_iterator_next_log(&it, &log);
+		if (err > 0) {
+			err = 0;
+			break;
+		}
+		if (err < 0) {
+			break;
+		}
+		if (first == 0 && reftable_log_record_is_deletion(&log)) {
+			continue;
+		}
+
+		err = expiry_shadow_filter(&shadow, &log, config);
+		if (err < 0)
+			break;
+		if (err > 0)
+			continue;
+
+		err = reftable_writer_add_log(wr, &log);
+		if (err < 0) {
+			break;
+		}
+		entries++;
+	}
+
+done:
+	expiry_shadow_release(&shadow);
+	reftable_iterator_destroy(&it);
+	if (mt != NULL) {
+		merged_table_release(mt);
+		reftable_merged_table_free(mt);
+	}
+	reftable_log_record_release(&log);
+	st->stats.entries_written += entries;
+	return err;
+}
+
+/* Writes table `i` without its expired logs. The ref and obj sections are
+ * copied as they are, so only the log section is decoded and re-encoded. */
+static int stack_write_expired_logs(struct reftable_stack *st,
+				    struct reftable_writer *wr, int i,
+				    struct reftable_log_expiry_config *config)
+{
+	struct reftable_reader *r = st->readers[i];
+	struct reftable_iterator it = { NULL };
+	struct reftable_log_record log = { NULL };
+	struct expiry_shadow shadow = EXPIRY_SHADOW_INIT;
+	uint64_t entries = 0;
+	int err = writer_copy_ref_sections(wr, r);
+	if (err > 0)
+		return stack_write_compact(st, wr, i, i, config);
+	if (err < 0)
+		return err;
+	st->stats.bytes += r->size;
+
+	err = expiry_shadow_init(&shadow, st, i);
+	if (err < 0)
+		goto done;
+	/* only the bottom table can skip expired entries unseen. */
+	if (i == 0 && config->time > 0)
+		err = reftable_reader_seek_log_time(r, &it, "", config->time,
+						    ~((uint64_t)0));
+	else
+		err = reftable_reader_seek_log(r, &it, "");
+	if (err < 0)
+		goto done;
+
+	while (1) {
+		err = reftable_iterator_next_log(&it, &log);
+		if (err > 0) {
+			err = 0;
+			break;
+		}
+		if (err < 0)
+			break;
+		if (i == 0 && reftable_log_record_is_deletion(&log))
+			continue;
+		err = expiry_shadow_filter(&shadow, &log, config);
+		if (err < 0)
+			break;
+		if (err > 0)
+			continue;
+
+		err = reftable_writer_add_log(wr, &log);
+		if (err < 0)
+			break;
+		entries++;
+	}
+
+done:
+	expiry_shadow_release(&shadow);
+	reftable_iterator_destroy(&it);
+	reftable_log_record_release(&log);
+	st->stats.entries_written += entries;
+	return err;
+}
+
+/* returns 1 if table `r` has logs that `config` expires, 0 if not, and < 0 on
+ * error. */
+static int reader_has_expired_logs(struct reftable_reader *r,
+				   struct reftable_log_expiry_config *config)
+{
+	struct reftable_iterator it = { NULL };
+	struct reftable_log_record log = { NULL };
+	int found = 0;
+	int err = 0;
+
+	if (!r->log_offsets.is_present)
+		return 0;
+	if (config->time > 0 && config->min_update_index == 0)
+		/* a log time index lets this skip the newer blocks. */
+		err = reftable_reader_seek_log_time(r, &it, "", 0,
+						    config->time - 1);
+	else if (config->time > 0 ||
+		 r->min_update_index < config->min_update_index)
+		err = reftable_reader_seek_log(r, &it, "");
+	else
+		return 0;
+
+	while (err == 0) {
+		err = reftable_iterator_next_log(&it, &log);
+		if (err == 0 && log_record_expired(&log, config))
+			found = 1;
+		if (found)
+			break;
+	}
+	if (err > 0)
+		err = 0;
+
+	reftable_iterator_destroy(&it);
+	reftable_log_record_release(&log);
+	return err < 0 ? err : found;
+}
+
+/* <  0: error. 0 == OK, > 0 attempt failed; could retry. */
+static int stack_compact_range(struct reftable_stack *st, int first, int last,
+			       struct reftable_log_expiry_config *expiry,
+			       int logs_only)
+{
+	struct strbuf temp_tab_file_name = STRBUF_INIT;
+	struct strbuf new_table_name = STRBUF_INIT;
+	struct strbuf lock_file_name = STRBUF_INIT;
+	struct strbuf ref_list_contents = STRBUF_INIT;
+	struct strbuf new_table_path = STRBUF_INIT;
+	int err = 0;
+	int fsync_err = 0;
 	int have_lock = 0;
 	int lock_file_fd = 0;
 	int compact_count = last - first + 1;
@@ -842,9 +1803,12 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 		reftable_calloc(sizeof(char *) * (compact_count + 1));
 	char **subtable_locks =
 		reftable_calloc(sizeof(char *) * (compact_count + 1));
+	char **names = NULL;
+	int rebase_start = 0;
 	int i = 0;
 	int j = 0;
 	int is_empty_table = 0;
+	uint64_t start_usecs = 0;
 
 	if (first > last || (expiry == NULL && first == last)) {
 		err = 0;
@@ -852,6 +1816,7 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	}
 
 	st->stats.attempts++;
+	start_usecs = now_usecs();
 
 	strbuf_reset(&lock_file_name);
 	strbuf_addstr(&lock_file_name, st->list_file);
@@ -915,7 +1880,7 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	have_lock = 0;
 
 	err = stack_compact_locked(st, first, last, &temp_tab_file_name,
-				   expiry);
+				   expiry, logs_only);
 	/* Compaction + tombstones can create an empty table out of non-empty
 	 * tables. */
 	is_empty_table = (err == REFTABLE_EMPTY_TABLE_ERROR);
@@ -925,18 +1890,49 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	if (err < 0)
 		goto done;
 
-	lock_file_fd =
-		open(lock_file_name.buf, O_EXCL | O_CREAT | O_WRONLY, 0644);
+	/* Additions only hold the lock briefly, so wait for them rather than
+	 * throwing away the merge. */
+	lock_file_fd = open_lock_with_backoff(lock_file_name.buf,
+					      COMPACTION_LOCK_TIMEOUT_MS);
 	if (lock_file_fd < 0) {
 		if (errno == EEXIST) {
 			err = 1;
 		} else {
 			err = REFTABLE_IO_ERROR;
 		}
+		if (!is_empty_table)
+			unlink(temp_tab_file_name.buf);
 		goto done;
 	}
 	have_lock = 1;
 
+	/* Tables may have been added while we didn't hold the lock, and tables
+	 * below `first` may have been compacted. Our subtable locks keep the
+	 * compacted tables in place, so splice the new table into the current
+	 * list. */
+	err = read_lines(st->list_file, &names);
+	if (err < 0) {
+		if (!is_empty_table)
+			unlink(temp_tab_file_name.buf);
+		goto done;
+	}
+	for (rebase_start = 0; names[rebase_start]; rebase_start++) {
+		if (!strcmp(names[rebase_start], st->readers[first]->name))
+			break;
+	}
+	for (i = 0; i < compact_count; i++) {
+		const char *nm = names[rebase_start + i];
+		if (nm == NULL || strcmp(nm, st->readers[first + i]->name)) {
+			err = 1;
+			break;
+		}
+	}
+	if (err != 0) {
+		if (!is_empty_table)
+			unlink(temp_tab_file_name.buf);
+		goto done;
+	}
+
 	format_name(&new_table_name, st->readers[first]->min_update_index,
 		    st->readers[last]->max_update_index);
 	strbuf_addstr(&new_table_name, ".ref");
@@ -952,18 +1948,23 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 			err = REFTABLE_IO_ERROR;
 			goto done;
 		}
+		err = stack_fsync_dir(st);
+		if (err < 0) {
+			unlink(new_table_path.buf);
+			goto done;
+		}
 	}
 
-	for (i = 0; i < first; i++) {
-		strbuf_addstr(&ref_list_contents, st->readers[i]->name);
+	for (i = 0; i < rebase_start; i++) {
+		strbuf_addstr(&ref_list_contents, names[i]);
 		strbuf_addstr(&ref_list_contents, "\n");
 	}
 	if (!is_empty_table) {
 		strbuf_addbuf(&ref_list_contents, &new_table_name);
 		strbuf_addstr(&ref_list_contents, "\n");
 	}
-	for (i = last + 1; i < st->merged->stack_len; i++) {
-		strbuf_addstr(&ref_list_contents, st->readers[i]->name);
+	for (i = rebase_start + compact_count; names[i]; i++) {
+		strbuf_addstr(&ref_list_contents, names[i]);
 		strbuf_addstr(&ref_list_contents, "\n");
 	}
 
@@ -973,6 +1974,11 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 		unlink(new_table_path.buf);
 		goto done;
 	}
+	err = stack_fsync(st, lock_file_fd);
+	if (err < 0) {
+		unlink(new_table_path.buf);
+		goto done;
+	}
 	err = close(lock_file_fd);
 	lock_file_fd = 0;
 	if (err < 0) {
@@ -989,11 +1995,21 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	}
 	have_lock = 0;
 
-	/* Reload the stack before deleting. On windows, we can only delete the
-	   files after we closed them.
+	/* The compaction is committed now, so reload even if the directory
+	 * can't be synced. On windows, we can only delete the files after we
+	 * closed them.
 	*/
+	fsync_err = stack_fsync_dir(st);
 	err = reftable_stack_reload_maybe_reuse(st, first < last);
 
+	/* Don't delete the compacted tables before the new tables.list is
+	 * durable. */
+	if (fsync_err < 0) {
+		if (err == 0)
+			err = fsync_err;
+		goto done;
+	}
+
 	listp = delete_on_success;
 	while (*listp) {
 		if (strcmp(*listp, new_table_path.buf)) {
@@ -1004,6 +2020,8 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 
 done:
 	free_names(delete_on_success);
+	if (names != NULL)
+		free_names(names);
 
 	listp = subtable_locks;
 	while (*listp) {
@@ -1023,26 +2041,70 @@ done:
 	strbuf_release(&ref_list_contents);
 	strbuf_release(&temp_tab_file_name);
 	strbuf_release(&lock_file_name);
+	if (start_usecs > 0)
+		st->stack_stats.compaction_usecs += now_usecs() - start_usecs;
 	return err;
 }
 
 int reftable_stack_compact_all(struct reftable_stack *st,
 			       struct reftable_log_expiry_config *config)
 {
-	return stack_compact_range(st, 0, st->merged->stack_len - 1, config);
+	return stack_compact_range(st, 0, st->merged->stack_len - 1, config,
+				   0);
 }
 
 static int stack_compact_range_stats(struct reftable_stack *st, int first,
 				     int last,
 				     struct reftable_log_expiry_config *config)
 {
-	int err = stack_compact_range(st, first, last, config);
+	int err = stack_compact_range(st, first, last, config, 0);
 	if (err > 0) {
 		st->stats.failures++;
 	}
 	return err;
 }
 
+int reftable_stack_expire_logs(struct reftable_stack *st,
+			       struct reftable_log_expiry_config *config)
+{
+	struct strbuf next_name = STRBUF_INIT;
+	int i = 0;
+	int err = 0;
+
+	if (config->time == 0 && config->min_update_index == 0)
+		return 0;
+
+	while (i < st->merged->stack_len) {
+		err = reader_has_expired_logs(st->readers[i], config);
+		if (err < 0)
+			break;
+		if (err == 0) {
+			i++;
+			continue;
+		}
+
+		/* the rewritten table may be dropped if it ends up empty, and
+		 * other processes may change the stack, so continue from the
+		 * next table by name. */
+		strbuf_reset(&next_name);
+		if (i + 1 < st->merged->stack_len)
+			strbuf_addstr(&next_name, st->readers[i + 1]->name);
+		err = stack_compact_range(st, i, i, config, 1);
+		if (err > 0)
+			st->stats.failures++;
+		if (err != 0 || next_name.len == 0)
+			break;
+
+		for (i = 0; i < st->merged->stack_len; i++) {
+			if (!strcmp(st->readers[i]->name, next_name.buf))
+				break;
+		}
+	}
+
+	strbuf_release(&next_name);
+	return err;
+}
+
 static int segment_size(struct segment *s)
 {
 	return s->end - s->start;
@@ -1151,15 +2213,77 @@ int reftable_stack_auto_compact(struct reftable_stack *st)
 struct reftable_compaction_stats *
 reftable_stack_compaction_stats(struct reftable_stack *st)
 {
+	compaction_worker_fold_stats(st);
 	return &st->stats;
 }
 
+const struct reftable_stack_stats *
+reftable_stack_get_stats(struct reftable_stack *st)
+{
+	compaction_worker_fold_stats(st);
+	return &st->stack_stats;
+}
+
+/* Records the stack depth, and snapshots the block counters of the readers so
+ * stack_lookup_end can attribute block reads to this lookup. */
+static void stack_lookup_begin(struct reftable_stack *st)
+{
+	size_t depth = st->readers_len;
+	int i = 0;
+
+	st->stack_stats.lookups++;
+	if (depth >= REFTABLE_STACK_DEPTH_BUCKETS)
+		depth = REFTABLE_STACK_DEPTH_BUCKETS - 1;
+	st->stack_stats.depth_histogram[depth]++;
+
+	if (st->probe_snapshot_cap < st->readers_len) {
+		st->probe_snapshot_cap = st->readers_len;
+		st->probe_snapshot = reftable_realloc(
+			st->probe_snapshot,
+			sizeof(uint64_t) * st->probe_snapshot_cap);
+	}
+	for (i = 0; i < st->readers_len; i++) {
+		struct reftable_reader *r = st->readers[i];
+		st->probe_snapshot[i] = r->blocks_read;
+		st->stack_stats.blocks_read -= r->blocks_read;
+		st->stack_stats.blocks_inflated -= r->blocks_inflated;
+	}
+}
+
+static void stack_lookup_end(struct reftable_stack *st)
+{
+	int i = 0;
+	for (i = 0; i < st->readers_len; i++) {
+		struct reftable_reader *r = st->readers[i];
+		if (r->blocks_read != st->probe_snapshot[i])
+			st->stack_stats.tables_probed++;
+		st->stack_stats.blocks_read += r->blocks_read;
+		st->stack_stats.blocks_inflated += r->blocks_inflated;
+	}
+}
+
 int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
 			    struct reftable_ref_record *ref)
 {
 	struct reftable_table tab = { NULL };
+	int err = 0;
+
 	reftable_table_from_merged_table(&tab, reftable_stack_merged_table(st));
-	return reftable_table_read_ref(&tab, refname, ref);
+	stack_lookup_begin(st);
+	err = reftable_table_read_ref(&tab, refname, ref);
+	stack_lookup_end(st);
+	return err;
+}
+
+int reftable_stack_refs_for(struct reftable_stack *st,
+			    struct reftable_iterator *it, uint8_t *oid)
+{
+	int err = 0;
+	stack_lookup_begin(st);
+	err = reftable_merged_table_refs_for(reftable_stack_merged_table(st),
+					     it, oid);
+	stack_lookup_end(st);
+	return err;
 }
 
 int reftable_stack_read_log(struct reftable_stack *st, const char *refname,
@@ -1167,7 +2291,10 @@ int reftable_stack_read_log(struct reftable_stack *st, const char *refname,
 {
 	struct reftable_iterator it = { NULL };
 	struct reftable_merged_table *mt = reftable_stack_merged_table(st);
-	int err = reftable_merged_table_seek_log(mt, &it, refname);
+	int err = 0;
+
+	stack_lookup_begin(st);
+	err = reftable_merged_table_seek_log(mt, &it, refname);
 	if (err)
 		goto done;
 
@@ -1186,6 +2313,7 @@ done:
 		reftable_log_record_release(log);
 	}
 	reftable_iterator_destroy(&it);
+	stack_lookup_end(st);
 	return err;
 }
 
@@ -1252,3 +2380,649 @@ done:
 	reftable_reader_free(rd);
 	return err;
 }
+
+/* like stack_check_addition, for a table just written by a writer that
+ * recorded the names. */
+static int stack_check_written_names(struct reftable_stack *st,
+				     struct writer_names *names)
+{
+	struct modification mod = { { NULL } };
+	size_t i = 0;
+	int err = 0;
+
+	if (st->config.skip_name_check)
+		return 0;
+
+	reftable_table_from_merged_table(&mod.tab,
+					 reftable_stack_merged_table(st));
+	mod.add = reftable_calloc(sizeof(char *) * (names->add_len + 1));
+	mod.del = reftable_calloc(sizeof(char *) * (names->del_len + 1));
+	for (i = 0; i < names->add_len; i++)
+		mod.add[mod.add_len++] = names->buf.buf + names->add[i];
+	for (i = 0; i < names->del_len; i++)
+		mod.del[mod.del_len++] = names->buf.buf + names->del[i];
+
+	err = modification_validate_batch(&mod);
+	reftable_free(mod.add);
+	reftable_free(mod.del);
+	return err;
+}
+
+/* CPU time the worker may use before it pauses to honor max_cpu_percent. */
+#define COMPACTION_WORKER_SLICE_USECS 10000
+#define COMPACTION_WORKER_MAX_BACKOFF_MS 1000
+
+struct compaction_worker {
+	struct reftable_compaction_worker_options opts;
+	pthread_t thread;
+
+	/* protects everything below, up to the throttling state. */
+	pthread_mutex_t mu;
+	pthread_cond_t cond;
+	int pending;
+	int stop;
+
+	/* compaction statistics not yet folded into the owning stack. */
+	struct reftable_compaction_stats stats;
+	uint64_t compaction_bytes;
+	uint64_t compaction_usecs;
+
+	/* Private stack on the same directory. It is only used by the worker
+	 * thread; the file locks arbitrate with the owning stack. */
+	struct reftable_stack *stack;
+
+	/* throttling state for the table being written. */
+	struct fd_sink *sink;
+	uint64_t window_start_usecs;
+	uint64_t window_bytes;
+	/* CPU time of the worker thread when it last resumed. */
+	uint64_t cpu_start_usecs;
+};
+
+/* Sleeps for the given time, or until the worker is stopped. */
+static void compaction_worker_sleep(struct compaction_worker *w,
+				    uint64_t usecs)
+{
+	struct timespec deadline = { 0 };
+	uint64_t nsecs = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	nsecs = deadline.tv_nsec + (usecs % 1000000) * 1000;
+	deadline.tv_sec += usecs / 1000000 + nsecs / 1000000000;
+	deadline.tv_nsec = nsecs % 1000000000;
+
+	pthread_mutex_lock(&w->mu);
+	while (!w->stop) {
+		if (pthread_cond_timedwait(&w->cond, &w->mu, &deadline) ==
+		    ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&w->mu);
+}
+
+static void compaction_worker_begin_write(struct compaction_worker *w,
+					  struct fd_sink *sink)
+{
+	w->sink = sink;
+	w->window_start_usecs = now_usecs();
+	w->cpu_start_usecs = thread_cpu_usecs();
+	w->window_bytes = 0;
+}
+
+static int compaction_worker_write(void *arg, const void *data, size_t sz)
+{
+	struct compaction_worker *w = arg;
+	int n = reftable_fd_write(w->sink, data, sz);
+	uint64_t now = 0;
+	uint64_t wait = 0;
+	int pct = w->opts.max_cpu_percent;
+
+	if (n <= 0)
+		return n;
+
+	now = now_usecs();
+	w->window_bytes += n;
+	if (w->opts.max_bytes_per_second > 0) {
+		uint64_t due = w->window_start_usecs +
+			       w->window_bytes * 1000000 /
+				       w->opts.max_bytes_per_second;
+		if (due > now)
+			wait = due - now;
+	}
+	if (pct > 0 && pct < 100) {
+		/* time spent waiting on the disk or on locks doesn't count. */
+		uint64_t busy = thread_cpu_usecs() - w->cpu_start_usecs;
+		if (busy >= COMPACTION_WORKER_SLICE_USECS &&
+		    busy * (100 - pct) / pct > wait)
+			wait = busy * (100 - pct) / pct;
+	}
+
+	if (wait > 0) {
+		compaction_worker_sleep(w, wait);
+		w->cpu_start_usecs = thread_cpu_usecs();
+	}
+	return n;
+}
+
+/* Moves the statistics of the private stack into the worker. Called with
+ * w->mu held. */
+static void compaction_worker_collect_stats(struct compaction_worker *w)
+{
+	struct reftable_stack *wst = w->stack;
+	struct reftable_compaction_stats empty = { 0 };
+
+	w->stats.bytes += wst->stats.bytes;
+	w->stats.entries_written += wst->stats.entries_written;
+	w->stats.attempts += wst->stats.attempts;
+	w->stats.failures += wst->stats.failures;
+	wst->stats = empty;
+
+	w->compaction_bytes += wst->stack_stats.compaction_bytes;
+	w->compaction_usecs += wst->stack_stats.compaction_usecs;
+	wst->stack_stats.compaction_bytes = 0;
+	wst->stack_stats.compaction_usecs = 0;
+}
+
+static void compaction_worker_fold_stats(struct reftable_stack *st)
+{
+	struct compaction_worker *w = st->worker;
+	struct reftable_compaction_stats empty = { 0 };
+	if (w == NULL)
+		return;
+
+	pthread_mutex_lock(&w->mu);
+	st->stats.bytes += w->stats.bytes;
+	st->stats.entries_written += w->stats.entries_written;
+	st->stats.attempts += w->stats.attempts;
+	st->stats.failures += w->stats.failures;
+	w->stats = empty;
+
+	st->stack_stats.compaction_bytes += w->compaction_bytes;
+	st->stack_stats.compaction_usecs += w->compaction_usecs;
+	w->compaction_bytes = 0;
+	w->compaction_usecs = 0;
+	pthread_mutex_unlock(&w->mu);
+}
+
+static void compaction_worker_trigger(struct compaction_worker *w)
+{
+	pthread_mutex_lock(&w->mu);
+	w->pending = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mu);
+}
+
+static void *compaction_worker_run(void *arg)
+{
+	struct compaction_worker *w = arg;
+	int backoff_ms = 0;
+	int compacted = 0;
+	int err = 0;
+
+	pthread_mutex_lock(&w->mu);
+	while (1) {
+		while (!w->pending && !w->stop)
+			pthread_cond_wait(&w->cond, &w->mu);
+		if (w->stop)
+			break;
+		w->pending = 0;
+		pthread_mutex_unlock(&w->mu);
+
+		err = reftable_stack_reload(w->stack);
+		if (err == 0)
+			err = reftable_stack_auto_compact(w->stack);
+		compacted = w->stack->stats.attempts > 0;
+
+		pthread_mutex_lock(&w->mu);
+		compaction_worker_collect_stats(w);
+		if (err > 0) {
+			/* Lost a race with an addition. Back off, so the
+			 * foreground can proceed, and try again. */
+			w->pending = 1;
+			backoff_ms = backoff_ms ? 2 * backoff_ms : 1;
+			if (backoff_ms > COMPACTION_WORKER_MAX_BACKOFF_MS)
+				backoff_ms = COMPACTION_WORKER_MAX_BACKOFF_MS;
+			pthread_mutex_unlock(&w->mu);
+			compaction_worker_sleep(w, backoff_ms * 1000);
+			pthread_mutex_lock(&w->mu);
+		} else {
+			backoff_ms = 0;
+			/* a compaction may leave other segments to compact. */
+			if (err == 0 && compacted)
+				w->pending = 1;
+		}
+	}
+	pthread_mutex_unlock(&w->mu);
+	return NULL;
+}
+
+int reftable_stack_start_compaction_worker(
+	struct reftable_stack *st,
+	const struct reftable_compaction_worker_options *opts)
+{
+	struct compaction_worker *w = NULL;
+	int err = 0;
+
+	if (st->worker != NULL || st->throttle != NULL)
+		return REFTABLE_API_ERROR;
+
+	w = reftable_calloc(sizeof(struct compaction_worker));
+	if (opts != NULL)
+		w->opts = *opts;
+
+	err = reftable_new_stack(&w->stack, st->reftable_dir, st->config);
+	if (err < 0) {
+		reftable_free(w);
+		return err;
+	}
+	w->stack->throttle = w;
+
+	pthread_mutex_init(&w->mu, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, compaction_worker_run, w)) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mu);
+		reftable_stack_destroy(w->stack);
+		reftable_free(w);
+		return REFTABLE_IO_ERROR;
+	}
+
+	st->worker = w;
+	return 0;
+}
+
+void reftable_stack_stop_compaction_worker(struct reftable_stack *st)
+{
+	struct compaction_worker *w = st->worker;
+	if (w == NULL)
+		return;
+
+	pthread_mutex_lock(&w->mu);
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mu);
+	pthread_join(w->thread, NULL);
+
+	compaction_worker_fold_stats(st);
+	st->worker = NULL;
+
+	reftable_stack_destroy(w->stack);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mu);
+	reftable_free(w);
+}
+
+struct group_commit_member {
+	struct reftable_ref_record *refs;
+	size_t refs_len;
+	struct reftable_log_record *logs;
+	size_t logs_len;
+
+	int done;
+	int err;
+	struct group_commit_member *next;
+};
+
+struct group_commit {
+	pthread_mutex_t mu;
+	pthread_cond_t cond;
+
+	/* members waiting to be committed, in arrival order. */
+	struct group_commit_member *head;
+	struct group_commit_member *tail;
+
+	/* whether a thread is committing a group. */
+	int leader_active;
+};
+
+static struct group_commit *group_commit_new(void)
+{
+	struct group_commit *g = reftable_calloc(sizeof(struct group_commit));
+	pthread_mutex_init(&g->mu, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	return g;
+}
+
+static void group_commit_free(struct group_commit *g)
+{
+	if (g == NULL)
+		return;
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->mu);
+	reftable_free(g);
+}
+
+struct group_commit_write_arg {
+	struct reftable_ref_record *refs;
+	size_t refs_len;
+	struct reftable_log_record *logs;
+	size_t logs_len;
+	uint64_t update_index;
+};
+
+static int group_commit_write_table(struct reftable_writer *wr, void *arg)
+{
+	struct group_commit_write_arg *wa = arg;
+	int err = 0;
+	size_t i = 0;
+
+	reftable_writer_set_limits(wr, wa->update_index, wa->update_index);
+	for (i = 0; i < wa->refs_len; i++)
+		wa->refs[i].update_index = wa->update_index;
+	for (i = 0; i < wa->logs_len; i++)
+		wa->logs[i].update_index = wa->update_index;
+
+	err = reftable_writer_add_refs(wr, wa->refs, wa->refs_len);
+	if (err < 0)
+		return err;
+	return reftable_writer_add_logs(wr, wa->logs, wa->logs_len);
+}
+
+static int group_commit_add(struct reftable_stack *st,
+			    struct group_commit_write_arg *wa)
+{
+	struct reftable_addition *add = NULL;
+	int err = reftable_stack_new_addition(&add, st);
+	if (err > 0)
+		err = REFTABLE_LOCK_ERROR;
+	if (err < 0)
+		goto done;
+
+	wa->update_index = add->next_update_index;
+	err = reftable_addition_add(add, &group_commit_write_table, wa);
+	if (err < 0)
+		goto done;
+
+	err = reftable_addition_commit(add);
+done:
+	reftable_addition_destroy(add);
+	if (err == REFTABLE_LOCK_ERROR)
+		reftable_stack_reload(st);
+	return err;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+struct find_name_arg {
+	char **names;
+	const char *want;
+};
+
+static int find_name(size_t k, void *arg)
+{
+	struct find_name_arg *f_arg = arg;
+	return strcmp(f_arg->names[k], f_arg->want) >= 0;
+}
+
+static int names_contain(char **names, size_t len, const char *want)
+{
+	struct find_name_arg arg = {
+		.names = names,
+		.want = want,
+	};
+	size_t idx = 0;
+	if (len == 0)
+		return 0;
+	idx = binsearch(len, &find_name, &arg);
+	return idx < len && !strcmp(names[idx], want);
+}
+
+/* Returns the ref names touched by `m`, sorted. Returns REFTABLE_API_ERROR if
+ * a ref or a log appears twice, since they would get the same key. */
+static int group_commit_member_names(struct group_commit_member *m,
+				     char ***namesp, size_t *lenp)
+{
+	char **names = reftable_calloc(sizeof(char *) *
+				       (m->refs_len + m->logs_len + 1));
+	size_t len = 0;
+	size_t refs_end = 0;
+	size_t i = 0;
+	int err = 0;
+
+	for (i = 0; i < m->refs_len; i++)
+		names[len++] = m->refs[i].refname;
+	refs_end = len;
+	for (i = 0; i < m->logs_len; i++)
+		names[len++] = m->logs[i].refname;
+
+	for (i = 0; i < len; i++) {
+		if (names[i] == NULL) {
+			err = REFTABLE_API_ERROR;
+			goto done;
+		}
+	}
+
+	qsort(names, refs_end, sizeof(char *), &name_cmp);
+	qsort(names + refs_end, len - refs_end, sizeof(char *), &name_cmp);
+	for (i = 1; i < len; i++) {
+		if (i != refs_end && !strcmp(names[i - 1], names[i])) {
+			err = REFTABLE_API_ERROR;
+			goto done;
+		}
+	}
+	qsort(names, len, sizeof(char *), &name_cmp);
+
+done:
+	if (err < 0) {
+		reftable_free(names);
+		names = NULL;
+		len = 0;
+	}
+	*namesp = names;
+	*lenp = len;
+	return err;
+}
+
+/* Checks the refs of a single member against the stack. */
+static int group_commit_member_validate(struct reftable_stack *st,
+					struct group_commit_member *m)
+{
+	struct reftable_ref_record *refs = NULL;
+	struct reftable_table tab = { NULL };
+	int err = 0;
+
+	if (st->config.skip_name_check || m->refs_len == 0)
+		return 0;
+
+	refs = reftable_calloc(sizeof(*refs) * m->refs_len);
+	memcpy(refs, m->refs, sizeof(*refs) * m->refs_len);
+	QSORT(refs, m->refs_len, reftable_ref_record_compare_name);
+
+	reftable_table_from_merged_table(&tab, reftable_stack_merged_table(st));
+	err = validate_ref_record_addition(tab, refs, m->refs_len);
+	reftable_free(refs);
+	return err;
+}
+
+/* Commits the members of `batch` that don't touch the same ref names as an
+ * earlier member in one table. Members that got their result are returned in
+ * `finished`. Returns the remaining members, which should be committed in a
+ * next group. */
+static struct group_commit_member *
+group_commit_run(struct reftable_stack *st, struct group_commit_member *batch,
+		 struct group_commit_member **finished)
+{
+	struct group_commit_member **finished_tail = finished;
+	struct group_commit_member *deferred = NULL;
+	struct group_commit_member **deferred_tail = &deferred;
+	struct group_commit_member *admitted = NULL;
+	struct group_commit_member **admitted_tail = &admitted;
+	struct group_commit_write_arg wa = { NULL };
+	struct group_commit_member *m = NULL;
+	char **group_names = NULL;
+	size_t group_names_len = 0;
+	int err = reftable_stack_reload(st);
+
+	while (batch != NULL) {
+		char **names = NULL;
+		size_t names_len = 0;
+		size_t i = 0;
+
+		m = batch;
+		batch = m->next;
+		m->next = NULL;
+
+		if (err < 0) {
+			m->err = err;
+			*finished_tail = m;
+			finished_tail = &m->next;
+			continue;
+		}
+
+		m->err = group_commit_member_names(m, &names, &names_len);
+		if (m->err < 0) {
+			*finished_tail = m;
+			finished_tail = &m->next;
+			continue;
+		}
+
+		for (i = 0; i < names_len; i++) {
+			if (names_contain(group_names, group_names_len,
+					  names[i]))
+				break;
+		}
+		if (i < names_len) {
+			*deferred_tail = m;
+			deferred_tail = &m->next;
+			reftable_free(names);
+			continue;
+		}
+
+		m->err = group_commit_member_validate(st, m);
+		if (m->err < 0) {
+			*finished_tail = m;
+			finished_tail = &m->next;
+			reftable_free(names);
+			continue;
+		}
+
+		group_names = reftable_realloc(
+			group_names,
+			sizeof(char *) * (group_names_len + names_len));
+		memcpy(group_names + group_names_len, names,
+		       sizeof(char *) * names_len);
+		group_names_len += names_len;
+		QSORT(group_names, group_names_len, name_cmp);
+		reftable_free(names);
+
+		wa.refs = reftable_realloc(wa.refs, sizeof(*wa.refs) *
+							    (wa.refs_len +
+							     m->refs_len));
+		memcpy(wa.refs + wa.refs_len, m->refs,
+		       sizeof(*wa.refs) * m->refs_len);
+		wa.refs_len += m->refs_len;
+		wa.logs = reftable_realloc(wa.logs, sizeof(*wa.logs) *
+							    (wa.logs_len +
+							     m->logs_len));
+		memcpy(wa.logs + wa.logs_len, m->logs,
+		       sizeof(*wa.logs) * m->logs_len);
+		wa.logs_len += m->logs_len;
+
+		*admitted_tail = m;
+		admitted_tail = &m->next;
+	}
+
+	if (admitted != NULL) {
+		err = group_commit_add(st, &wa);
+		if (err == REFTABLE_NAME_CONFLICT && admitted->next != NULL) {
+			/* The members conflict with each other. Fall back to
+			 * committing them one by one. */
+			for (m = admitted; m != NULL; m = m->next) {
+				struct group_commit_write_arg single = {
+					.refs = wa.refs,
+					.refs_len = m->refs_len,
+					.logs = wa.logs,
+					.logs_len = m->logs_len,
+				};
+				memcpy(wa.refs, m->refs,
+				       sizeof(*wa.refs) * m->refs_len);
+				memcpy(wa.logs, m->logs,
+				       sizeof(*wa.logs) * m->logs_len);
+				m->err = group_commit_add(st, &single);
+			}
+		} else {
+			for (m = admitted; m != NULL; m = m->next)
+				m->err = err;
+		}
+
+		*finished_tail = admitted;
+		if (st->worker == NULL && !st->disable_auto_compact)
+			reftable_stack_auto_compact(st);
+	}
+
+	reftable_free(group_names);
+	reftable_free(wa.refs);
+	reftable_free(wa.logs);
+	return deferred;
+}
+
+int reftable_stack_group_add(struct reftable_stack *st,
+			     struct reftable_ref_record *refs, size_t refs_len,
+			     struct reftable_log_record *logs, size_t logs_len)
+{
+	struct group_commit *g = st->group;
+	struct group_commit_member self = {
+		.refs = refs,
+		.refs_len = refs_len,
+		.logs = logs,
+		.logs_len = logs_len,
+	};
+
+	if (refs_len == 0 && logs_len == 0)
+		return 0;
+
+	pthread_mutex_lock(&g->mu);
+	if (g->tail != NULL)
+		g->tail->next = &self;
+	else
+		g->head = &self;
+	g->tail = &self;
+
+	while (!self.done) {
+		struct group_commit_member *batch = NULL;
+		struct group_commit_member *finished = NULL;
+		struct group_commit_member *deferred = NULL;
+
+		if (g->leader_active) {
+			pthread_cond_wait(&g->cond, &g->mu);
+			continue;
+		}
+
+		g->leader_active = 1;
+		if (st->config.group_commit_window_ms > 0) {
+			pthread_mutex_unlock(&g->mu);
+			sleep_millisec(st->config.group_commit_window_ms);
+			pthread_mutex_lock(&g->mu);
+		}
+		batch = g->head;
+		g->head = g->tail = NULL;
+		pthread_mutex_unlock(&g->mu);
+
+		deferred = group_commit_run(st, batch, &finished);
+
+		pthread_mutex_lock(&g->mu);
+		while (finished != NULL) {
+			/* once done, the member may go away. */
+			struct group_commit_member *next = finished->next;
+			finished->done = 1;
+			finished = next;
+		}
+		if (deferred != NULL) {
+			struct group_commit_member *last = deferred;
+			while (last->next != NULL)
+				last = last->next;
+			last->next = g->head;
+			if (g->head == NULL)
+				g->tail = last;
+			g->head = deferred;
+		}
+		g->leader_active = 0;
+		pthread_cond_broadcast(&g->cond);
+	}
+	pthread_mutex_unlock(&g->mu);
+
+	return self.err;
+}
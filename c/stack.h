@@ -13,6 +13,9 @@ https://developers.google.com/open-source/licenses/bsd
 #include "reftable-writer.h"
 #include "reftable-stack.h"
 
+struct compaction_worker;
+struct group_commit;
+
 struct reftable_stack {
 	char *list_file;
 	char *reftable_dir;
@@ -24,6 +27,25 @@ struct reftable_stack {
 	size_t readers_len;
 	struct reftable_merged_table *merged;
 	struct reftable_compaction_stats stats;
+	struct reftable_stack_stats stack_stats;
+
+	/* per-reader block counts at the start of the current lookup. */
+	uint64_t *probe_snapshot;
+	size_t probe_snapshot_cap;
+
+	/* writer kept between additions, so small transactions don't pay for
+	 * allocating its buffers. */
+	struct reftable_writer *writer;
+
+	/* queue of reftable_stack_group_add callers. */
+	struct group_commit *group;
+
+	/* background worker compacting this stack, if any. */
+	struct compaction_worker *worker;
+
+	/* for the worker's private stack: the worker whose limits apply to
+	 * compaction writes. */
+	struct compaction_worker *throttle;
 };
 
 int read_lines(const char *filename, char ***lines);
@@ -13,12 +13,15 @@ https://developers.google.com/open-source/licenses/bsd
 #include "merged.h"
 #include "basics.h"
 #include "constants.h"
+#include "reader.h"
 #include "record.h"
+#include "reftable-merged.h"
 #include "test_framework.h"
 #include "reftable-tests.h"
 
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 
 static void clear_dir(const char *dirname)
 {
@@ -137,6 +140,177 @@ static void test_reftable_stack_add_one(void)
 	clear_dir(dir);
 }
 
+/* adds the ref, and then fails the transaction. */
+static int write_test_ref_fail(struct reftable_writer *wr, void *arg)
+{
+	int err = write_test_ref(wr, arg);
+	return err < 0 ? err : REFTABLE_API_ERROR;
+}
+
+static void test_reftable_stack_writer_reuse(void)
+{
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	struct reftable_writer *cached = NULL;
+	int err;
+	struct reftable_ref_record ref1 = {
+		.refname = "HEAD",
+		.update_index = 1,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	struct reftable_ref_record failed = {
+		.refname = "refs/heads/failed",
+		.update_index = 2,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	struct reftable_ref_record ref2 = {
+		.refname = "refs/heads/next",
+		.update_index = 2,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "HEAD",
+	};
+	struct reftable_ref_record dest = { NULL };
+
+	EXPECT(mkdtemp(dir));
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_add(st, &write_test_ref, &ref1);
+	EXPECT_ERR(err);
+	cached = st->writer;
+	EXPECT(cached != NULL);
+
+	err = reftable_stack_add(st, &write_test_ref_fail, &failed);
+	EXPECT(err == REFTABLE_API_ERROR);
+	EXPECT(st->writer == cached);
+
+	/* the aborted table leaves nothing behind in the writer. */
+	err = reftable_stack_add(st, &write_test_ref, &ref2);
+	EXPECT_ERR(err);
+	EXPECT(st->writer == cached);
+	EXPECT(st->merged->stack_len == 2);
+
+	err = reftable_stack_read_ref(st, failed.refname, &dest);
+	EXPECT(err == 1);
+	err = reftable_stack_read_ref(st, ref2.refname, &dest);
+	EXPECT_ERR(err);
+	EXPECT(0 == strcmp("HEAD", dest.value.symref));
+	err = reftable_stack_read_ref(st, ref1.refname, &dest);
+	EXPECT_ERR(err);
+	EXPECT(0 == strcmp("master", dest.value.symref));
+
+	reftable_ref_record_release(&dest);
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+struct refs_for_table_arg {
+	uint64_t update_index;
+	int round;
+};
+
+/* each round rewrites a different subset of refs, pointing them to one of
+ * a few objects, or deleting them. */
+static int write_refs_for_table(struct reftable_writer *wr, void *arg)
+{
+	struct refs_for_table_arg *a = arg;
+	int i = 0;
+	reftable_writer_set_limits(wr, a->update_index, a->update_index);
+	for (i = a->round % 3; i < 1000; i += 1 + 3 * (a->round % 4)) {
+		uint8_t hash[SHA1_SIZE];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = a->update_index,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		int err = 0;
+		snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+		set_test_hash(hash, (i + a->round) % 5);
+		if ((i + a->round) % 7 == 0)
+			ref.value_type = REFTABLE_REF_DELETION;
+		err = reftable_writer_add_ref(wr, &ref);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+static void test_reftable_stack_refs_for(void)
+{
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	int round = 0;
+	int oid = 0;
+	int err;
+
+	EXPECT(mkdtemp(dir));
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (round = 0; round < 12; round++) {
+		struct refs_for_table_arg arg = {
+			.update_index = reftable_stack_next_update_index(st),
+			.round = round,
+		};
+		err = reftable_stack_add(st, &write_refs_for_table, &arg);
+		EXPECT_ERR(err);
+	}
+	EXPECT(st->merged->stack_len == 12);
+	/* both indexed and unindexed tables are searched. */
+	EXPECT(st->readers[0]->obj_offsets.is_present);
+	EXPECT(!st->readers[3]->obj_offsets.is_present);
+
+	for (oid = 0; oid < 5; oid++) {
+		uint8_t hash[SHA1_SIZE];
+		struct reftable_iterator it = { NULL };
+		struct reftable_iterator all = { NULL };
+		struct reftable_ref_record ref = { NULL };
+		struct reftable_ref_record want = { NULL };
+		int n = 0;
+
+		set_test_hash(hash, oid);
+		err = reftable_stack_refs_for(st, &it, hash);
+		EXPECT_ERR(err);
+		err = reftable_merged_table_seek_ref(st->merged, &all, "");
+		EXPECT_ERR(err);
+
+		/* must match a scan of the merged view. */
+		while (1) {
+			err = reftable_iterator_next_ref(&all, &want);
+			if (err > 0)
+				break;
+			EXPECT_ERR(err);
+			if (memcmp(reftable_ref_record_val1(&want), hash,
+				   SHA1_SIZE))
+				continue;
+
+			err = reftable_iterator_next_ref(&it, &ref);
+			EXPECT_ERR(err);
+			EXPECT(reftable_ref_record_equal(&ref, &want,
+							 SHA1_SIZE));
+			n++;
+		}
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT(err == 1);
+		EXPECT(n > 0);
+
+		reftable_ref_record_release(&ref);
+		reftable_ref_record_release(&want);
+		reftable_iterator_destroy(&it);
+		reftable_iterator_destroy(&all);
+	}
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
 static void test_reftable_stack_uptodate(void)
 {
 	struct reftable_write_options cfg = { 0 };
@@ -228,6 +402,120 @@ static void test_reftable_stack_transaction_api(void)
 	clear_dir(dir);
 }
 
+static void test_reftable_stack_optimistic_addition(void)
+{
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st1 = NULL;
+	struct reftable_stack *st2 = NULL;
+	struct reftable_addition *add1 = NULL;
+	struct reftable_addition *add2 = NULL;
+	struct stat stat_result;
+	int err;
+	struct reftable_ref_record ref1 = {
+		.refname = "a/b",
+		.update_index = 1,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	struct reftable_ref_record ref2 = {
+		.refname = "c",
+		.update_index = 2,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	struct reftable_ref_record ref3 = {
+		.refname = "a",
+		.update_index = 3,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	struct reftable_ref_record dest = { NULL };
+	struct strbuf lock_name = STRBUF_INIT;
+
+	EXPECT(mkdtemp(dir));
+	strbuf_addstr(&lock_name, dir);
+	strbuf_addstr(&lock_name, "/tables.list.lock");
+
+	err = reftable_new_stack(&st1, dir, cfg);
+	EXPECT_ERR(err);
+	err = reftable_new_stack(&st2, dir, cfg);
+	EXPECT_ERR(err);
+
+	/* both writers build their tables without holding the lock. */
+	err = reftable_stack_new_optimistic_addition(&add1, st1);
+	EXPECT_ERR(err);
+	err = reftable_stack_new_optimistic_addition(&add2, st2);
+	EXPECT_ERR(err);
+
+	err = reftable_addition_add(add1, &write_test_ref, &ref1);
+	EXPECT_ERR(err);
+	err = reftable_addition_add(add2, &write_test_ref, &ref2);
+	EXPECT_ERR(err);
+	EXPECT(stat(lock_name.buf, &stat_result) < 0);
+
+	/* the second commit rebases on top of the first one. */
+	err = reftable_addition_commit(add1);
+	EXPECT_ERR(err);
+	err = reftable_addition_commit(add2);
+	EXPECT_ERR(err);
+	reftable_addition_destroy(add1);
+	reftable_addition_destroy(add2);
+	EXPECT(st2->merged->stack_len == 2);
+
+	err = reftable_stack_read_ref(st2, "a/b", &dest);
+	EXPECT_ERR(err);
+	err = reftable_stack_read_ref(st2, "c", &dest);
+	EXPECT_ERR(err);
+
+	/* conflicting update_index. */
+	err = reftable_stack_new_optimistic_addition(&add1, st1);
+	EXPECT_ERR(err);
+	err = reftable_stack_new_optimistic_addition(&add2, st2);
+	EXPECT_ERR(err);
+	ref1.update_index = 3;
+	ref2.update_index = 3;
+	err = reftable_addition_add(add1, &write_test_ref, &ref1);
+	EXPECT_ERR(err);
+	err = reftable_addition_add(add2, &write_test_ref, &ref2);
+	EXPECT_ERR(err);
+	err = reftable_addition_commit(add1);
+	EXPECT_ERR(err);
+	err = reftable_addition_commit(add2);
+	EXPECT(err == REFTABLE_LOCK_ERROR);
+	reftable_addition_destroy(add1);
+	reftable_addition_destroy(add2);
+
+	/* "x" conflicts with "x/y", which is added after the snapshot. */
+	err = reftable_stack_new_optimistic_addition(&add2, st2);
+	EXPECT_ERR(err);
+	ref3.refname = "x";
+	ref3.update_index = 5;
+	err = reftable_addition_add(add2, &write_test_ref, &ref3);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_reload(st1);
+	EXPECT_ERR(err);
+	ref1.refname = "x/y";
+	ref1.update_index = 4;
+	err = reftable_stack_add(st1, &write_test_ref, &ref1);
+	EXPECT_ERR(err);
+
+	err = reftable_addition_commit(add2);
+	EXPECT(err == REFTABLE_LOCK_ERROR);
+	reftable_addition_destroy(add2);
+	EXPECT(stat(lock_name.buf, &stat_result) < 0);
+
+	err = reftable_stack_read_ref(st2, "x", &dest);
+	EXPECT(err == 1);
+
+	reftable_ref_record_release(&dest);
+	strbuf_release(&lock_name);
+	reftable_stack_destroy(st1);
+	reftable_stack_destroy(st2);
+	clear_dir(dir);
+}
+
 static void test_reftable_stack_validate_refname(void)
 {
 	struct reftable_write_options cfg = { 0 };
@@ -266,6 +554,87 @@ static void test_reftable_stack_validate_refname(void)
 	clear_dir(dir);
 }
 
+struct write_refs_arg {
+	struct reftable_ref_record *refs;
+	int n;
+};
+
+static int write_test_refs(struct reftable_writer *wr, void *arg)
+{
+	struct write_refs_arg *wra = arg;
+	reftable_writer_set_limits(wr, wra->refs[0].update_index,
+				   wra->refs[0].update_index);
+	return reftable_writer_add_refs(wr, wra->refs, wra->n);
+}
+
+static void test_reftable_stack_validate_refname_deletion(void)
+{
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	int err;
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_ref_record ref = {
+		.refname = "a/b",
+		.update_index = 1,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	/* "a" only conflicts with "a/b" if the latter isn't deleted in the
+	 * same table. */
+	struct reftable_ref_record conflict[] = {
+		{
+			.refname = "a",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		},
+		{
+			.refname = "a/c",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_DELETION,
+		},
+	};
+	struct reftable_ref_record replace[] = {
+		{
+			.refname = "a",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		},
+		{
+			.refname = "a/b",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_DELETION,
+		},
+	};
+	struct write_refs_arg arg = { conflict, ARRAY_SIZE(conflict) };
+	struct reftable_ref_record dest = { NULL };
+
+	EXPECT(mkdtemp(dir));
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_add(st, &write_test_ref, &ref);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_add(st, &write_test_refs, &arg);
+	EXPECT(err == REFTABLE_NAME_CONFLICT);
+
+	arg.refs = replace;
+	arg.n = ARRAY_SIZE(replace);
+	err = reftable_stack_add(st, &write_test_refs, &arg);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_read_ref(st, "a", &dest);
+	EXPECT_ERR(err);
+	err = reftable_stack_read_ref(st, "a/b", &dest);
+	EXPECT(err == 1);
+
+	reftable_ref_record_release(&dest);
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
 static int write_error(struct reftable_writer *wr, void *arg)
 {
 	return *((int *)arg);
@@ -640,10 +1009,14 @@ static void test_suggest_compaction_segment_nothing(void)
 	EXPECT(result.start == result.end);
 }
 
-static void test_reflog_expire(void)
+static void test_reflog_expire_opts(int log_time_index)
 {
 	char *dir = get_tmp_template(__FUNCTION__);
-	struct reftable_write_options cfg = { 0 };
+	/* small blocks, so the compacted tables have a log index. */
+	struct reftable_write_options cfg = {
+		.block_size = log_time_index ? 256 : 0,
+		.log_time_index = log_time_index,
+	};
 	struct reftable_stack *st = NULL;
 	struct reftable_log_record logs[20] = { { NULL } };
 	int N = ARRAY_SIZE(logs) - 1;
@@ -682,6 +1055,8 @@ static void test_reflog_expire(void)
 
 	err = reftable_stack_compact_all(st, NULL);
 	EXPECT_ERR(err);
+	if (log_time_index)
+		EXPECT(st->readers[0]->log_offsets.index_offset > 0);
 
 	err = reftable_stack_compact_all(st, &expiry);
 	EXPECT_ERR(err);
@@ -702,6 +1077,17 @@ static void test_reflog_expire(void)
 	err = reftable_stack_read_log(st, logs[16].refname, &log);
 	EXPECT_ERR(err);
 
+	/* a table without refs is rewritten completely. */
+	expiry.min_update_index = 17;
+	err = reftable_stack_expire_logs(st, &expiry);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_read_log(st, logs[16].refname, &log);
+	EXPECT(err == 1);
+
+	err = reftable_stack_read_log(st, logs[18].refname, &log);
+	EXPECT_ERR(err);
+
 	/* cleanup */
 	reftable_stack_destroy(st);
 	for (i = 0; i <= N; i++) {
@@ -711,43 +1097,441 @@ static void test_reflog_expire(void)
 	reftable_log_record_release(&log);
 }
 
-static int write_nothing(struct reftable_writer *wr, void *arg)
+static void test_reflog_expire(void)
 {
-	reftable_writer_set_limits(wr, 1, 1);
-	return 0;
+	test_reflog_expire_opts(0);
 }
 
-static void test_empty_add(void)
+static void test_reflog_expire_log_time_index(void)
 {
-	struct reftable_write_options cfg = { 0 };
+	test_reflog_expire_opts(1);
+}
+
+struct write_refs_logs_arg {
+	struct reftable_ref_record *refs;
+	struct reftable_log_record *logs;
+	int n;
+};
+
+static int write_test_refs_logs(struct reftable_writer *wr, void *arg)
+{
+	struct write_refs_logs_arg *arg_ = arg;
+	int err = 0;
+	reftable_writer_set_limits(wr, arg_->refs[0].update_index,
+				   arg_->refs[0].update_index);
+	err = reftable_writer_add_refs(wr, arg_->refs, arg_->n);
+	if (err < 0)
+		return err;
+	return reftable_writer_add_logs(wr, arg_->logs, arg_->n);
+}
+
+/* how test_reflog_expire_shadowed_opts expires logs. */
+enum {
+	EXPIRE_BY_COMPACTING,
+	EXPIRE_LOGS,
+	/* tables with refs, whose ref sections are copied. */
+	EXPIRE_LOGS_WITH_REFS,
+};
+
+static void test_reflog_expire_shadowed_opts(int mode)
+{
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_write_options cfg = {
+		.log_time_index = 1,
+	};
 	struct reftable_stack *st = NULL;
+	uint8_t hash[SHA1_SIZE] = { 1 };
+	struct reftable_ref_record refs[2] = {
+		{
+			.refname = "refs/heads/a",
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		},
+		{
+			.refname = "refs/heads/b",
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		},
+	};
+	/* the second table rewrites the entry with an expired time. */
+	struct reftable_log_record logs[2] = {
+		{
+			.refname = "branch",
+			.update_index = 1,
+			.time = 20,
+			.new_hash = hash,
+			.email = "identity@invalid",
+		},
+		{
+			.refname = "branch",
+			.update_index = 1,
+			.time = 5,
+			.new_hash = hash,
+			.email = "identity@invalid",
+		},
+	};
+	struct reftable_log_expiry_config expiry = {
+		.time = 10,
+	};
+	struct reftable_log_record log = { NULL };
+	struct reftable_iterator it = { NULL };
+	int i = 0;
 	int err;
-	char *dir = get_tmp_template(__FUNCTION__);
-	struct reftable_stack *st2 = NULL;
 
 	EXPECT(mkdtemp(dir));
 
 	err = reftable_new_stack(&st, dir, cfg);
 	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
 
-	err = reftable_stack_add(st, &write_nothing, NULL);
+	for (i = 0; i < ARRAY_SIZE(logs); i++) {
+		uint64_t update_index = reftable_stack_next_update_index(st);
+		struct write_log_arg arg = {
+			.log = &logs[i],
+			.update_index = update_index,
+		};
+		struct write_refs_logs_arg refs_arg = {
+			.refs = &refs[i],
+			.logs = &logs[i],
+			.n = 1,
+		};
+		refs[i].update_index = update_index;
+		if (mode == EXPIRE_LOGS_WITH_REFS)
+			err = reftable_stack_add(st, &write_test_refs_logs,
+						 &refs_arg);
+		else
+			err = reftable_stack_add(st, &write_test_log, &arg);
+		EXPECT_ERR(err);
+	}
+
+	err = reftable_stack_read_log(st, "branch", &log);
 	EXPECT_ERR(err);
+	EXPECT(log.time == 5);
 
-	err = reftable_new_stack(&st2, dir, cfg);
+	/* the newer entry, outside the range, still hides the older one. */
+	err = reftable_merged_table_seek_log_time(st->merged, &it, "",
+						  expiry.time, ~((uint64_t)0));
 	EXPECT_ERR(err);
-	clear_dir(dir);
-	reftable_stack_destroy(st);
-	reftable_stack_destroy(st2);
-}
+	err = reftable_iterator_next_log(&it, &log);
+	EXPECT(err == 1);
+	reftable_iterator_destroy(&it);
 
-static void test_reftable_stack_auto_compaction(void)
-{
-	struct reftable_write_options cfg = { 0 };
-	struct reftable_stack *st = NULL;
-	char *dir = get_tmp_template(__FUNCTION__);
-	int err, i;
-	int N = 100;
-	EXPECT(mkdtemp(dir));
+	if (mode == EXPIRE_BY_COMPACTING) {
+		err = reftable_stack_compact_all(st, &expiry);
+		EXPECT_ERR(err);
+	} else {
+		err = reftable_stack_expire_logs(st, &expiry);
+		EXPECT_ERR(err);
+		EXPECT(st->merged->stack_len == 2);
+	}
+
+	/* the older copy must not come back. */
+	err = reftable_stack_read_log(st, "branch", &log);
+	EXPECT(err == 1);
+
+	/* nor when the bottom table is compacted in later. */
+	err = reftable_stack_compact_all(st, NULL);
+	EXPECT_ERR(err);
+	err = reftable_stack_read_log(st, "branch", &log);
+	EXPECT(err == 1);
+
+	/* cleanup */
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+	reftable_log_record_release(&log);
+}
+
+static void test_reflog_expire_shadowed(void)
+{
+	test_reflog_expire_shadowed_opts(EXPIRE_BY_COMPACTING);
+	test_reflog_expire_shadowed_opts(EXPIRE_LOGS);
+	test_reflog_expire_shadowed_opts(EXPIRE_LOGS_WITH_REFS);
+}
+
+/* the ref and obj sections of `r`, as stored. */
+static void read_ref_sections(struct reftable_reader *r, struct strbuf *dest)
+{
+	struct reftable_block block = { NULL };
+	int n = block_source_read_block(&r->source, &block, 0,
+					r->log_offsets.offset);
+	EXPECT(n == r->log_offsets.offset);
+	strbuf_reset(dest);
+	strbuf_add(dest, block.data, n);
+	reftable_block_done(&block);
+}
+
+static void test_reftable_stack_expire_logs(void)
+{
+	char *dir = get_tmp_template(__FUNCTION__);
+	/* small blocks, so the tables have a ref index and an obj section. */
+	struct reftable_write_options cfg = {
+		.block_size = 256,
+	};
+	struct reftable_stack *st = NULL;
+	struct reftable_ref_record refs[3][50] = { { { NULL } } };
+	struct reftable_log_record logs[3][50] = { { { NULL } } };
+	struct strbuf before[3] = { STRBUF_INIT, STRBUF_INIT, STRBUF_INIT };
+	struct strbuf after = STRBUF_INIT;
+	struct reftable_log_expiry_config expiry = {
+		.time = 10,
+	};
+	struct reftable_compaction_stats *stats = NULL;
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_log_record log = { NULL };
+	int N = ARRAY_SIZE(refs[0]);
+	int err = 0;
+	int t = 0;
+	int i = 0;
+
+	EXPECT(mkdtemp(dir));
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	/* the logs of the middle table are all recent. */
+	for (t = 0; t < 3; t++) {
+		struct write_refs_logs_arg arg = {
+			.refs = refs[t],
+			.logs = logs[t],
+			.n = N,
+		};
+		uint64_t update_index = reftable_stack_next_update_index(st);
+		for (i = 0; i < N; i++) {
+			char name[100];
+			snprintf(name, sizeof(name), "refs/heads/t%d-%02d", t, i);
+			refs[t][i].refname = xstrdup(name);
+			refs[t][i].update_index = update_index;
+			refs[t][i].value_type = REFTABLE_REF_VAL1;
+			refs[t][i].value.val1 = reftable_malloc(SHA1_SIZE);
+			set_test_hash(refs[t][i].value.val1, t * N + i);
+
+			logs[t][i].refname = xstrdup(name);
+			logs[t][i].update_index = update_index;
+			logs[t][i].old_hash = reftable_malloc(SHA1_SIZE);
+			logs[t][i].new_hash = reftable_malloc(SHA1_SIZE);
+			logs[t][i].time = (t == 1) ? 100 : i;
+			logs[t][i].name = xstrdup("identity");
+			logs[t][i].email = xstrdup("identity@invalid");
+			logs[t][i].message = xstrdup("update\n");
+			set_test_hash(logs[t][i].old_hash, i);
+			set_test_hash(logs[t][i].new_hash, i + 1);
+		}
+		err = reftable_stack_add(st, &write_test_refs_logs, &arg);
+		EXPECT_ERR(err);
+	}
+	EXPECT(st->merged->stack_len == 3);
+	EXPECT(st->readers[0]->obj_offsets.is_present);
+	for (t = 0; t < 3; t++)
+		read_ref_sections(st->readers[t], &before[t]);
+
+	stats = reftable_stack_compaction_stats(st);
+	err = reftable_stack_expire_logs(st, &expiry);
+	EXPECT_ERR(err);
+
+	/* only the outer tables were rewritten, and only their logs. */
+	EXPECT(stats->attempts == 2);
+	EXPECT(stats->entries_written == 80);
+	EXPECT(st->merged->stack_len == 3);
+	for (t = 0; t < 3; t++) {
+		read_ref_sections(st->readers[t], &after);
+		EXPECT(!strbuf_cmp(&before[t], &after));
+	}
+
+	for (t = 0; t < 3; t++) {
+		for (i = 0; i < N; i++) {
+			err = reftable_stack_read_ref(st, refs[t][i].refname,
+						      &ref);
+			EXPECT_ERR(err);
+			EXPECT(reftable_ref_record_equal(&ref, &refs[t][i],
+							 SHA1_SIZE));
+
+			err = reftable_stack_read_log(st, logs[t][i].refname,
+						      &log);
+			if (t != 1 && i < 10) {
+				EXPECT(err == 1);
+			} else {
+				EXPECT_ERR(err);
+				EXPECT(reftable_log_record_equal(
+					&log, &logs[t][i], SHA1_SIZE));
+			}
+		}
+	}
+
+	/* nothing left to expire. */
+	err = reftable_stack_expire_logs(st, &expiry);
+	EXPECT_ERR(err);
+	EXPECT(stats->attempts == 2);
+
+	reftable_stack_destroy(st);
+	for (t = 0; t < 3; t++) {
+		for (i = 0; i < N; i++) {
+			reftable_ref_record_release(&refs[t][i]);
+			reftable_log_record_release(&logs[t][i]);
+		}
+		strbuf_release(&before[t]);
+	}
+	strbuf_release(&after);
+	reftable_ref_record_release(&ref);
+	reftable_log_record_release(&log);
+	clear_dir(dir);
+}
+
+static void test_reftable_stack_compaction_copies_blocks(void)
+{
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_write_options cfg = {
+		.block_size = 256,
+	};
+	struct reftable_stack *st = NULL;
+	struct reftable_ref_record refs[2][100] = { { { NULL } } };
+	struct reftable_log_record logs[2][100] = { { { NULL } } };
+	int lens[2] = { 100, 10 };
+	struct reftable_compaction_stats *stats = NULL;
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_log_record log = { NULL };
+	struct reftable_iterator it = { NULL };
+	struct reftable_block before = { NULL };
+	struct reftable_block after = { NULL };
+	uint8_t want[SHA1_SIZE];
+	int n = 0;
+	int err = 0;
+	int t = 0;
+	int i = 0;
+
+	EXPECT(mkdtemp(dir));
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	/* the second table only has names after those of the first. */
+	for (t = 0; t < 2; t++) {
+		struct write_refs_logs_arg arg = {
+			.refs = refs[t],
+			.logs = logs[t],
+			.n = lens[t],
+		};
+		uint64_t update_index = reftable_stack_next_update_index(st);
+		for (i = 0; i < lens[t]; i++) {
+			char name[100];
+			snprintf(name, sizeof(name), "refs/heads/t%d-%03d", t, i);
+			refs[t][i].refname = xstrdup(name);
+			refs[t][i].update_index = update_index;
+			refs[t][i].value_type = REFTABLE_REF_VAL1;
+			refs[t][i].value.val1 = reftable_malloc(SHA1_SIZE);
+			set_test_hash(refs[t][i].value.val1, t * 100 + i);
+
+			logs[t][i].refname = xstrdup(name);
+			logs[t][i].update_index = update_index;
+			logs[t][i].old_hash = reftable_malloc(SHA1_SIZE);
+			logs[t][i].new_hash = reftable_malloc(SHA1_SIZE);
+			logs[t][i].time = i;
+			logs[t][i].name = xstrdup("identity");
+			logs[t][i].email = xstrdup("identity@invalid");
+			logs[t][i].message = xstrdup("update\n");
+			set_test_hash(logs[t][i].old_hash, i);
+			set_test_hash(logs[t][i].new_hash, i + 1);
+		}
+		err = reftable_stack_add(st, &write_test_refs_logs, &arg);
+		EXPECT_ERR(err);
+	}
+	EXPECT(st->merged->stack_len == 2);
+	n = block_source_read_block(&st->readers[0]->source, &before,
+				    cfg.block_size, cfg.block_size);
+	EXPECT(n == cfg.block_size);
+
+	/* records that are merged get a restart point each, so only copied
+	 * blocks stay the same. */
+	st->config.restart_interval = 1;
+	stats = reftable_stack_compaction_stats(st);
+	err = reftable_stack_compact_all(st, NULL);
+	EXPECT_ERR(err);
+	EXPECT(st->merged->stack_len == 1);
+	EXPECT(stats->entries_written == 220);
+
+	/* the second ref block of the first table was copied. */
+	n = block_source_read_block(&st->readers[0]->source, &after,
+				    cfg.block_size, cfg.block_size);
+	EXPECT(n == cfg.block_size);
+	EXPECT(!memcmp(before.data, after.data, cfg.block_size));
+
+	for (t = 0; t < 2; t++) {
+		for (i = 0; i < lens[t]; i++) {
+			err = reftable_stack_read_ref(st, refs[t][i].refname,
+						      &ref);
+			EXPECT_ERR(err);
+			EXPECT(reftable_ref_record_equal(&ref, &refs[t][i],
+							 SHA1_SIZE));
+
+			err = reftable_stack_read_log(st, logs[t][i].refname,
+						      &log);
+			EXPECT_ERR(err);
+			EXPECT(reftable_log_record_equal(&log, &logs[t][i],
+							 SHA1_SIZE));
+		}
+	}
+
+	/* the obj section points at the copied blocks. */
+	set_test_hash(want, 50);
+	err = reftable_stack_refs_for(st, &it, want);
+	EXPECT_ERR(err);
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT_ERR(err);
+	EXPECT(!strcmp(ref.refname, refs[0][50].refname));
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT(err == 1);
+	reftable_iterator_destroy(&it);
+
+	reftable_block_done(&before);
+	reftable_block_done(&after);
+	reftable_stack_destroy(st);
+	for (t = 0; t < 2; t++) {
+		for (i = 0; i < lens[t]; i++) {
+			reftable_ref_record_release(&refs[t][i]);
+			reftable_log_record_release(&logs[t][i]);
+		}
+	}
+	reftable_ref_record_release(&ref);
+	reftable_log_record_release(&log);
+	clear_dir(dir);
+}
+
+static int write_nothing(struct reftable_writer *wr, void *arg)
+{
+	reftable_writer_set_limits(wr, 1, 1);
+	return 0;
+}
+
+static void test_empty_add(void)
+{
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	int err;
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_stack *st2 = NULL;
+
+	EXPECT(mkdtemp(dir));
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_add(st, &write_nothing, NULL);
+	EXPECT_ERR(err);
+
+	err = reftable_new_stack(&st2, dir, cfg);
+	EXPECT_ERR(err);
+	clear_dir(dir);
+	reftable_stack_destroy(st);
+	reftable_stack_destroy(st2);
+}
+
+static void test_reftable_stack_auto_compaction(void)
+{
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_template(__FUNCTION__);
+	int err, i;
+	int N = 100;
+	EXPECT(mkdtemp(dir));
 
 	err = reftable_new_stack(&st, dir, cfg);
 	EXPECT_ERR(err);
@@ -775,21 +1559,441 @@ static void test_reftable_stack_auto_compaction(void)
 	clear_dir(dir);
 }
 
+static void test_reftable_stack_stats(void)
+{
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_template(__FUNCTION__);
+	const struct reftable_stack_stats *stats = NULL;
+	struct reftable_ref_record dest = { NULL };
+	int err, i;
+	int N = 4;
+	EXPECT(mkdtemp(dir));
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = reftable_stack_next_update_index(st),
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		};
+		snprintf(name, sizeof(name), "branch%04d", i);
+
+		err = reftable_stack_add(st, &write_test_ref, &ref);
+		EXPECT_ERR(err);
+	}
+
+	stats = reftable_stack_get_stats(st);
+	EXPECT(stats->addition_bytes > 0);
+	EXPECT(stats->compaction_bytes == 0);
+
+	err = reftable_stack_read_ref(st, "branch0000", &dest);
+	EXPECT_ERR(err);
+	EXPECT(stats->lookups == 1);
+	EXPECT(stats->depth_histogram[N] == 1);
+	EXPECT(stats->tables_probed >= 1);
+	EXPECT(stats->tables_probed <= N);
+	EXPECT(stats->blocks_read >= stats->tables_probed);
+
+	err = reftable_stack_compact_all(st, NULL);
+	EXPECT_ERR(err);
+	EXPECT(stats->compaction_bytes > 0);
+
+	err = reftable_stack_read_ref(st, "branch0000", &dest);
+	EXPECT_ERR(err);
+	EXPECT(stats->lookups == 2);
+	EXPECT(stats->depth_histogram[1] == 1);
+
+	reftable_ref_record_release(&dest);
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+static void test_reftable_stack_compaction_worker(void)
+{
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_compaction_worker_options opts = {
+		.max_bytes_per_second = 1 << 20,
+		.max_cpu_percent = 50,
+	};
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_template(__FUNCTION__);
+	int err, i;
+	int N = 50;
+	EXPECT(mkdtemp(dir));
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_start_compaction_worker(st, &opts);
+	EXPECT_ERR(err);
+	err = reftable_stack_start_compaction_worker(st, &opts);
+	EXPECT(err == REFTABLE_API_ERROR);
+
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = reftable_stack_next_update_index(st),
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		};
+		snprintf(name, sizeof(name), "branch%04d", i);
+
+		err = reftable_stack_add(st, &write_test_ref, &ref);
+		EXPECT_ERR(err);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		err = reftable_stack_reload(st);
+		EXPECT_ERR(err);
+		if (st->merged->stack_len < 2 * fastlog2(N))
+			break;
+		sleep_millisec(10);
+	}
+	EXPECT(st->merged->stack_len < 2 * fastlog2(N));
+
+	reftable_stack_stop_compaction_worker(st);
+	EXPECT(reftable_stack_compaction_stats(st)->attempts > 0);
+	EXPECT(reftable_stack_get_stats(st)->compaction_bytes > 0);
+
+	err = reftable_stack_reload(st);
+	EXPECT_ERR(err);
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record dest = { NULL };
+		snprintf(name, sizeof(name), "branch%04d", i);
+
+		err = reftable_stack_read_ref(st, name, &dest);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp("master", dest.value.symref));
+		reftable_ref_record_release(&dest);
+	}
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+struct write_bulk_arg {
+	const char *prefix;
+	int n;
+	uint64_t update_index;
+};
+
+static int write_bulk_refs(struct reftable_writer *wr, void *arg)
+{
+	struct write_bulk_arg *wba = arg;
+	uint8_t hash[SHA1_SIZE] = { 1 };
+	int err = 0;
+	int i;
+
+	reftable_writer_set_limits(wr, wba->update_index, wba->update_index);
+	for (i = 0; i < wba->n && err == 0; i++) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = wba->update_index,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		snprintf(name, sizeof(name), "%s%06d", wba->prefix, i);
+		err = reftable_writer_add_ref(wr, &ref);
+	}
+	return err;
+}
+
+static void *concurrent_adder(void *arg)
+{
+	const char *dir = arg;
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	int err, i;
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (i = 0; i < 20; i++) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		};
+		snprintf(name, sizeof(name), "refs/heads/concurrent%04d", i);
+
+		do {
+			ref.update_index = reftable_stack_next_update_index(st);
+			err = reftable_stack_add(st, &write_test_ref, &ref);
+		} while (err == REFTABLE_LOCK_ERROR);
+		EXPECT_ERR(err);
+		sleep_millisec(1);
+	}
+
+	reftable_stack_destroy(st);
+	return NULL;
+}
+
+static void test_reftable_stack_compaction_concurrent_add(void)
+{
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	char *dir = xstrdup(get_tmp_template(__FUNCTION__));
+	struct reftable_ref_record dest = { NULL };
+	pthread_t adder;
+	int err, i;
+	EXPECT(mkdtemp(dir));
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (i = 0; i < 2; i++) {
+		struct write_bulk_arg arg = {
+			.prefix = i ? "refs/tags/bulk" : "refs/heads/bulk",
+			.n = 5000,
+			.update_index = reftable_stack_next_update_index(st),
+		};
+		err = reftable_stack_add(st, &write_bulk_refs, &arg);
+		EXPECT_ERR(err);
+	}
+
+	EXPECT(0 == pthread_create(&adder, NULL, concurrent_adder, dir));
+	for (i = 0; i < 20; i++) {
+		/* a positive result means the stack was out of date, or the
+		 * lock was taken when we started. */
+		err = reftable_stack_compact_all(st, NULL);
+		EXPECT(err >= 0);
+		err = reftable_stack_reload(st);
+		EXPECT_ERR(err);
+	}
+	EXPECT(0 == pthread_join(adder, NULL));
+
+	err = reftable_stack_reload(st);
+	EXPECT_ERR(err);
+	for (i = 0; i < 20; i++) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/concurrent%04d", i);
+		err = reftable_stack_read_ref(st, name, &dest);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp("master", dest.value.symref));
+	}
+	err = reftable_stack_read_ref(st, "refs/tags/bulk004999", &dest);
+	EXPECT_ERR(err);
+
+	reftable_ref_record_release(&dest);
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+	reftable_free(dir);
+}
+
+struct group_add_arg {
+	struct reftable_stack *st;
+	char name[100];
+	int err;
+};
+
+static void *group_adder(void *arg)
+{
+	struct group_add_arg *ga = arg;
+	uint8_t hash[SHA1_SIZE] = { 1 };
+	struct reftable_ref_record ref = {
+		.refname = ga->name,
+		.value_type = REFTABLE_REF_VAL1,
+		.value.val1 = hash,
+	};
+	struct reftable_log_record log = {
+		.refname = ga->name,
+		.new_hash = hash,
+		.old_hash = hash,
+		.name = "C O Mitter",
+		.email = "committer@invalid",
+		.message = "group\n",
+	};
+
+	ga->err = reftable_stack_group_add(ga->st, &ref, 1, &log, 1);
+	return NULL;
+}
+
+static void test_reftable_stack_group_add(void)
+{
+	struct reftable_write_options cfg = {
+		.group_commit_window_ms = 50,
+	};
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_ref_record dest = { NULL };
+	struct reftable_log_record log = { NULL };
+	struct reftable_ref_record dup[2] = {
+		{
+			.refname = "refs/heads/dup",
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		},
+		{
+			.refname = "refs/heads/dup",
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		},
+	};
+	struct reftable_ref_record head = {
+		.refname = "a",
+		.update_index = 1,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	struct group_add_arg args[8];
+	pthread_t threads[8];
+	int err, i;
+	int N = ARRAY_SIZE(args);
+	EXPECT(mkdtemp(dir));
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	err = reftable_stack_add(st, &write_test_ref, &head);
+	EXPECT_ERR(err);
+
+	err = reftable_stack_group_add(st, dup, 2, NULL, 0);
+	EXPECT(err == REFTABLE_API_ERROR);
+
+	for (i = 0; i < N; i++) {
+		args[i].st = st;
+		args[i].err = 1;
+		if (i == 0)
+			/* conflicts with "a" */
+			snprintf(args[i].name, sizeof(args[i].name), "a/b");
+		else if (i >= N - 2)
+			/* these go into different groups */
+			snprintf(args[i].name, sizeof(args[i].name),
+				 "refs/heads/shared");
+		else
+			snprintf(args[i].name, sizeof(args[i].name),
+				 "refs/heads/group%d", i);
+		EXPECT(0 == pthread_create(&threads[i], NULL, group_adder,
+					   &args[i]));
+	}
+	for (i = 0; i < N; i++) {
+		EXPECT(0 == pthread_join(threads[i], NULL));
+		if (i == 0) {
+			EXPECT(args[i].err == REFTABLE_NAME_CONFLICT);
+		} else {
+			EXPECT_ERR(args[i].err);
+		}
+	}
+
+	/* one table for "a", and at least two groups. */
+	EXPECT(st->merged->stack_len >= 3);
+	EXPECT(st->merged->stack_len < N);
+
+	for (i = 1; i < N; i++) {
+		err = reftable_stack_read_ref(st, args[i].name, &dest);
+		EXPECT_ERR(err);
+		err = reftable_stack_read_log(st, args[i].name, &log);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(log.message, "group\n"));
+	}
+	err = reftable_stack_read_ref(st, "a/b", &dest);
+	EXPECT(err == 1);
+
+	reftable_ref_record_release(&dest);
+	reftable_log_record_release(&log);
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+static void test_reftable_stack_fsync_mode(int fsync_mode)
+{
+	char *dir = get_tmp_template(__FUNCTION__);
+	struct reftable_write_options cfg = {
+		.fsync_mode = fsync_mode,
+	};
+	struct reftable_stack *st = NULL;
+	int err;
+	int i;
+
+	EXPECT(mkdtemp(dir));
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (i = 0; i < 3; i++) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = reftable_stack_next_update_index(st),
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		};
+		snprintf(name, sizeof(name), "branch%d", i);
+		err = reftable_stack_add(st, &write_test_ref, &ref);
+		EXPECT_ERR(err);
+	}
+	EXPECT(st->merged->stack_len == 3);
+
+	err = reftable_stack_compact_all(st, NULL);
+	EXPECT_ERR(err);
+	EXPECT(st->merged->stack_len == 1);
+
+	for (i = 0; i < 3; i++) {
+		char name[100];
+		struct reftable_ref_record dest = { NULL };
+		snprintf(name, sizeof(name), "branch%d", i);
+		err = reftable_stack_read_ref(st, name, &dest);
+		EXPECT_ERR(err);
+		EXPECT_STREQ("master", dest.value.symref);
+		reftable_ref_record_release(&dest);
+	}
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+static void test_reftable_stack_fsync_data(void)
+{
+	test_reftable_stack_fsync_mode(REFTABLE_FSYNC_DATA);
+}
+
+static void test_reftable_stack_fsync_full(void)
+{
+	test_reftable_stack_fsync_mode(REFTABLE_FSYNC_FULL);
+}
+
 int stack_test_main(int argc, const char *argv[])
 {
+	test_reftable_stack_fsync_data();
+	test_reftable_stack_fsync_full();
+	test_reftable_stack_group_add();
+	test_reftable_stack_optimistic_addition();
+	test_reftable_stack_compaction_concurrent_add();
+	test_reftable_stack_compaction_worker();
+	test_reftable_stack_stats();
 	test_reftable_stack_uptodate();
 	test_reftable_stack_transaction_api();
 	test_reftable_stack_hash_id();
 	test_sizes_to_segments_all_equal();
 	test_reftable_stack_auto_compaction();
 	test_reftable_stack_validate_refname();
+	test_reftable_stack_validate_refname_deletion();
 	test_reftable_stack_update_index_check();
 	test_reftable_stack_lock_failure();
 	test_reftable_stack_log_normalize();
 	test_reftable_stack_tombstone();
 	test_reftable_stack_add_one();
+	test_reftable_stack_writer_reuse();
+	test_reftable_stack_refs_for();
 	test_empty_add();
 	test_reflog_expire();
+	test_reflog_expire_log_time_index();
+	test_reflog_expire_shadowed();
+	test_reftable_stack_expire_logs();
+	test_reftable_stack_compaction_copies_blocks();
 	test_suggest_compaction_segment();
 	test_suggest_compaction_segment_nothing();
 	test_sizes_to_segments();
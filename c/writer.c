@@ -12,14 +12,19 @@ https://developers.google.com/open-source/licenses/bsd
 
 #include "block.h"
 #include "constants.h"
+#include "radix.h"
+#include "reader.h"
 #include "record.h"
-#include "tree.h"
 #include "reftable-error.h"
 
+/* Blocks and padding are collected and passed to the writer callback in
+ * chunks of this size, to save on write(2) calls. */
+#define WRITER_BUFFER_SIZE (64 * 1024)
+
 /* finishes a block, and writes it to storage */
 static int writer_flush_block(struct reftable_writer *w);
 
-/* deallocates memory related to the index */
+/* drops the pending index records, keeping the array for reuse. */
 static void writer_clear_index(struct reftable_writer *w);
 
 /* finishes writing a 'r' (refs) or 'g' (reflogs) section */
@@ -42,28 +47,75 @@ writer_reftable_block_stats(struct reftable_writer *w, uint8_t typ)
 	return NULL;
 }
 
+/* hands the buffered output to the writer callback. */
+static int writer_flush_output(struct reftable_writer *w)
+{
+	int n = 0;
+	if (w->out_len == 0)
+		return 0;
+	n = w->write(w->write_arg, w->out, w->out_len);
+	w->out_len = 0;
+	if (n < 0)
+		return n;
+	return 0;
+}
+
+/* appends `len` bytes of `data`, or zeros if `data` is NULL, to the output
+ * buffer, flushing it to the callback when it fills up. Writes of at least a
+ * buffer's worth bypass the buffer. */
+static int writer_output(struct reftable_writer *w, const uint8_t *data,
+			 size_t len)
+{
+	int err = 0;
+	if (w->out_len + len > WRITER_BUFFER_SIZE) {
+		err = writer_flush_output(w);
+		if (err < 0)
+			return err;
+	}
+
+	if (data != NULL && len >= WRITER_BUFFER_SIZE) {
+		int n = w->write(w->write_arg, data, len);
+		if (n < 0)
+			return n;
+		return 0;
+	}
+
+	while (len > 0) {
+		size_t chunk = WRITER_BUFFER_SIZE - w->out_len;
+		if (chunk > len)
+			chunk = len;
+		if (data != NULL) {
+			memcpy(w->out + w->out_len, data, chunk);
+			data += chunk;
+		} else {
+			memset(w->out + w->out_len, 0, chunk);
+		}
+		w->out_len += chunk;
+		len -= chunk;
+		if (w->out_len == WRITER_BUFFER_SIZE) {
+			err = writer_flush_output(w);
+			if (err < 0)
+				return err;
+		}
+	}
+	return 0;
+}
+
 /* write data, queuing the padding for the next write. Returns negative for
  * error. */
 static int padded_write(struct reftable_writer *w, uint8_t *data, size_t len,
 			int padding)
 {
-	int n = 0;
+	int err = 0;
 	if (w->pending_padding > 0) {
-		uint8_t *zeroed = reftable_calloc(w->pending_padding);
-		int n = w->write(w->write_arg, zeroed, w->pending_padding);
-		if (n < 0)
-			return n;
-
+		err = writer_output(w, NULL, w->pending_padding);
+		if (err < 0)
+			return err;
 		w->pending_padding = 0;
-		reftable_free(zeroed);
 	}
 
 	w->pending_padding = padding;
-	n = w->write(w->write_arg, data, len);
-	if (n < 0)
-		return n;
-	n += padding;
-	return 0;
+	return writer_output(w, data, len);
 }
 
 static void options_set_defaults(struct reftable_write_options *opts)
@@ -78,6 +130,91 @@ static void options_set_defaults(struct reftable_write_options *opts)
 	if (opts->block_size == 0) {
 		opts->block_size = DEFAULT_BLOCK_SIZE;
 	}
+
+	/* The table header announces the largest aligned block. */
+	if (opts->ref_block_size > opts->block_size)
+		opts->block_size = opts->ref_block_size;
+	if (opts->obj_block_size > opts->block_size)
+		opts->block_size = opts->obj_block_size;
+	if (opts->index_block_size > opts->block_size)
+		opts->block_size = opts->index_block_size;
+
+	if (opts->ref_block_size == 0)
+		opts->ref_block_size = opts->block_size;
+	if (opts->obj_block_size == 0)
+		opts->obj_block_size = opts->block_size;
+	if (opts->index_block_size == 0)
+		opts->index_block_size = opts->block_size;
+	if (opts->log_block_size == 0)
+		opts->log_block_size = opts->block_size;
+}
+
+static uint32_t writer_block_size(struct reftable_writer *w, uint8_t typ)
+{
+	switch (typ) {
+	case BLOCK_TYPE_REF:
+		return w->opts.ref_block_size;
+	case BLOCK_TYPE_OBJ:
+		return w->opts.obj_block_size;
+	case BLOCK_TYPE_INDEX:
+		return w->opts.index_block_size;
+	case BLOCK_TYPE_LOG:
+		return w->opts.log_block_size;
+	}
+	abort();
+}
+
+/* Linear scans between restarts should decode about this many bytes. */
+#define RESTART_SPAN_BYTES 256
+
+#define MIN_RESTART_INTERVAL 2
+#define MAX_RESTART_INTERVAL 128
+
+static int writer_restart_interval(struct reftable_writer *w, uint8_t typ)
+{
+	struct writer_key_stats *ks = &w->key_stats;
+	uint64_t entry_bytes = 0;
+	uint64_t restart_bytes = 0;
+	uint64_t interval = 0;
+	uint64_t min_interval = 0;
+
+	if (!w->opts.adaptive_restart_interval || ks->typ != typ ||
+	    ks->entries == 0)
+		return w->opts.restart_interval;
+
+	entry_bytes = ks->bytes / ks->entries;
+	if (entry_bytes == 0)
+		entry_bytes = 1;
+	/* a restart spells out the shared prefix, and takes 3 bytes in the
+	 * restart table. */
+	restart_bytes = 3 + ks->shared_prefix_bytes / ks->entries;
+
+	interval = RESTART_SPAN_BYTES / entry_bytes;
+	/* but don't spend more than 1/8 of the block on restarts. */
+	min_interval = (8 * restart_bytes + entry_bytes - 1) / entry_bytes;
+	if (interval < min_interval)
+		interval = min_interval;
+
+	if (interval < MIN_RESTART_INTERVAL)
+		interval = MIN_RESTART_INTERVAL;
+	if (interval > MAX_RESTART_INTERVAL)
+		interval = MAX_RESTART_INTERVAL;
+	return interval;
+}
+
+/* folds the statistics of the block being flushed into w->key_stats. */
+static void writer_update_key_stats(struct reftable_writer *w)
+{
+	struct block_writer *bw = w->block_writer;
+	struct writer_key_stats *ks = &w->key_stats;
+	uint8_t typ = block_writer_type(bw);
+	if (ks->typ != typ) {
+		memset(ks, 0, sizeof(*ks));
+		ks->typ = typ;
+	}
+	ks->entries += bw->entries;
+	ks->bytes += bw->next - bw->header_off - 4;
+	ks->shared_prefix_bytes += bw->shared_prefix_bytes;
 }
 
 static int writer_version(struct reftable_writer *w)
@@ -109,10 +246,15 @@ static void writer_reinit_block_writer(struct reftable_writer *w, uint8_t typ)
 
 	strbuf_release(&w->last_key);
 	block_writer_init(&w->block_writer_data, typ, w->block,
-			  w->opts.block_size, block_start,
+			  writer_block_size(w, typ), block_start,
 			  hash_size(w->opts.hash_id));
 	w->block_writer = &w->block_writer_data;
-	w->block_writer->restart_interval = w->opts.restart_interval;
+	w->block_writer->restart_interval = writer_restart_interval(w, typ);
+	w->block_has_time = 0;
+	if (typ == BLOCK_TYPE_REF && w->opts.columnar_ref_blocks)
+		block_writer_use_columns(w->block_writer);
+	else if (typ == BLOCK_TYPE_REF && w->opts.ref_block_dictionary)
+		block_writer_use_dict(w->block_writer);
 }
 
 static struct strbuf reftable_empty_strbuf = STRBUF_INIT;
@@ -123,17 +265,25 @@ reftable_new_writer(int (*writer_func)(void *, const void *, size_t),
 {
 	struct reftable_writer *wp =
 		reftable_calloc(sizeof(struct reftable_writer));
+	uint32_t max_block_size = 0;
 	strbuf_init(&wp->block_writer_data.last_key, 0);
+	strbuf_init(&wp->names.buf, 0);
 	options_set_defaults(opts);
-	if (opts->block_size >= (1 << 24)) {
+	max_block_size = opts->block_size;
+	if (opts->log_block_size > max_block_size)
+		max_block_size = opts->log_block_size;
+	if (max_block_size >= (1 << 24)) {
 		/* TODO - error return? */
 		abort();
 	}
 	wp->last_key = reftable_empty_strbuf;
-	wp->block = reftable_calloc(opts->block_size);
+	wp->block = reftable_calloc(max_block_size);
+	wp->out = reftable_malloc(WRITER_BUFFER_SIZE);
 	wp->write = writer_func;
 	wp->write_arg = writer_arg;
 	wp->opts = *opts;
+	obj_index_init(&wp->obj_index, hash_size(opts->hash_id),
+		       opts->obj_index_memory_limit);
 	writer_reinit_block_writer(wp, BLOCK_TYPE_REF);
 
 	return wp;
@@ -146,63 +296,46 @@ void reftable_writer_set_limits(struct reftable_writer *w, uint64_t min,
 	w->max_update_index = max;
 }
 
-void reftable_writer_free(struct reftable_writer *w)
+void reftable_writer_reset(struct reftable_writer *w,
+			   int (*writer_func)(void *, const void *, size_t),
+			   void *writer_arg)
 {
-	reftable_free(w->block);
-	reftable_free(w);
-}
-
-struct obj_index_tree_node {
-	struct strbuf hash;
-	uint64_t *offsets;
-	size_t offset_len;
-	size_t offset_cap;
-};
-
-#define OBJ_INDEX_TREE_NODE_INIT    \
-	{                           \
-		.hash = STRBUF_INIT \
-	}
-
-static int obj_index_tree_node_compare(const void *a, const void *b)
-{
-	return strbuf_cmp(&((const struct obj_index_tree_node *)a)->hash,
-			  &((const struct obj_index_tree_node *)b)->hash);
+	/* the buffers, restart, index and object index arrays are kept; only
+	 * the state of the table being written is cleared. */
+	writer_clear_index(w);
+	obj_index_reset(&w->obj_index);
+	strbuf_reset(&w->last_key);
+	w->write = writer_func;
+	w->write_arg = writer_arg;
+	w->pending_padding = 0;
+	w->out_len = 0;
+	w->next = 0;
+	w->min_update_index = 0;
+	w->max_update_index = 0;
+	memset(&w->key_stats, 0, sizeof(w->key_stats));
+	memset(&w->stats, 0, sizeof(w->stats));
+	w->record_names = 0;
+	strbuf_reset(&w->names.buf);
+	w->names.add_len = 0;
+	w->names.del_len = 0;
+	writer_reinit_block_writer(w, BLOCK_TYPE_REF);
 }
 
-static void writer_index_hash(struct reftable_writer *w, struct strbuf *hash)
+void reftable_writer_free(struct reftable_writer *w)
 {
-	uint64_t off = w->next;
-
-	struct obj_index_tree_node want = { .hash = *hash };
-
-	struct tree_node *node = tree_search(&want, &w->obj_index_tree,
-					     &obj_index_tree_node_compare, 0);
-	struct obj_index_tree_node *key = NULL;
-	if (node == NULL) {
-		struct obj_index_tree_node empty = OBJ_INDEX_TREE_NODE_INIT;
-		key = reftable_malloc(sizeof(struct obj_index_tree_node));
-		*key = empty;
-
-		strbuf_reset(&key->hash);
-		strbuf_addbuf(&key->hash, hash);
-		tree_search((void *)key, &w->obj_index_tree,
-			    &obj_index_tree_node_compare, 1);
-	} else {
-		key = node->key;
-	}
-
-	if (key->offset_len > 0 && key->offsets[key->offset_len - 1] == off) {
+	if (w == NULL)
 		return;
-	}
-
-	if (key->offset_len == key->offset_cap) {
-		key->offset_cap = 2 * key->offset_cap + 1;
-		key->offsets = reftable_realloc(
-			key->offsets, sizeof(uint64_t) * key->offset_cap);
-	}
-
-	key->offsets[key->offset_len++] = off;
+	obj_index_release(&w->obj_index);
+	block_writer_release(&w->block_writer_data);
+	writer_clear_index(w);
+	reftable_free(w->index);
+	strbuf_release(&w->last_key);
+	strbuf_release(&w->names.buf);
+	reftable_free(w->names.add);
+	reftable_free(w->names.del);
+	reftable_free(w->block);
+	reftable_free(w->out);
+	reftable_free(w);
 }
 
 static int writer_add_record(struct reftable_writer *w,
@@ -247,11 +380,37 @@ done:
 	return result;
 }
 
+static void writer_record_name(struct reftable_writer *w,
+			       struct reftable_ref_record *ref)
+{
+	struct writer_names *names = &w->names;
+	size_t off = names->buf.len;
+
+	/* including the NUL. */
+	strbuf_add(&names->buf, ref->refname, strlen(ref->refname) + 1);
+	if (reftable_ref_record_is_deletion(ref)) {
+		if (names->del_len == names->del_cap) {
+			names->del_cap = 2 * names->del_cap + 1;
+			names->del = reftable_realloc(
+				names->del, sizeof(size_t) * names->del_cap);
+		}
+		names->del[names->del_len++] = off;
+	} else {
+		if (names->add_len == names->add_cap) {
+			names->add_cap = 2 * names->add_cap + 1;
+			names->add = reftable_realloc(
+				names->add, sizeof(size_t) * names->add_cap);
+		}
+		names->add[names->add_len++] = off;
+	}
+}
+
 int reftable_writer_add_ref(struct reftable_writer *w,
 			    struct reftable_ref_record *ref)
 {
 	struct reftable_record rec = { NULL };
 	struct reftable_ref_record copy = *ref;
+	uint64_t pos = 0;
 	int err = 0;
 
 	if (ref->refname == NULL)
@@ -266,23 +425,28 @@ int reftable_writer_add_ref(struct reftable_writer *w,
 	err = writer_add_record(w, &rec);
 	if (err < 0)
 		return err;
+	if (w->record_names)
+		writer_record_name(w, ref);
+
+	pos = w->next;
+	if (w->opts.full_width_obj_index)
+		pos = pos << OBJ_POS_RESTART_BITS |
+		      (w->block_writer->restart_len - 1);
 
 	if (!w->opts.skip_index_objects &&
 	    reftable_ref_record_val1(ref) != NULL) {
-		struct strbuf h = STRBUF_INIT;
-		strbuf_add(&h, (char *)reftable_ref_record_val1(ref),
-			   hash_size(w->opts.hash_id));
-		writer_index_hash(w, &h);
-		strbuf_release(&h);
+		err = obj_index_add(&w->obj_index,
+				    reftable_ref_record_val1(ref), pos);
+		if (err < 0)
+			return err;
 	}
 
 	if (!w->opts.skip_index_objects &&
 	    reftable_ref_record_val2(ref) != NULL) {
-		struct strbuf h = STRBUF_INIT;
-		strbuf_add(&h, reftable_ref_record_val2(ref),
-			   hash_size(w->opts.hash_id));
-		writer_index_hash(w, &h);
-		strbuf_release(&h);
+		err = obj_index_add(&w->obj_index,
+				    reftable_ref_record_val2(ref), pos);
+		if (err < 0)
+			return err;
 	}
 	return 0;
 }
@@ -292,13 +456,24 @@ int reftable_writer_add_refs(struct reftable_writer *w,
 {
 	int err = 0;
 	int i = 0;
-	QSORT(refs, n, reftable_ref_record_compare_name);
+	radix_sort_refs(refs, n, w->opts.sort_threads);
 	for (i = 0; err == 0 && i < n; i++) {
 		err = reftable_writer_add_ref(w, &refs[i]);
 	}
 	return err;
 }
 
+/* widens the time range of the current block. */
+static void writer_add_time(struct reftable_writer *w, uint64_t min_time,
+			    uint64_t max_time)
+{
+	if (!w->block_has_time || min_time < w->block_min_time)
+		w->block_min_time = min_time;
+	if (!w->block_has_time || max_time > w->block_max_time)
+		w->block_max_time = max_time;
+	w->block_has_time = 1;
+}
+
 int reftable_writer_add_log(struct reftable_writer *w,
 			    struct reftable_log_record *log)
 {
@@ -336,6 +511,14 @@ int reftable_writer_add_log(struct reftable_writer *w,
 
 	reftable_record_from_log(&rec, log);
 	err = writer_add_record(w, &rec);
+	if (err == 0 && w->opts.log_time_index) {
+		if (reftable_log_record_is_deletion(log))
+			/* deletions may hide entries of any time in older
+			 * tables, so their blocks are never skipped. */
+			writer_add_time(w, 0, ~((uint64_t)0));
+		else
+			writer_add_time(w, log->time, log->time);
+	}
 
 done:
 	log->message = input_log_message;
@@ -348,7 +531,7 @@ int reftable_writer_add_logs(struct reftable_writer *w,
 {
 	int err = 0;
 	int i = 0;
-	QSORT(logs, n, reftable_log_record_compare_key);
+	radix_sort_logs(logs, n, w->opts.sort_threads);
 
 	for (i = 0; err == 0 && i < n; i++) {
 		err = reftable_writer_add_log(w, &logs[i]);
@@ -369,6 +552,10 @@ static int writer_finish_section(struct reftable_writer *w)
 	if (err < 0)
 		return err;
 
+	/* time ranges are worth indexing for as few as two blocks. */
+	if (typ == BLOCK_TYPE_LOG && w->opts.log_time_index)
+		threshold = 1;
+
 	while (w->index_len > threshold) {
 		struct reftable_index_record *idx = NULL;
 		int idx_len = 0;
@@ -387,6 +574,9 @@ static int writer_finish_section(struct reftable_writer *w)
 			struct reftable_record rec = { NULL };
 			reftable_record_from_index(&rec, idx + i);
 			if (block_writer_add(w->block_writer, &rec) == 0) {
+				if (idx[i].has_time)
+					writer_add_time(w, idx[i].min_time,
+							idx[i].max_time);
 				continue;
 			}
 
@@ -402,19 +592,27 @@ static int writer_finish_section(struct reftable_writer *w)
 				 */
 				abort();
 			}
+			if (idx[i].has_time)
+				writer_add_time(w, idx[i].min_time,
+						idx[i].max_time);
 		}
+
+		/* the last block of this level must be indexed by the next
+		 * one too. */
+		err = writer_flush_block(w);
+		if (err < 0)
+			return err;
+
 		for (i = 0; i < idx_len; i++) {
 			strbuf_release(&idx[i].last_key);
 		}
 		reftable_free(idx);
 	}
 
+	/* The records for the top-level blocks must not end up in the next
+	 * section's index. */
 	writer_clear_index(w);
 
-	err = writer_flush_block(w);
-	if (err < 0)
-		return err;
-
 	bstats = writer_reftable_block_stats(w, typ);
 	bstats->index_blocks = w->stats.idx_stats.blocks - before_blocks;
 	bstats->index_offset = index_start;
@@ -426,91 +624,64 @@ static int writer_finish_section(struct reftable_writer *w)
 	return 0;
 }
 
-struct common_prefix_arg {
-	struct strbuf *last;
-	int max;
-};
-
-static void update_common(void *void_arg, void *key)
+static int writer_write_object_record(struct reftable_writer *w,
+				      struct reftable_obj_record *obj_rec)
 {
-	struct common_prefix_arg *arg = (struct common_prefix_arg *)void_arg;
-	struct obj_index_tree_node *entry = (struct obj_index_tree_node *)key;
-	if (arg->last != NULL) {
-		int n = common_prefix_size(&entry->hash, arg->last);
-		if (n > arg->max) {
-			arg->max = n;
-		}
-	}
-	arg->last = &entry->hash;
-}
-
-struct write_record_arg {
-	struct reftable_writer *w;
-	int err;
-};
-
-static void write_object_record(void *void_arg, void *key)
-{
-	struct write_record_arg *arg = (struct write_record_arg *)void_arg;
-	struct obj_index_tree_node *entry = (struct obj_index_tree_node *)key;
-	struct reftable_obj_record obj_rec = {
-		.hash_prefix = (uint8_t *)entry->hash.buf,
-		.hash_prefix_len = arg->w->stats.object_id_len,
-		.offsets = entry->offsets,
-		.offset_len = entry->offset_len,
-	};
 	struct reftable_record rec = { NULL };
-	if (arg->err < 0)
-		goto done;
+	int err = 0;
 
-	reftable_record_from_obj(&rec, &obj_rec);
-	arg->err = block_writer_add(arg->w->block_writer, &rec);
-	if (arg->err == 0)
-		goto done;
+	reftable_record_from_obj(&rec, obj_rec);
+	err = block_writer_add(w->block_writer, &rec);
+	if (err == 0)
+		return 0;
 
-	arg->err = writer_flush_block(arg->w);
-	if (arg->err < 0)
-		goto done;
+	err = writer_flush_block(w);
+	if (err < 0)
+		return err;
 
-	writer_reinit_block_writer(arg->w, BLOCK_TYPE_OBJ);
-	arg->err = block_writer_add(arg->w->block_writer, &rec);
-	if (arg->err == 0)
-		goto done;
-	obj_rec.offset_len = 0;
-	arg->err = block_writer_add(arg->w->block_writer, &rec);
+	writer_reinit_block_writer(w, BLOCK_TYPE_OBJ);
+	err = block_writer_add(w->block_writer, &rec);
+	if (err == 0)
+		return 0;
+	obj_rec->offset_len = 0;
+	err = block_writer_add(w->block_writer, &rec);
 
 	/* Should be able to write into a fresh block. */
-	assert(arg->err == 0);
-
-done:;
+	assert(err == 0);
+	return err;
 }
 
-static void object_record_free(void *void_arg, void *key)
+static int write_object_record(void *void_arg, uint8_t *hash,
+			       uint64_t *offsets, size_t offsets_len)
 {
-	struct obj_index_tree_node *entry = (struct obj_index_tree_node *)key;
-
-	FREE_AND_NULL(entry->offsets);
-	strbuf_release(&entry->hash);
-	reftable_free(entry);
+	struct reftable_writer *w = void_arg;
+	struct reftable_obj_record obj_rec = {
+		.hash_prefix = hash,
+		.hash_prefix_len = w->stats.object_id_len,
+		.offsets = offsets,
+		.offset_len = offsets_len,
+	};
+	return writer_write_object_record(w, &obj_rec);
 }
 
 static int writer_dump_object_index(struct reftable_writer *w)
 {
-	struct write_record_arg closure = { .w = w };
-	struct common_prefix_arg common = { NULL };
-	if (w->obj_index_tree != NULL) {
-		infix_walk(w->obj_index_tree, &update_common, &common);
+	int common = 0;
+	int err = 0;
+	if (w->opts.full_width_obj_index) {
+		w->stats.object_id_len = hash_size(w->opts.hash_id);
+	} else {
+		err = obj_index_common_prefix(&w->obj_index, &common);
+		if (err < 0)
+			return err;
+		w->stats.object_id_len = common + 1;
 	}
-	w->stats.object_id_len = common.max + 1;
 
 	writer_reinit_block_writer(w, BLOCK_TYPE_OBJ);
 
-	if (w->obj_index_tree != NULL) {
-		infix_walk(w->obj_index_tree, &write_object_record, &closure);
-	}
-
-	if (closure.err < 0)
-		return closure.err;
+	err = obj_index_walk(&w->obj_index, &write_object_record, w);
+	if (err < 0)
+		return err;
 	return writer_finish_section(w);
 }
 
@@ -533,12 +704,298 @@ static int writer_finish_public_section(struct reftable_writer *w)
 			return err;
 	}
 
-	if (w->obj_index_tree != NULL) {
-		infix_walk(w->obj_index_tree, &object_record_free, NULL);
-		tree_free(w->obj_index_tree);
-		w->obj_index_tree = NULL;
+	obj_index_reset(&w->obj_index);
+
+	w->block_writer = NULL;
+	return 0;
+}
+
+/* the type byte of the ref blocks this writer produces. */
+static uint8_t writer_ref_block_type(struct reftable_writer *w)
+{
+	if (w->opts.columnar_ref_blocks)
+		return BLOCK_TYPE_REF_COLUMNS;
+	if (w->opts.ref_block_dictionary)
+		return BLOCK_TYPE_REF_DICT;
+	return BLOCK_TYPE_REF;
+}
+
+/* what writer_add_block needs to know about the records of a block. */
+struct block_summary {
+	int entries;
+	int has_deletion;
+	int has_time;
+	uint64_t min_time;
+	uint64_t max_time;
+	/* for ref blocks: the object IDs, with the restart run they are in as
+	 * offset. */
+	struct obj_index_entry *objs;
+	size_t objs_len;
+	size_t objs_cap;
+};
+
+static void block_summary_add_obj(struct block_summary *sum, uint8_t *hash,
+				  int hash_size, int run)
+{
+	struct obj_index_entry *e = NULL;
+	if (sum->objs_len == sum->objs_cap) {
+		sum->objs_cap = 2 * sum->objs_cap + 1;
+		sum->objs = reftable_realloc(
+			sum->objs, sizeof(struct obj_index_entry) * sum->objs_cap);
+	}
+	e = &sum->objs[sum->objs_len++];
+	memcpy(e->hash, hash, hash_size);
+	e->offset = run;
+}
+
+static int block_summarize(struct block_reader *br, struct block_summary *sum)
+{
+	struct block_iter it = { .last_key = STRBUF_INIT };
+	uint8_t typ = block_reader_type(br);
+	struct reftable_record rec = reftable_new_record(typ);
+	int err = 0;
+
+	block_reader_start(br, &it);
+	while (1) {
+		int run = block_iter_restart_run(&it);
+		err = block_iter_next(&it, &rec);
+		if (err > 0) {
+			err = 0;
+			break;
+		}
+		if (err < 0)
+			break;
+
+		sum->entries++;
+		if (reftable_record_is_deletion(&rec))
+			sum->has_deletion = 1;
+		if (typ == BLOCK_TYPE_REF) {
+			struct reftable_ref_record *ref =
+				reftable_record_as_ref(&rec);
+			if (reftable_ref_record_val1(ref) != NULL)
+				block_summary_add_obj(
+					sum, reftable_ref_record_val1(ref),
+					br->hash_size, run);
+			if (reftable_ref_record_val2(ref) != NULL)
+				block_summary_add_obj(
+					sum, reftable_ref_record_val2(ref),
+					br->hash_size, run);
+		} else if (typ == BLOCK_TYPE_LOG) {
+			struct reftable_log_record *log =
+				reftable_record_as_log(&rec);
+			uint64_t min_time = log->time;
+			uint64_t max_time = log->time;
+			if (reftable_log_record_is_deletion(log)) {
+				min_time = 0;
+				max_time = ~((uint64_t)0);
+			}
+			if (!sum->has_time || min_time < sum->min_time)
+				sum->min_time = min_time;
+			if (!sum->has_time || max_time > sum->max_time)
+				sum->max_time = max_time;
+			sum->has_time = 1;
+		}
+	}
+	block_iter_close(&it);
+	reftable_record_destroy(&rec);
+	return err;
+}
+
+int writer_add_block(struct reftable_writer *w, struct writer_block *b,
+		     int drop_deletions)
+{
+	struct reftable_reader *r = b->r;
+	uint64_t off = b->idx.offset;
+	uint32_t header_off = off ? 0 : header_size(r->version);
+	struct block_reader br = { 0 };
+	struct block_summary sum = { 0 };
+	struct reftable_block raw = { NULL };
+	/* the raw bytes, lent to the block reader so they survive inflating. */
+	struct reftable_block lent = { NULL };
+	struct reftable_block_stats *bstats = NULL;
+	struct reftable_index_record ir = { .last_key = STRBUF_INIT };
+	int at_start = w->next == 0 && (w->block_writer == NULL ||
+					 w->block_writer->entries == 0);
+	uint32_t raw_bytes = 0;
+	uint32_t sz = 0;
+	uint8_t typ = 0;
+	int padding = 0;
+	size_t i = 0;
+	int err = 0;
+
+	if (r->block_size != w->opts.block_size ||
+	    r->hash_id != w->opts.hash_id || b->len <= header_off + 4)
+		return 1;
+	/* the first block holds the file header, and no other block can. */
+	if (at_start != (off == 0))
+		return 1;
+
+	err = block_source_read_block(&r->source, &raw, off, b->len);
+	if (err != b->len) {
+		err = REFTABLE_IO_ERROR;
+		goto done;
+	}
+	r->blocks_read++;
+	typ = raw.data[header_off];
+	/* the size in the block header is the uncompressed one. */
+	sz = get_be24(raw.data + header_off + 1);
+	raw_bytes = (typ == BLOCK_TYPE_LOG) ? b->len : sz;
+
+	/* refs store their update_index relative to the table's, and only
+	 * blocks in the writer's format and at least half full are worth
+	 * copying. */
+	err = 1;
+	if (typ != BLOCK_TYPE_LOG &&
+	    (typ != writer_ref_block_type(w) ||
+	     r->min_update_index != w->min_update_index ||
+	     r->max_update_index > w->max_update_index || sz > b->len))
+		goto done;
+	if (typ != BLOCK_TYPE_LOG)
+		typ = BLOCK_TYPE_REF;
+	if (sz > writer_block_size(w, typ) ||
+	    2 * sz < writer_block_size(w, typ))
+		goto done;
+
+	lent.data = raw.data;
+	lent.len = raw_bytes;
+	if (typ == BLOCK_TYPE_LOG)
+		r->blocks_inflated++;
+	err = block_reader_init(&br, &lent, header_off, r->block_size,
+				hash_size(r->hash_id));
+	if (err == 0)
+		err = block_summarize(&br, &sum);
+	if (err < 0)
+		goto done;
+	err = 1;
+	if (sum.entries == 0 || (drop_deletions && sum.has_deletion))
+		goto done;
+
+	if (typ == BLOCK_TYPE_LOG && w->block_writer != NULL &&
+	    block_writer_type(w->block_writer) == BLOCK_TYPE_REF) {
+		err = writer_finish_public_section(w);
+		if (err < 0)
+			goto done;
+	}
+	if (strbuf_cmp(&w->last_key, &b->start_key) > 0) {
+		err = REFTABLE_API_ERROR;
+		goto done;
+	}
+	if (w->block_writer == NULL ?
+		    typ != BLOCK_TYPE_LOG :
+		    block_writer_type(w->block_writer) != typ) {
+		err = REFTABLE_API_ERROR;
+		goto done;
+	}
+	err = writer_flush_block(w);
+	if (err < 0)
+		goto done;
+	if (typ == BLOCK_TYPE_LOG) {
+		w->next -= w->pending_padding;
+		w->pending_padding = 0;
+	}
+
+	if (typ == BLOCK_TYPE_REF && !w->opts.unpadded &&
+	    writer_block_size(w, typ) == w->opts.block_size)
+		padding = w->opts.block_size - raw_bytes;
+	if (off == 0) {
+		/* the header has this table's update index limits. */
+		uint8_t header[28];
+		int n = writer_write_header(w, header);
+		err = padded_write(w, header, n, 0);
+		if (err == 0)
+			err = padded_write(w, raw.data + n, raw_bytes - n,
+					   padding);
+	} else {
+		err = padded_write(w, raw.data, raw_bytes, padding);
 	}
+	if (err < 0)
+		goto done;
+
+	for (i = 0; !w->opts.skip_index_objects && i < sum.objs_len; i++) {
+		uint64_t pos = w->next;
+		if (w->opts.full_width_obj_index)
+			pos = pos << OBJ_POS_RESTART_BITS | sum.objs[i].offset;
+		err = obj_index_add(&w->obj_index, sum.objs[i].hash, pos);
+		if (err < 0)
+			goto done;
+	}
+
+	bstats = writer_reftable_block_stats(w, typ);
+	if (bstats->blocks == 0)
+		bstats->offset = w->next;
+	bstats->entries += sum.entries;
+	bstats->restarts += br.restart_count;
+	bstats->blocks++;
+	w->stats.blocks++;
 
+	if (w->index_cap == w->index_len) {
+		w->index_cap = 2 * w->index_cap + 1;
+		w->index = reftable_realloc(
+			w->index,
+			sizeof(struct reftable_index_record) * w->index_cap);
+	}
+	ir.offset = w->next;
+	strbuf_addbuf(&ir.last_key, &b->idx.last_key);
+	ir.has_time = w->opts.log_time_index && sum.has_time;
+	ir.min_time = sum.min_time;
+	ir.max_time = sum.max_time;
+	w->index[w->index_len++] = ir;
+	w->next += padding + raw_bytes;
+
+	/* following records go in a new block. */
+	writer_reinit_block_writer(w, typ);
+	strbuf_addbuf(&w->last_key, &b->idx.last_key);
+	err = 0;
+
+done:
+	reftable_block_done(&br.block);
+	reftable_block_done(&raw);
+	reftable_free(sum.objs);
+	return err;
+}
+
+int writer_copy_ref_sections(struct reftable_writer *w,
+			     struct reftable_reader *r)
+{
+	uint64_t end = r->log_offsets.is_present ? r->log_offsets.offset :
+						   r->size;
+	uint64_t off = 0;
+	int err = 0;
+
+	if (w->next != 0 || w->last_key.len > 0)
+		return REFTABLE_API_ERROR;
+	/* the copied blocks must be readable with the footer we write, and a
+	 * table without refs has its header in the first log block. */
+	if (r->block_size != w->opts.block_size ||
+	    r->hash_id != w->opts.hash_id || !r->ref_offsets.is_present)
+		return 1;
+
+	reftable_writer_set_limits(w, r->min_update_index,
+				   r->max_update_index);
+	while (off < end) {
+		struct reftable_block block = { NULL };
+		uint32_t sz = WRITER_BUFFER_SIZE;
+		if (end - off < sz)
+			sz = end - off;
+		err = block_source_read_block(&r->source, &block, off, sz);
+		if (err != sz) {
+			reftable_block_done(&block);
+			return REFTABLE_IO_ERROR;
+		}
+		err = padded_write(w, block.data, sz, 0);
+		reftable_block_done(&block);
+		if (err < 0)
+			return err;
+		off += sz;
+	}
+	w->next = end;
+
+	/* the sections keep their offsets, so the footer can point at them. */
+	w->stats.ref_stats.index_offset = r->ref_offsets.index_offset;
+	w->stats.obj_stats.offset = r->obj_offsets.offset;
+	w->stats.obj_stats.index_offset = r->obj_offsets.index_offset;
+	w->stats.object_id_len = r->object_id_len;
+	w->opts.full_width_obj_index = r->obj_full_width;
 	w->block_writer = NULL;
 	return 0;
 }
@@ -564,7 +1021,11 @@ int reftable_writer_close(struct reftable_writer *w)
 	p += writer_write_header(w, footer);
 	put_be64(p, w->stats.ref_stats.index_offset);
 	p += 8;
-	put_be64(p, (w->stats.obj_stats.offset) << 5 | w->stats.object_id_len);
+	/* an object_id_len of 0 marks a full-width index. */
+	put_be64(p, (w->stats.obj_stats.offset) << 5 |
+			    (w->opts.full_width_obj_index ?
+				     0 :
+				     w->stats.object_id_len));
 	p += 8;
 	put_be64(p, w->stats.obj_stats.index_offset);
 	p += 8;
@@ -581,16 +1042,20 @@ int reftable_writer_close(struct reftable_writer *w)
 	if (err < 0)
 		goto done;
 
+	err = writer_flush_output(w);
+	if (err < 0)
+		goto done;
+
 	if (empty_table) {
 		err = REFTABLE_EMPTY_TABLE_ERROR;
 		goto done;
 	}
 
 done:
-	/* free up memory. */
-	block_writer_release(&w->block_writer_data);
+	/* storage is kept for reftable_writer_reset, and released by
+	 * reftable_writer_free. */
 	writer_clear_index(w);
-	strbuf_release(&w->last_key);
+	strbuf_reset(&w->last_key);
 	return err;
 }
 
@@ -600,10 +1065,7 @@ static void writer_clear_index(struct reftable_writer *w)
 	for (i = 0; i < w->index_len; i++) {
 		strbuf_release(&w->index[i].last_key);
 	}
-
-	FREE_AND_NULL(w->index);
 	w->index_len = 0;
-	w->index_cap = 0;
 }
 
 static const int debug = 0;
@@ -614,14 +1076,20 @@ static int writer_flush_nonempty_block(struct reftable_writer *w)
 	struct reftable_block_stats *bstats =
 		writer_reftable_block_stats(w, typ);
 	uint64_t block_typ_off = (bstats->blocks == 0) ? w->next : 0;
-	int raw_bytes = block_writer_finish(w->block_writer);
+	int raw_bytes = 0;
 	int padding = 0;
 	int err = 0;
 	struct reftable_index_record ir = { .last_key = STRBUF_INIT };
+
+	writer_update_key_stats(w);
+	raw_bytes = block_writer_finish(w->block_writer);
 	if (raw_bytes < 0)
 		return raw_bytes;
 
-	if (!w->opts.unpadded && typ != BLOCK_TYPE_LOG) {
+	/* Only blocks of the table's block size are padded; smaller ones
+	 * wouldn't be aligned anyway. */
+	if (!w->opts.unpadded && typ != BLOCK_TYPE_LOG &&
+	    writer_block_size(w, typ) == w->opts.block_size) {
 		padding = w->opts.block_size - raw_bytes;
 	}
 
@@ -658,6 +1126,9 @@ static int writer_flush_nonempty_block(struct reftable_writer *w)
 	ir.offset = w->next;
 	strbuf_reset(&ir.last_key);
 	strbuf_addbuf(&ir.last_key, &w->block_writer->last_key);
+	ir.has_time = w->block_has_time;
+	ir.min_time = w->block_min_time;
+	ir.max_time = w->block_max_time;
 	w->index[w->index_len] = ir;
 
 	w->index_len++;
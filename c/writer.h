@@ -11,13 +11,40 @@ https://developers.google.com/open-source/licenses/bsd
 
 #include "basics.h"
 #include "block.h"
-#include "tree.h"
+#include "obj_index.h"
 #include "reftable-writer.h"
 
+struct writer_key_stats {
+	uint8_t typ;
+	uint64_t entries;
+	/* encoded size of the entries. */
+	uint64_t bytes;
+	uint64_t shared_prefix_bytes;
+};
+
+/* the names of the refs written to a table, in order. */
+struct writer_names {
+	/* the names, each NUL-terminated. */
+	struct strbuf buf;
+
+	/* offsets into buf of the refs that are set, and of the deletions. */
+	size_t *add;
+	size_t add_len;
+	size_t add_cap;
+	size_t *del;
+	size_t del_len;
+	size_t del_cap;
+};
+
 struct reftable_writer {
 	int (*write)(void *, const void *, size_t);
 	void *write_arg;
 	int pending_padding;
+
+	/* output not yet passed to `write`. */
+	uint8_t *out;
+	size_t out_len;
+
 	struct strbuf last_key;
 
 	/* offset of next block to write. */
@@ -34,17 +61,64 @@ struct reftable_writer {
 
 	struct block_writer block_writer_data;
 
+	/* for log_time_index: whether the current block has log times, and
+	 * their range. */
+	int block_has_time;
+	uint64_t block_min_time;
+	uint64_t block_max_time;
+
+	/* for adaptive_restart_interval: the blocks written so far in the
+	 * current section. */
+	struct writer_key_stats key_stats;
+
 	/* pending index records for the current section */
 	struct reftable_index_record *index;
 	size_t index_len;
 	size_t index_cap;
 
-	/*
-	 * tree for use with tsearch; used to populate the 'o' inverse OID
-	 * map */
-	struct tree_node *obj_index_tree;
+	/* object IDs with their ref block offsets; used to populate the 'o'
+	 * inverse OID map. */
+	struct obj_index obj_index;
 
 	struct reftable_stats stats;
+
+	/* boolean: record the names of added refs in `names`, so name
+	 * conflicts can be checked without reading back the table. Cleared by
+	 * reftable_writer_reset. */
+	int record_names;
+	struct writer_names names;
 };
 
+struct reftable_reader;
+
+/* Copies the ref and obj sections of `r` verbatim to the start of the table
+ * being written by `w`, and sets its update index limits to those of `r`.
+ * Only a log section can be added afterwards. Returns 1 if the sections can't
+ * be copied because `r` was written with a different block size or hash, or
+ * has no refs. */
+int writer_copy_ref_sections(struct reftable_writer *w,
+			     struct reftable_reader *r);
+
+/* a ref or log block to copy, as found in the index of its table. */
+struct writer_block {
+	struct reftable_reader *r;
+	/* the block's offset and last key. */
+	struct reftable_index_record idx;
+	/* the size of the block in the file, including padding. */
+	uint64_t len;
+	/* the last key of the preceding block of `r`; empty for the first
+	 * block of a section. */
+	struct strbuf start_key;
+};
+
+/* Appends the ref or log block `b` verbatim. Its records are decoded for the
+ * stats and the obj section, but not re-encoded. The records written before
+ * must sort at or before `b->start_key`. Returns 1 if the block can't be
+ * copied, and its records should be added one by one instead: it is in
+ * another format, less than half full, holds deletions and
+ * `drop_deletions` is set, or it is (or would become) the first block in a
+ * table but the other isn't. */
+int writer_add_block(struct reftable_writer *w, struct writer_block *b,
+		     int drop_deletions);
+
 #endif